@@ -0,0 +1,288 @@
+/**
+@file backpressure.h
+@author Gary Heckman
+@brief Enforces the limits on a session's write queue.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include <boost/asio.hpp>
+
+#include "comm_options.h"
+#include "frame.h"
+
+namespace boost_messaging
+{
+    namespace detail
+    {
+        /**
+        Tracks the frames queued on a session against its write_queue_limits.
+        Writers ask for admission on their own thread; everything else runs on the session's executor.
+        A session that reaches a limit stays backpressured until it drains to the low watermark.
+        Costs nothing when the queue is unbounded.
+        */
+        class write_limiter
+        {
+        public:
+            enum admission
+            {
+                admitted,
+                refused,
+                disconnect
+            };
+
+            /**
+            Constructor.
+            @param [in] limits Limits of the session's write queue
+            @param [in] id     Id of the session, passed to the callback
+            */
+            write_limiter(const write_queue_limits& limits, session_id_t id) :
+                limits_(limits),
+                id_(id),
+                bounded_(limits.max_bytes != 0 || limits.max_messages != 0),
+                low_bytes_(limits.low_watermark_bytes ? limits.low_watermark_bytes : limits.max_bytes / 2),
+                low_messages_(limits.low_watermark_messages ? limits.low_watermark_messages : limits.max_messages / 2),
+                bytes_(0),
+                messages_(0),
+                backpressured_(false),
+                shut_down_(false)
+            { }
+
+            overflow_policy policy() const { return limits_.policy; }
+
+            bool backpressured() const { return backpressured_.load(); }
+
+            /**
+            Decides whether a new message may be queued.
+            Blocks under the block policy.
+            @return admitted if the message is queued, disconnect if the session must be closed
+            */
+            admission admit()
+            {
+                if (!bounded_)
+                    return admitted;
+                if (shut_down_.load())
+                    return refused;
+
+                check_high_watermark();
+                if (backpressured_.load())
+                {
+                    switch (limits_.policy)
+                    {
+                    case overflow_policy::reject:
+                        return refused;
+                    case overflow_policy::drop_newest:
+                        notify(backpressure_event::dropped);
+                        return refused;
+                    case overflow_policy::disconnect:
+                        shut_down();
+                        notify(backpressure_event::disconnected);
+                        return disconnect;
+                    case overflow_policy::block:
+                    {
+                        std::unique_lock<std::mutex> lock(mutex_);
+                        drained_.wait(lock, [this] { return !backpressured_.load() || shut_down_.load(); });
+                        if (shut_down_.load())
+                            return refused;
+                        break;
+                    }
+                    default:
+                        break;
+                    }
+                }
+
+                messages_.fetch_add(1);
+                return admitted;
+            }
+
+            /**
+            Counts a message that is queued whatever the limits, like one accepted before the session existed.
+            @return admitted
+            */
+            admission admit_anyway()
+            {
+                if (bounded_)
+                    messages_.fetch_add(1);
+                return admitted;
+            }
+
+            /**
+            Counts an admitted message once it is in the queue.
+            @param [in] bytes Bytes the message takes in the queue
+            */
+            void queued(size_t bytes)
+            {
+                if (!bounded_)
+                    return;
+
+                bytes_.fetch_add(bytes);
+                check_high_watermark();
+            }
+
+            /**
+            Counts a frame leaving the queue, whether it was written or dropped.
+            @param [in] bytes    Bytes the frame took in the queue
+            @param [in] messages Messages the frame finished; 0 for every fragment of a message but the last
+            */
+            void dequeued(size_t bytes, size_t messages = 1)
+            {
+                if (!bounded_)
+                    return;
+
+                bytes_.fetch_sub(bytes);
+                messages_.fetch_sub(messages);
+                check_low_watermark();
+            }
+
+            /**
+            Counts a message the session dropped to make room.
+            @param [in] bytes Bytes the message took in the queue
+            */
+            void dropped(size_t bytes)
+            {
+                dequeued(bytes);
+                notify(backpressure_event::dropped);
+            }
+
+            /**
+            Counts an admitted message that was thrown away before it was queued, like one too large to send.
+            */
+            void rejected()
+            {
+                if (bounded_)
+                {
+                    messages_.fetch_sub(1);
+                    check_low_watermark();
+                }
+                notify(backpressure_event::dropped);
+            }
+
+            /**
+            Counts a frame that took the place of a queued one.
+            @param [in] old_bytes Bytes of the frame that was replaced
+            @param [in] new_bytes Bytes of the frame that replaced it
+            */
+            void replaced(size_t old_bytes, size_t new_bytes)
+            {
+                if (!bounded_)
+                    return;
+
+                bytes_.fetch_add(new_bytes);
+                bytes_.fetch_sub(old_bytes);
+                messages_.fetch_sub(1);
+                check_low_watermark();
+            }
+
+            /**
+            Checks whether the queue is past a limit and frames should be dropped.
+            @return True if the queue holds more than a limit allows
+            */
+            bool over_limit() const
+            {
+                return (limits_.max_bytes != 0 && bytes_.load() > limits_.max_bytes) ||
+                    (limits_.max_messages != 0 && messages_.load() > limits_.max_messages);
+            }
+
+            /**
+            Computes the conflation key of a frame.
+            @param [in] queued      Frame to compute the key of
+            @param [in] header_size Size of the serializer's header
+            @param [out] key        Key of the frame
+            @return False if there is no key function or the frame's payload isn't contiguous
+            */
+            bool key(const frame& queued, size_t header_size, uint64_t& key) const
+            {
+                const char* begin;
+                const char* end;
+                if (!limits_.conflation_key || !frame_payload(queued, header_size, begin, end))
+                    return false;
+
+                key = limits_.conflation_key(begin, end);
+                return true;
+            }
+
+            /**
+            Refuses every later write and wakes up blocked writers.
+            */
+            void shut_down()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    shut_down_.store(true);
+                }
+                drained_.notify_all();
+            }
+
+        private:
+            write_queue_limits limits_;
+            session_id_t id_;
+            bool bounded_;
+            size_t low_bytes_;
+            size_t low_messages_;
+            std::atomic<size_t> bytes_;
+            std::atomic<size_t> messages_;
+            std::atomic<bool> backpressured_;
+            std::atomic<bool> shut_down_;
+            std::mutex mutex_;
+            std::condition_variable drained_;
+
+            void check_high_watermark()
+            {
+                auto at_high = (limits_.max_bytes != 0 && bytes_.load() >= limits_.max_bytes) ||
+                    (limits_.max_messages != 0 && messages_.load() >= limits_.max_messages);
+                if (at_high && !backpressured_.exchange(true))
+                    notify(backpressure_event::high_watermark);
+            }
+
+            void check_low_watermark()
+            {
+                auto at_low = (limits_.max_bytes == 0 || bytes_.load() <= low_bytes_) &&
+                    (limits_.max_messages == 0 || messages_.load() <= low_messages_);
+                if (!at_low || !backpressured_.load())
+                    return;
+
+                bool was_backpressured;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    was_backpressured = backpressured_.exchange(false);
+                }
+                if (was_backpressured)
+                {
+                    drained_.notify_all();
+                    notify(backpressure_event::low_watermark);
+                }
+            }
+
+            void notify(backpressure_event event)
+            {
+                if (limits_.callback)
+                    limits_.callback(id_, event);
+            }
+
+            // Finds the bytes after the header when they are in one piece.
+            static bool frame_payload(const frame& queued, size_t header_size, const char*& begin, const char*& end)
+            {
+                auto body = static_cast<const char*>(queued.body.data());
+                auto body_size = boost::asio::buffer_size(queued.body);
+                if (body_size == 0 && queued.data.size() >= header_size)
+                {
+                    begin = queued.data.data() + header_size;
+                    end = queued.data.data() + queued.data.size();
+                }
+                else if (queued.data.size() <= header_size && queued.data.size() + body_size >= header_size)
+                {
+                    begin = body + (header_size - queued.data.size());
+                    end = body + body_size;
+                }
+                else
+                    return false;
+                return true;
+            }
+        };
+    }
+}
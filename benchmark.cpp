@@ -0,0 +1,509 @@
+/**
+@author Gary Heckman
+@file benchmark.cpp
+@brief Loopback throughput and latency benchmark
+@detail
+	Runs a server and clients over tcp and udp loopback, a unix domain socket
+	and shared memory in one process and reports messages/s, bytes/s and
+	round trip latency for every combination of message size, connection
+	count and io thread count.
+
+	Every client keeps a window of messages in flight. The server's handler
+	echoes each message back to the client that sent it, and the client's
+	handler times the round trip from the timestamp in the message.
+
+	Build on Linux with
+		g++ -std=c++14 -O2 -I<boost> benchmark.cpp -o benchmark -lpthread
+	Run with --help for the options. --csv prints one line per run so results
+	can be compared between builds.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "client.h"
+#include "server.h"
+#include "string_serializer.h"
+
+using namespace boost::asio;
+using namespace boost_messaging;
+
+namespace
+{
+	typedef std::chrono::steady_clock bench_clock;
+
+	// Payload layout: send time (8) | client port (2) | client index (2) | filler
+	const size_t STAMP_SIZE = 12;
+	// Largest message udp can split into fragments, with the serializer's header
+	const size_t MAX_UDP_MESSAGE = boost_messaging::detail::max_fragmented_size(boost_messaging::detail::DEFAULT_UDP_MTU) - sizeof(uint32_t);
+
+	struct settings
+	{
+		std::vector<std::string> protocols{ "tcp", "udp", "local", "shm" };
+		std::vector<size_t> sizes{ 64, 512, 4096, 65536 };
+		std::vector<size_t> connections{ 1, 4, 16 };
+		std::vector<size_t> threads{ 1, 2, 4 };
+		double seconds = 2.0;
+		int64_t window = 32;
+		bool csv = false;
+	};
+
+	struct result
+	{
+		std::string protocol;
+		size_t size;
+		size_t connections;
+		size_t threads;
+		uint64_t messages;
+		uint64_t lost;
+		double elapsed;
+		uint64_t p50;
+		uint64_t p99;
+		uint64_t p999;
+	};
+
+	/**
+	Round trip bookkeeping for one client.
+	The samples are only touched by the client's handler until the io threads are stopped.
+	*/
+	struct client_stats
+	{
+		std::atomic<int64_t> in_flight{ 0 };
+		std::atomic<uint64_t> received{ 0 };
+		std::atomic<int64_t> last_receive{ 0 };
+		std::vector<uint64_t> samples;
+	};
+
+	std::vector<std::unique_ptr<client_stats>> stats;
+	std::atomic<bool> recording{ false };
+
+	int64_t now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now().time_since_epoch()).count();
+	}
+
+	std::string make_message(size_t size, uint16_t port, uint16_t index)
+	{
+		std::string message(size, 'x');
+		auto sent = now_ns();
+		std::memcpy(&message[0], &sent, sizeof(sent));
+		std::memcpy(&message[8], &port, sizeof(port));
+		std::memcpy(&message[10], &index, sizeof(index));
+		return message;
+	}
+
+	/**
+	Server side handler that sends every message back on the session it came in on.
+	*/
+	struct session_echo_handler
+	{
+		session_writer<std::string> session;
+
+		void attach(const session_writer<std::string>& writer)
+		{
+			session = writer;
+		}
+
+		void handle(const std::string& message)
+		{
+			session.write(message);
+		}
+	};
+
+	/**
+	Server side handler that sends every udp message back to the port in the message.
+	The server is reached through a static since handlers are built by each session.
+	*/
+	struct datagram_echo_handler
+	{
+		static std::function<void(const std::string&, const ip::udp::endpoint&)> echo;
+
+		void handle(const std::string& message)
+		{
+			uint16_t port;
+			std::memcpy(&port, &message[8], sizeof(port));
+			echo(message, ip::udp::endpoint(ip::address_v4::loopback(), port));
+		}
+	};
+
+	std::function<void(const std::string&, const ip::udp::endpoint&)> datagram_echo_handler::echo;
+
+	/**
+	Echoes on each session's own connection.
+	*/
+	struct session_bench_protocol
+	{
+		typedef session_echo_handler echo_handler;
+
+		/**
+		Port the echo is sent back to, zero while the client isn't connected.
+		Sessions echo on their own connection, so any other value does; the
+		messages are kept until the client connects.
+		*/
+		template <typename TClient>
+		static uint16_t reply_port(const TClient&) { return 1; }
+
+		template <typename TServer>
+		static void install_echo(TServer&) { }
+
+		static void configure(comm_options&) { }
+	};
+
+	/**
+	Where the server listens and how the clients reach it over loopback.
+	@tparam TProtocol Either boost::asio::ip::tcp or boost::asio::ip::udp
+	*/
+	template <typename TProtocol>
+	struct ip_bench_protocol : session_bench_protocol
+	{
+		static typename TProtocol::endpoint server_endpoint()
+		{
+			return typename TProtocol::endpoint(ip::address_v4::loopback(), 0);
+		}
+
+		static std::string host(const typename TProtocol::endpoint&) { return "127.0.0.1"; }
+		static std::string port(const typename TProtocol::endpoint& endpoint) { return std::to_string(endpoint.port()); }
+		static void remove(const typename TProtocol::endpoint&) { }
+	};
+
+	template <typename TProtocol>
+	struct bench_protocol : ip_bench_protocol<TProtocol> { };
+
+	/**
+	Echoes to the port in each message, since udp sessions aren't connections.
+	*/
+	template <>
+	struct bench_protocol<ip::udp> : ip_bench_protocol<ip::udp>
+	{
+		typedef datagram_echo_handler echo_handler;
+
+		// The port shows up as soon as the socket connects, a little before the client's connect handler runs
+		template <typename TClient>
+		static uint16_t reply_port(const TClient& client) { return client.local_endpoint().port(); }
+
+		template <typename TServer>
+		static void install_echo(TServer& server)
+		{
+			datagram_echo_handler::echo = [&server](const std::string& message, const ip::udp::endpoint& endpoint)
+			{
+				server.write(message, endpoint);
+			};
+		}
+
+		// Messages bigger than a datagram are split into fragments, small ones are packed together
+		static void configure(comm_options& options)
+		{
+			options.udp_fragmentation = true;
+			options.udp_mtu = boost_messaging::detail::DEFAULT_UDP_MTU;
+		}
+	};
+
+	/**
+	Protocols whose server listens on a socket path, which is made in /tmp for each run.
+	The server doesn't remove its path, so this does before and after.
+	@tparam TProtocol Either boost::asio::local::stream_protocol or shared_memory_protocol
+	*/
+	template <typename TProtocol>
+	struct path_bench_protocol : session_bench_protocol
+	{
+		static typename TProtocol::endpoint server_endpoint()
+		{
+			auto path = "/tmp/boost_messaging_bench_" + std::to_string(::getpid());
+			::unlink(path.c_str());
+			return typename TProtocol::endpoint(path);
+		}
+
+		static std::string host(const typename TProtocol::endpoint& endpoint) { return endpoint.path(); }
+		static std::string port(const typename TProtocol::endpoint&) { return std::string(); }
+		static void remove(const typename TProtocol::endpoint& endpoint) { ::unlink(endpoint.path().c_str()); }
+	};
+
+	template <>
+	struct bench_protocol<local::stream_protocol> : path_bench_protocol<local::stream_protocol> { };
+
+	template <>
+	struct bench_protocol<shared_memory_protocol> : path_bench_protocol<shared_memory_protocol> { };
+
+	/**
+	Client side handler that times each echoed message.
+	*/
+	struct rtt_handler
+	{
+		void handle(const std::string& message)
+		{
+			int64_t sent;
+			uint16_t index;
+			std::memcpy(&sent, &message[0], sizeof(sent));
+			std::memcpy(&index, &message[10], sizeof(index));
+
+			auto now = now_ns();
+			auto& client = *stats[index];
+			if (recording)
+				client.samples.push_back(static_cast<uint64_t>(now - sent));
+			client.received.fetch_add(1, std::memory_order_relaxed);
+			client.in_flight.fetch_sub(1, std::memory_order_relaxed);
+			client.last_receive.store(now, std::memory_order_relaxed);
+		}
+	};
+
+	template <typename TProtocol, typename TThreading>
+	result run(const std::string& name, size_t size, size_t connections, size_t threads, const settings& config)
+	{
+		typedef bench_protocol<TProtocol> bench_t;
+		typedef server<TProtocol, string_serializer, typename bench_t::echo_handler, TThreading> server_t;
+		typedef client<TProtocol, string_serializer, rtt_handler, TThreading> client_t;
+
+		result outcome{ name, size, connections, threads, 0, 0, 0.0, 0, 0, 0 };
+
+		stats.clear();
+		for (size_t i = 0; i < connections; ++i)
+			stats.emplace_back(new client_stats());
+
+		io_service io_service;
+		std::unique_ptr<io_service::work> work(new io_service::work(io_service));
+		std::vector<std::thread> io_threads;
+		for (size_t i = 0; i < threads; ++i)
+			io_threads.emplace_back([&] { io_service.run(); });
+
+		{
+			comm_options options;
+			options.write_limits.max_messages = static_cast<size_t>(config.window) * 4;
+			bench_t::configure(options);
+
+			server_t echo_server(io_service, bench_t::server_endpoint(), options);
+			auto endpoint = echo_server.local_endpoint();
+			bench_t::install_echo(echo_server);
+
+			std::vector<std::unique_ptr<client_t>> clients;
+			std::vector<uint16_t> ports(connections, 0);
+			for (size_t i = 0; i < connections; ++i)
+				clients.emplace_back(new client_t(io_service, bench_t::host(endpoint), bench_t::port(endpoint), options));
+
+			auto give_up = bench_clock::now() + std::chrono::seconds(5);
+			for (size_t i = 0; i < connections && bench_clock::now() < give_up; ++i)
+			{
+				while ((ports[i] = bench_t::reply_port(*clients[i])) == 0 && bench_clock::now() < give_up)
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+			// Warm up: wait until every client has had a message echoed back
+			for (size_t i = 0; i < connections && bench_clock::now() < give_up; ++i)
+			{
+				while (ports[i] != 0 && stats[i]->received == 0 && bench_clock::now() < give_up)
+				{
+					clients[i]->write(make_message(size, ports[i], static_cast<uint16_t>(i)));
+					std::this_thread::sleep_for(std::chrono::milliseconds(20));
+				}
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			for (auto& client : stats)
+			{
+				client->in_flight = 0;
+				client->received = 0;
+				client->last_receive = now_ns();
+			}
+
+			// Keeps every client's window full until time runs out
+			recording = true;
+			auto start = bench_clock::now();
+			auto stop = start + std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(config.seconds));
+			// Messages that haven't come back by then are counted as lost and the window is reopened
+			const int64_t lost_after = 200000000;
+			while (bench_clock::now() < stop)
+			{
+				bool sent = false;
+				for (size_t i = 0; i < connections; ++i)
+				{
+					auto& client = *stats[i];
+					if (ports[i] == 0)
+						continue;
+
+					auto in_flight = client.in_flight.load(std::memory_order_relaxed);
+					if (in_flight > 0 && now_ns() - client.last_receive.load(std::memory_order_relaxed) > lost_after)
+					{
+						outcome.lost += in_flight;
+						client.in_flight -= in_flight;
+						client.last_receive = now_ns();
+					}
+
+					for (; client.in_flight.load(std::memory_order_relaxed) < config.window; sent = true)
+					{
+						client.in_flight.fetch_add(1, std::memory_order_relaxed);
+						if (!clients[i]->write(make_message(size, ports[i], static_cast<uint16_t>(i))))
+						{
+							client.in_flight.fetch_sub(1, std::memory_order_relaxed);
+							break;
+						}
+					}
+				}
+
+				if (!sent)
+					std::this_thread::yield();
+			}
+			outcome.elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+			recording = false;
+
+			for (auto& client : stats)
+				outcome.messages += client->received;
+
+			work.reset();
+			io_service.stop();
+			for (auto& thread : io_threads)
+				thread.join();
+			bench_t::remove(endpoint);
+		}
+
+		std::vector<uint64_t> samples;
+		for (auto& client : stats)
+			samples.insert(samples.end(), client->samples.begin(), client->samples.end());
+
+		auto percentile = [&samples](double fraction) -> uint64_t
+		{
+			if (samples.empty())
+				return 0;
+			auto nth = samples.begin() + static_cast<ptrdiff_t>(fraction * (samples.size() - 1));
+			std::nth_element(samples.begin(), nth, samples.end());
+			return *nth;
+		};
+		outcome.p50 = percentile(0.5);
+		outcome.p99 = percentile(0.99);
+		outcome.p999 = percentile(0.999);
+		return outcome;
+	}
+
+	void print(const result& outcome, bool csv)
+	{
+		double rate = outcome.elapsed > 0 ? outcome.messages / outcome.elapsed : 0.0;
+		if (csv)
+		{
+			std::cout << outcome.protocol << ',' << outcome.size << ',' << outcome.connections << ',' << outcome.threads << ','
+				<< static_cast<uint64_t>(rate) << ',' << static_cast<uint64_t>(rate * outcome.size) << ','
+				<< outcome.p50 << ',' << outcome.p99 << ',' << outcome.p999 << ',' << outcome.lost << std::endl;
+			return;
+		}
+
+		std::cout << std::left << std::setw(6) << outcome.protocol << std::right
+			<< std::setw(8) << outcome.size
+			<< std::setw(7) << outcome.connections
+			<< std::setw(9) << outcome.threads
+			<< std::setw(13) << static_cast<uint64_t>(rate)
+			<< std::setw(11) << std::fixed << std::setprecision(1) << rate * outcome.size / (1024 * 1024)
+			<< std::setw(10) << std::setprecision(1) << outcome.p50 / 1000.0
+			<< std::setw(10) << outcome.p99 / 1000.0
+			<< std::setw(10) << outcome.p999 / 1000.0
+			<< std::setw(8) << outcome.lost << std::endl;
+	}
+
+	template <typename T>
+	std::vector<T> parse_list(const std::string& text, std::function<T(const std::string&)> convert)
+	{
+		std::vector<T> values;
+		std::stringstream stream(text);
+		std::string item;
+		while (std::getline(stream, item, ','))
+			values.push_back(convert(item));
+		return values;
+	}
+
+	void usage()
+	{
+		std::cout <<
+			"usage: benchmark [options]\n"
+			"  --protocols tcp,udp,... protocols to run: tcp, udp, local and shm\n"
+			"  --sizes 64,512,...      message sizes in bytes\n"
+			"  --connections 1,4,...   number of clients\n"
+			"  --threads 1,2,...       number of io threads\n"
+			"  --seconds 2             length of each run\n"
+			"  --window 32             messages each client keeps in flight\n"
+			"  --csv                   print comma separated results\n";
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	settings config;
+	auto to_size = [](const std::string& text) { return static_cast<size_t>(std::stoul(text)); };
+	auto to_string = [](const std::string& text) { return text; };
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string option = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (option == "--protocols" && has_value)
+			config.protocols = parse_list<std::string>(argv[++i], to_string);
+		else if (option == "--sizes" && has_value)
+			config.sizes = parse_list<size_t>(argv[++i], to_size);
+		else if (option == "--connections" && has_value)
+			config.connections = parse_list<size_t>(argv[++i], to_size);
+		else if (option == "--threads" && has_value)
+			config.threads = parse_list<size_t>(argv[++i], to_size);
+		else if (option == "--seconds" && has_value)
+			config.seconds = std::stod(argv[++i]);
+		else if (option == "--window" && has_value)
+			config.window = std::stoll(argv[++i]);
+		else if (option == "--csv")
+			config.csv = true;
+		else
+		{
+			usage();
+			return option == "--help" ? 0 : 1;
+		}
+	}
+
+	if (config.csv)
+		std::cout << "protocol,size,connections,threads,messages_per_s,bytes_per_s,p50_ns,p99_ns,p999_ns,lost" << std::endl;
+	else
+		std::cout << "proto     size  conns  threads        msg/s      MiB/s   p50(us)   p99(us) p99.9(us)    lost" << std::endl;
+
+	for (auto& protocol : config.protocols)
+	{
+		for (auto size : config.sizes)
+		{
+			if (size < STAMP_SIZE || (protocol == "udp" && size > MAX_UDP_MESSAGE))
+			{
+				std::cerr << "skipping " << protocol << " with " << size << " byte messages" << std::endl;
+				continue;
+			}
+
+			for (auto connections : config.connections)
+			{
+				for (auto threads : config.threads)
+				{
+					if (protocol == "tcp")
+						print(threads > 1
+							? run<ip::tcp, multi_threaded>(protocol, size, connections, threads, config)
+							: run<ip::tcp, single_threaded>(protocol, size, connections, threads, config), config.csv);
+					else if (protocol == "udp")
+						print(threads > 1
+							? run<ip::udp, multi_threaded>(protocol, size, connections, threads, config)
+							: run<ip::udp, single_threaded>(protocol, size, connections, threads, config), config.csv);
+					else if (protocol == "local")
+						print(threads > 1
+							? run<local::stream_protocol, multi_threaded>(protocol, size, connections, threads, config)
+							: run<local::stream_protocol, single_threaded>(protocol, size, connections, threads, config), config.csv);
+					else if (protocol == "shm")
+						print(threads > 1
+							? run<shared_memory_protocol, multi_threaded>(protocol, size, connections, threads, config)
+							: run<shared_memory_protocol, single_threaded>(protocol, size, connections, threads, config), config.csv);
+					else
+						std::cerr << "unknown protocol " << protocol << std::endl;
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,189 @@
+/**
+@file buffer_pool.h
+@author Gary Heckman
+@brief Pool of reusable byte buffers shared between sessions.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace boost_messaging
+{
+    /**
+    Counters describing how well a buffer pool fits its workload.
+    A high miss count means the pool is too small for the traffic.
+    A high discard count means buffers come back faster than they are needed.
+    */
+    struct buffer_pool_stats
+    {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t releases = 0;
+        size_t discards = 0;
+    };
+
+    /**
+    Pool of byte buffers sorted into power of two size classes.
+    Sessions take buffers for serialized frames and read buffers from the pool and give them back when done.
+    Once the pool has warmed up, steady state messaging doesn't allocate.
+    Safe to use from multiple threads.
+    */
+    class buffer_pool
+    {
+    public:
+        static constexpr size_t MIN_CLASS_BITS = 6;
+        static constexpr size_t MAX_CLASS_BITS = 20;
+
+        /**
+        Constructor.
+        @param [in] max_buffers_per_class Number of idle buffers kept for each size class
+        */
+        explicit buffer_pool(size_t max_buffers_per_class = 256) :
+            max_buffers_per_class_(max_buffers_per_class),
+            classes_(MAX_CLASS_BITS - MIN_CLASS_BITS + 1)
+        { }
+
+        /**
+        Gets the pool shared by every session on an io_service.
+        @param [in, out] io_service The io_service that owns the pool
+        @return Pool for the io_service
+        */
+        static std::shared_ptr<buffer_pool> shared(boost::asio::io_service& io_service);
+
+        /**
+        Takes a buffer from the pool, or allocates one if the pool has none that fit.
+        @param [in] size Size of the buffer
+        @return Buffer resized to size
+        */
+        std::vector<char> acquire(size_t size)
+        {
+            auto class_bits = ceil_bits(size);
+            std::vector<char> buffer;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (class_bits <= MAX_CLASS_BITS && !classes_[class_bits - MIN_CLASS_BITS].empty())
+                {
+                    auto& free_list = classes_[class_bits - MIN_CLASS_BITS];
+                    buffer = std::move(free_list.back());
+                    free_list.pop_back();
+                    ++stats_.hits;
+                }
+                else
+                    ++stats_.misses;
+            }
+
+            // Round new buffers up to their size class so they can be pooled later
+            if (buffer.capacity() == 0 && class_bits <= MAX_CLASS_BITS)
+                buffer.reserve(size_t(1) << class_bits);
+            buffer.resize(size);
+            return buffer;
+        }
+
+        /**
+        Gives a buffer back to the pool.
+        Buffers that are too small, too big, or don't fit in a full size class are freed.
+        @param [in] buffer Buffer that is no longer used
+        */
+        void release(std::vector<char> buffer)
+        {
+            if (buffer.capacity() == 0)
+                return;
+
+            auto class_bits = floor_bits(buffer.capacity());
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stats_.releases;
+
+            if (class_bits < MIN_CLASS_BITS || class_bits > MAX_CLASS_BITS)
+            {
+                ++stats_.discards;
+                return;
+            }
+
+            auto& free_list = classes_[class_bits - MIN_CLASS_BITS];
+            if (free_list.size() >= max_buffers_per_class_)
+            {
+                ++stats_.discards;
+                return;
+            }
+
+            buffer.clear();
+            free_list.push_back(std::move(buffer));
+        }
+
+        /**
+        Gets a snapshot of the pool's counters.
+        @return Hit, miss, release and discard counts since the pool was made
+        */
+        buffer_pool_stats stats() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return stats_;
+        }
+
+    private:
+        size_t max_buffers_per_class_;
+        std::vector<std::vector<std::vector<char>>> classes_;
+        buffer_pool_stats stats_;
+        mutable std::mutex mutex_;
+
+        // Smallest class that holds size bytes
+        static size_t ceil_bits(size_t size)
+        {
+            size_t bits = MIN_CLASS_BITS;
+            while (bits <= MAX_CLASS_BITS && (size_t(1) << bits) < size)
+                ++bits;
+            return bits;
+        }
+
+        // Largest class that fits in capacity bytes
+        static size_t floor_bits(size_t capacity)
+        {
+            size_t bits = 0;
+            while (bits <= MAX_CLASS_BITS && (size_t(2) << bits) <= capacity)
+                ++bits;
+            return bits;
+        }
+    };
+
+    namespace detail
+    {
+        /**
+        Keeps one buffer pool per io_service.
+        A template only so the service id can be defined in this header.
+        */
+        template <typename T = void>
+        class basic_buffer_pool_service : public boost::asio::io_service::service
+        {
+        public:
+            static boost::asio::io_service::id id;
+
+            explicit basic_buffer_pool_service(boost::asio::io_service& io_service) :
+                boost::asio::io_service::service(io_service),
+                pool_(std::make_shared<buffer_pool>())
+            { }
+
+            std::shared_ptr<buffer_pool> pool() const { return pool_; }
+
+        private:
+            std::shared_ptr<buffer_pool> pool_;
+        };
+
+        template <typename T>
+        boost::asio::io_service::id basic_buffer_pool_service<T>::id;
+
+        typedef basic_buffer_pool_service<> buffer_pool_service;
+    }
+
+    inline std::shared_ptr<buffer_pool> buffer_pool::shared(boost::asio::io_service& io_service)
+    {
+        return boost::asio::use_service<detail::buffer_pool_service>(io_service).pool();
+    }
+}
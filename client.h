@@ -6,13 +6,28 @@
 
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
-#include <boost\asio.hpp>
-#include <boost\system\error_code.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/optional.hpp>
+#include <boost/system/error_code.hpp>
 
 #include "comm.h"
+#include "comm_options.h"
+#include "metrics.h"
 
 using namespace boost::asio;
 
@@ -21,15 +36,144 @@ namespace boost_messaging
     namespace detail
     {
         /**
-        Exposes functions for clients that use the tcp protocol.
+        Turns a host and port into the endpoints a client tries to connect to.
+        @tparam TProtocol Protocol type with a resolver, like boost::asio::ip::tcp
+        */
+        template <typename TProtocol>
+        class endpoint_resolver
+        {
+        public:
+            typedef typename TProtocol::endpoint endpoint_t;
+
+            explicit endpoint_resolver(io_service& io_service) :
+                resolver_(io_service)
+            { }
+
+            /**
+            Looks up the host and port.
+            @param [in] host     IP or hostname of the server
+            @param [in] port     Port number or port protocol name
+            @param [in] callback Called with an error code and the endpoints that were found
+            */
+            template <typename TCallback>
+            void async_resolve(const std::string& host, const std::string& port, TCallback&& callback)
+            {
+                typedef typename TProtocol::resolver::iterator iterator_t;
+                resolver_.async_resolve(typename TProtocol::resolver::query(host, port),
+                    [callback](const boost::system::error_code& error, iterator_t it) mutable
+                    {
+                        callback(error, error ? std::vector<endpoint_t>() : std::vector<endpoint_t>(it, iterator_t()));
+                    });
+            }
+
+            void cancel()
+            {
+                resolver_.cancel();
+            }
+
+        private:
+            typename TProtocol::resolver resolver_;
+        };
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        /**
+        Resolver for unix domain sockets, where the host is the socket's path and there is no port.
+        @tparam TProtocol Either boost::asio::local::stream_protocol or boost::asio::local::datagram_protocol
+        */
+        template <typename TProtocol>
+        class path_resolver
+        {
+        public:
+            typedef typename TProtocol::endpoint endpoint_t;
+
+            explicit path_resolver(io_service& io_service) :
+                io_service_(io_service)
+            { }
+
+            /**
+            Makes the endpoint for a path. There is nothing to look up, so this never fails.
+            @param [in] path     Path of the server's socket
+            @param [in] port     Ignored
+            @param [in] callback Called with an error code and the endpoint
+            */
+            template <typename TCallback>
+            void async_resolve(const std::string& path, const std::string&, TCallback&& callback)
+            {
+                std::vector<endpoint_t> endpoints(1, endpoint_t(path));
+                io_service_.post([callback, endpoints]() mutable { callback(boost::system::error_code(), endpoints); });
+            }
+
+            void cancel() { }
+
+        private:
+            io_service& io_service_;
+        };
+
+        template <>
+        class endpoint_resolver<local::stream_protocol> : public path_resolver<local::stream_protocol>
+        {
+        public:
+            using path_resolver::path_resolver;
+        };
+
+        template <>
+        class endpoint_resolver<local::datagram_protocol> : public path_resolver<local::datagram_protocol>
+        {
+        public:
+            using path_resolver::path_resolver;
+        };
+#endif
+
+#if defined(__linux__)
+        template <>
+        class endpoint_resolver<shared_memory_protocol> : public path_resolver<shared_memory_protocol>
+        {
+        public:
+            using path_resolver::path_resolver;
+        };
+#endif
+
+        /**
+        Connects a socket to an endpoint, opening the socket first if it is closed.
+        @param [in, out] socket   Socket to connect
+        @param [in]      endpoint Endpoint to connect to
+        @param [in]      callback Called with an error code and the endpoint that was connected to
+        */
+        template <typename TSocket, typename TEndpoint, typename TCallback>
+        void connect_one(TSocket& socket, const TEndpoint& endpoint, TCallback&& callback)
+        {
+            socket.async_connect(endpoint, [callback, endpoint](const boost::system::error_code& error) mutable
+            {
+                callback(error, error ? TEndpoint() : endpoint);
+            });
+        }
+
+        /**
+        Exposes functions for clients that connect, like tcp.
         @tparam TSerializer Type that fulfils the Serializer concept
         @tparam THandler    Type that fulfils the Handler concept
+        @tparam TThreading  Either single_threaded or multi_threaded
+        @tparam TProtocol   boost::asio::ip::tcp, boost::asio::local::stream_protocol or shared_memory_protocol
         */
-        template <typename TSerializer, typename THandler>
+        template <typename TSerializer, typename THandler, typename TThreading, typename TProtocol = ip::tcp>
         class client_tcp_interface
         {
         public:
-            typedef tcp_comm<TSerializer, THandler> comm_t;
+            typedef typename comm_selector<TProtocol, TSerializer, THandler, TThreading>::type comm_t;
+            typedef typename TProtocol::socket socket_t;
+            typedef typename TProtocol::endpoint endpoint_t;
+
+            /**
+            Connects the socket of a new session.
+            @param [in, out] socket   Closed socket owned by the client's communcation object
+            @param [in]      endpoint Endpoint to connect to
+            @param [in]      callback Called with an error code and the endpoint that was connected to
+            */
+            template <typename TCallback>
+            void async_connect(socket_t& socket, const endpoint_t& endpoint, TCallback&& callback)
+            {
+                connect_one(socket, endpoint, std::forward<TCallback>(callback));
+            }
 
             /**
             Sets up options that make tcp socket communication go smoothly.
@@ -41,186 +185,654 @@ namespace boost_messaging
                 socket.set_option(ip::tcp::no_delay(true));
             }
 
+            /**
+            Does nothing. Other stream sockets have no options worth setting.
+            @param [in, out] socket Socket owned by the client's communcation object
+            */
+            template <typename TSocket>
+            void set_socket_opts(TSocket&) { }
+
             /**
             Sets the remote endpoint that the communcation object needs for udp communcation.
             Does nothing. This isn't needed for tcp. Only exists to fulfil an interface.
             @param [in, out] session  Client's session
             @param [in]      endpoint Remote endpoint
             */
-            void set_remote_endpoint(comm_t& session, const ip::tcp::endpoint& endpoint) { }
+            void set_remote_endpoint(comm_t&, const endpoint_t&) { }
         };
 
         /**
-        Exposes functions for clients that use the udp protocol.
+        Exposes functions for clients that use a datagram protocol, like udp.
         @tparam TSerializer Type that fulfils the Serializer concept
         @tparam THandler    Type that fulfils the Handler concept
+        @tparam TThreading  Either single_threaded or multi_threaded
+        @tparam TProtocol   Either boost::asio::ip::udp or boost::asio::local::datagram_protocol
         */
-        template <typename TSerializer, typename THandler>
+        template <typename TSerializer, typename THandler, typename TThreading, typename TProtocol = ip::udp>
         class client_udp_interface
         {
         public:
-            typedef udp_comm<TSerializer, THandler> comm_t;
+            typedef udp_comm<TSerializer, THandler, TThreading, TProtocol> comm_t;
+            typedef typename TProtocol::socket socket_t;
+            typedef typename TProtocol::endpoint endpoint_t;
+
+            /**
+            Connects the socket of a new session.
+            @param [in, out] socket   Closed socket owned by the client's communcation object
+            @param [in]      endpoint Endpoint to connect to
+            @param [in]      callback Called with an error code and the endpoint that was connected to
+            */
+            template <typename TCallback>
+            void async_connect(socket_t& socket, const endpoint_t& endpoint, TCallback&& callback)
+            {
+                async_connect(socket, endpoint, std::forward<TCallback>(callback), static_cast<TProtocol*>(nullptr));
+            }
 
             /**
             Sets up options that make udp socket communication go smoothly.
             Does nothing currently. Only exists to fulfil an interface.
             @param [in, out] socket Socket owned by the client's communcation object
             */
-            void set_socket_opts(ip::udp::socket& socket) { }
+            void set_socket_opts(socket_t&) { }
 
             /**
             Sets the remote endpoint that the communcation object needs for udp communcation.
             @param [in, out] session  Client's session
             @param [in]      endpoint Remote endpoint
             */
-            void set_remote_endpoint(comm_t& session, const ip::udp::endpoint& endpoint)
+            void set_remote_endpoint(comm_t& session, const endpoint_t& endpoint)
             {
                 session.set_remote_endpoint(endpoint);
             }
+
+        private:
+            template <typename TCallback, typename TAnyProtocol>
+            void async_connect(socket_t& socket, const endpoint_t& endpoint, TCallback&& callback, const TAnyProtocol*)
+            {
+                connect_one(socket, endpoint, std::forward<TCallback>(callback));
+            }
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+            /**
+            An unbound unix domain socket has no address for the server to reply to, so this binds it
+            to an empty path first, which makes the system pick an abstract address.
+            */
+            template <typename TCallback>
+            void async_connect(socket_t& socket, const endpoint_t& endpoint, TCallback&& callback, const local::datagram_protocol*)
+            {
+                boost::system::error_code error;
+                socket.open(local::datagram_protocol(), error);
+                if (!error)
+                    socket.bind(endpoint_t(), error);
+                if (error)
+                {
+                    boost::asio::post(socket.get_executor(), [callback, error]() mutable { callback(error, endpoint_t()); });
+                    return;
+                }
+
+                connect_one(socket, endpoint, std::forward<TCallback>(callback));
+            }
+#endif
         };
 
         /**
-        Switches between client interfaces that use different communicaton protocols.
-        @tparam TProtocol   Either boost::asio::ip::tcp or boost::asio::ip::udp
+        Picks the client interface for a protocol.
+        @tparam TProtocol   Protocol type, like boost::asio::ip::tcp
         @tparam TSerializer Type that fulfils the Serializer concept
         @tparam THandler    Type that fulfils the Handler concept
+        @tparam TThreading  Either single_threaded or multi_threaded
         */
-        template <typename TProtocol, typename TSerializer, typename THandler>
-        struct client_interface_selector
+        template <typename TProtocol, typename TSerializer, typename THandler, typename TThreading>
+        struct client_interface_selector;
+
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct client_interface_selector<ip::tcp, TSerializer, THandler, TThreading>
+        {
+            using type = client_tcp_interface<TSerializer, THandler, TThreading, ip::tcp>;
+        };
+
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct client_interface_selector<ip::udp, TSerializer, THandler, TThreading>
+        {
+            using type = client_udp_interface<TSerializer, THandler, TThreading, ip::udp>;
+        };
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct client_interface_selector<local::stream_protocol, TSerializer, THandler, TThreading>
+        {
+            using type = client_tcp_interface<TSerializer, THandler, TThreading, local::stream_protocol>;
+        };
+
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct client_interface_selector<local::datagram_protocol, TSerializer, THandler, TThreading>
         {
-            using type =
-                typename std::conditional<
-                std::is_same<TProtocol, ip::tcp>::value,
-                client_tcp_interface<TSerializer, THandler>,
-                client_udp_interface<TSerializer, THandler>>::type;
+            using type = client_udp_interface<TSerializer, THandler, TThreading, local::datagram_protocol>;
+        };
+#endif
+
+#if defined(__linux__)
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct client_interface_selector<shared_memory_protocol, TSerializer, THandler, TThreading>
+        {
+            using type = client_tcp_interface<TSerializer, THandler, TThreading, shared_memory_protocol>;
+        };
+#endif
+
+        /**
+        Keeps a client connected to its server.
+        Every connection gets a new session, so nothing a failed session was doing carries over.
+        Resolving, connecting and waiting between attempts run on its own executor, and their
+        handlers keep it alive, so it outlives the client until they are cancelled.
+        @tparam TProtocol   Protocol type that has a client_interface_selector
+        @tparam TSerializer Type that fulfils the Serializer concept
+        @tparam THandler    Type that fulfils the Handler concept
+        @tparam TThreading  Either single_threaded or multi_threaded
+        */
+        template <typename TProtocol, typename TSerializer, typename THandler, typename TThreading>
+        class client_connection : public std::enable_shared_from_this<client_connection<TProtocol, TSerializer, THandler, TThreading>>
+        {
+        public:
+            typedef typename TProtocol::endpoint endpoint_t;
+            typedef typename TSerializer::send_t send_t;
+            typedef typename comm_selector<TProtocol, TSerializer, THandler, TThreading>::type comm_t;
+            typedef typename client_interface_selector<TProtocol, TSerializer, THandler, TThreading>::type interface_t;
+
+            client_connection(io_service& io_service, const std::string& host, const std::string& port, const comm_options& options,
+                std::shared_ptr<const THandler> handler) :
+                io_service_(io_service),
+                host_(host),
+                port_(port),
+                options_(options),
+                handler_(std::move(handler)),
+                executor_(io_service),
+                resolver_(io_service),
+                connect_timer_(io_service),
+                retry_timer_(io_service),
+                next_endpoint_(0),
+                attempts_(0),
+                backoff_(options.reconnect.initial_backoff),
+                random_(std::random_device()()),
+                stopped_(false)
+            { }
+
+            void start()
+            {
+                executor_.post([this, sp = this->shared_from_this()] { connect(); });
+            }
+
+            // Drops the connection for good. Safe to call from any thread.
+            void stop()
+            {
+                std::shared_ptr<comm_t> session;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    stopped_ = true;
+                    session = std::move(session_);
+                    pending_.clear();
+                }
+
+                if (session)
+                    session->close();
+
+                executor_.post([this, sp = this->shared_from_this()]
+                {
+                    boost::system::error_code ignored;
+                    resolver_.cancel();
+                    connect_timer_.cancel(ignored);
+                    retry_timer_.cancel(ignored);
+                    if (connecting_)
+                        connecting_->socket().close(ignored);
+                });
+            }
+
+            // Writes to the session, or keeps the message until there is one.
+            template <typename TMessage>
+            bool write(TMessage&& message)
+            {
+                return write(std::forward<TMessage>(message), [](session_id_t) {});
+            }
+
+            // written gets the id of the session the message goes to, or zero if it is kept, while no session can come or go.
+            template <typename TMessage, typename TWritten>
+            bool write(TMessage&& message, TWritten&& written)
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (stopped_)
+                    return false;
+
+                if (auto session = session_)
+                {
+                    written(session->id());
+                    lock.unlock();
+                    return write_to(*session, std::forward<TMessage>(message));
+                }
+
+                if (pending_.size() >= options_.reconnect.max_pending_messages)
+                    return false;
+                written(session_id_t(0));
+                pending_.emplace_back(std::forward<TMessage>(message));
+                return true;
+            }
+
+            // Called with each new session's id once the kept writes went to it, before any other write can.
+            void set_connected_callback(std::function<void(session_id_t session)> callback)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                connected_callback_ = std::move(callback);
+            }
+
+            metrics_snapshot metrics() const
+            {
+                metrics_snapshot snapshot;
+                retired_.snapshot(snapshot);
+                if (auto session = current())
+                    session->metrics().snapshot(snapshot);
+                return snapshot;
+            }
+
+            endpoint_t local_endpoint() const
+            {
+                auto session = current();
+                if (!session)
+                    return endpoint_t();
+
+                boost::system::error_code error;
+                auto endpoint = session->socket().local_endpoint(error);
+                return error ? endpoint_t() : endpoint;
+            }
+
+        private:
+            /**
+            Write made while there was no session.
+            */
+            struct pending_write
+            {
+                explicit pending_write(const send_t& message) : message(message) { }
+                explicit pending_write(send_t&& message) : message(std::move(message)) { }
+                explicit pending_write(std::vector<char>&& serialized) : serialized(std::move(serialized)) { }
+
+                boost::optional<send_t> message;
+                std::vector<char> serialized;
+            };
+
+            io_service& io_service_;
+            std::string host_;
+            std::string port_;
+            comm_options options_;
+            // Every session's handler starts as a copy of this one, unless it is null
+            std::shared_ptr<const THandler> handler_;
+            typename TThreading::executor_t executor_;
+            endpoint_resolver<TProtocol> resolver_;
+            boost::asio::steady_timer connect_timer_;
+            boost::asio::steady_timer retry_timer_;
+            interface_t interface_;
+            // Endpoints from the last resolve, tried before resolving again
+            std::vector<endpoint_t> endpoints_;
+            size_t next_endpoint_;
+            std::shared_ptr<comm_t> connecting_;
+            // Tells a connect timeout apart from the ones of earlier endpoints
+            uint64_t attempts_;
+            std::chrono::milliseconds backoff_;
+            std::chrono::steady_clock::time_point connected_at_;
+            std::minstd_rand random_;
+
+            // Shared with the writing threads
+            mutable std::mutex mutex_;
+            std::shared_ptr<comm_t> session_;
+            std::deque<pending_write> pending_;
+            std::function<void(session_id_t session)> connected_callback_;
+            bool stopped_;
+            // Counters of the sessions that came before this one
+            retired_metrics retired_;
+
+            std::shared_ptr<comm_t> current() const
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return session_;
+            }
+
+            bool stopped() const
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return stopped_;
+            }
+
+            static bool write_to(comm_t& session, const send_t& message) { return session.write(message); }
+            static bool write_to(comm_t& session, send_t&& message) { return session.write(std::move(message)); }
+            static bool write_to(comm_t& session, std::vector<char>&& serialized) { return session.write_frame(std::move(serialized)); }
+
+            // Pending writes were accepted when they were made, so the session's limits don't apply to them.
+            static void write_accepted(comm_t& session, pending_write&& pending)
+            {
+                if (pending.message)
+                    session.write_accepted(std::move(*pending.message));
+                else
+                    session.write_frame_accepted(std::move(pending.serialized));
+            }
+
+            // Tries the cached endpoints first, and resolves when there are none.
+            void connect()
+            {
+                if (stopped())
+                    return;
+
+                if (endpoints_.empty())
+                    resolve();
+                else
+                    attempt(false);
+            }
+
+            void resolve()
+            {
+                auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error, const std::vector<endpoint_t>& endpoints)
+                {
+                    if (error)
+                        retry_later();
+                    else
+                    {
+                        endpoints_ = endpoints;
+                        attempt(true);
+                    }
+                });
+                resolver_.async_resolve(host_, port_, callback);
+            }
+
+            void attempt(bool resolved)
+            {
+                if (stopped())
+                    return;
+
+                connecting_ = make_session<comm_t>(io_service_, typename TProtocol::socket(io_service_), options_, handler_);
+                next_endpoint_ = 0;
+                attempt_endpoint(resolved);
+            }
+
+            // Each endpoint gets its own connect_timeout, so one that never answers doesn't use up the time of the rest.
+            void attempt_endpoint(bool resolved)
+            {
+                if (stopped())
+                {
+                    connecting_.reset();
+                    return;
+                }
+
+                // A failed connect leaves the socket unusable, so every endpoint starts from a closed one
+                boost::system::error_code ignored;
+                connecting_->socket().close(ignored);
+                auto attempt = ++attempts_;
+
+                if (options_.reconnect.connect_timeout.count() != 0)
+                {
+                    connect_timer_.expires_from_now(options_.reconnect.connect_timeout);
+                    auto timeout = executor_.wrap([this, sp = this->shared_from_this(), attempt](const boost::system::error_code& error)
+                    {
+                        // Closing the socket makes the connect finish with an error
+                        boost::system::error_code ignored;
+                        if (!error && attempts_ == attempt && connecting_)
+                            connecting_->socket().close(ignored);
+                    });
+                    connect_timer_.async_wait(timeout);
+                }
+
+                auto callback = executor_.wrap([this, sp = this->shared_from_this(), resolved](const boost::system::error_code& error, const endpoint_t& endpoint)
+                {
+                    connected(error, endpoint, resolved);
+                });
+                interface_.async_connect(connecting_->socket(), endpoints_[next_endpoint_], callback);
+            }
+
+            void connected(const boost::system::error_code& error, const endpoint_t& endpoint, bool resolved)
+            {
+                boost::system::error_code ignored;
+                connect_timer_.cancel(ignored);
+
+                if (error)
+                {
+                    if (++next_endpoint_ < endpoints_.size())
+                        return attempt_endpoint(resolved);
+
+                    // Cached endpoints may be stale, so resolve once more before backing off
+                    connecting_.reset();
+                    endpoints_.clear();
+                    if (resolved)
+                        retry_later();
+                    else
+                        connect();
+                    return;
+                }
+
+                auto session = std::move(connecting_);
+                connected_at_ = std::chrono::steady_clock::now();
+                interface_.set_socket_opts(session->socket());
+                interface_.set_remote_endpoint(*session, endpoint);
+
+                std::weak_ptr<client_connection> weak_this = this->shared_from_this();
+                auto id = session->id();
+                session->set_error_callback([weak_this, id](const boost::system::error_code& error)
+                {
+                    if (auto sp = weak_this.lock())
+                        sp->executor_.post([sp, id, error] { sp->lost(id, error); });
+                });
+                session->read();
+
+                // Pending writes go first, and writers only see the session once they are in
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stopped_)
+                {
+                    session->close();
+                    return;
+                }
+
+                for (auto& pending : pending_)
+                    write_accepted(*session, std::move(pending));
+                pending_.clear();
+                if (connected_callback_)
+                    connected_callback_(id);
+                session_ = std::move(session);
+            }
+
+            /**
+            Reconnects after the backoff, so a server that drops every connection isn't hammered.
+            The backoff starts over if the connection got a message or stayed up for stable_after.
+            */
+            void lost(session_id_t id, const boost::system::error_code& error)
+            {
+                std::shared_ptr<comm_t> session;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (!session_ || session_->id() != id)
+                        return;
+                    session = std::move(session_);
+                    retired_.retire(session->metrics());
+                }
+
+                metrics_snapshot snapshot;
+                session->metrics().snapshot(snapshot);
+                if (snapshot.messages_in != 0 || std::chrono::steady_clock::now() - connected_at_ >= options_.reconnect.stable_after)
+                    backoff_ = options_.reconnect.initial_backoff;
+
+                session->close();
+                error_print(error);
+                retry_later();
+            }
+
+            void retry_later()
+            {
+                if (stopped())
+                    return;
+
+                // Waits somewhere between (1 - jitter) and all of the backoff
+                auto jitter = std::min(std::max(options_.reconnect.jitter, 0.0), 1.0);
+                std::uniform_real_distribution<double> chance(1.0 - jitter, 1.0);
+                auto wait = std::chrono::milliseconds(static_cast<int64_t>(backoff_.count() * chance(random_)));
+                auto next = std::chrono::milliseconds(static_cast<int64_t>(backoff_.count() * options_.reconnect.backoff_multiplier));
+                backoff_ = std::min(next, options_.reconnect.max_backoff);
+
+                retry_timer_.expires_from_now(wait);
+                auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error)
+                {
+                    if (!error)
+                        connect();
+                });
+                retry_timer_.async_wait(callback);
+            }
+
+            /**
+            Formats and prints the error code.
+            @param [in] error Error status of communication
+            */
+            void error_print(const boost::system::error_code& error)
+            {
+                std::cout << error.message() << std::endl;
+            }
         };
     }
 
     /**
     Generic client based on boost asio.
-    @tparam TProtocol   Either boost::asio::ip::tcp or boost::asio::ip::udp
+    @tparam TProtocol   boost::asio::ip::tcp, boost::asio::ip::udp, boost::asio::local::stream_protocol,
+                        boost::asio::local::datagram_protocol or shared_memory_protocol
     @tparam TSerializer Type that fulfils the Serializer concept
     @tparam THandler    Type that fulfils the Handler concept
+    @tparam TThreading  Either single_threaded or multi_threaded
     */
-	template <typename TProtocol, typename TSerializer, typename THandler>
+	template <typename TProtocol, typename TSerializer, typename THandler, typename TThreading = single_threaded>
 	class client
 	{
 	public:
-		typedef typename TProtocol::resolver resolver_t;
-		typedef typename TProtocol::resolver::query query_t;
-		typedef typename TProtocol::resolver::iterator iterator_t;
+		typedef typename TProtocol::endpoint endpoint_t;
 		typedef typename TSerializer::send_t send_t;
-		typedef typename detail::comm_selector<TProtocol, TSerializer, THandler>::type comm_t;
-		typedef typename detail::client_interface_selector<TProtocol, TSerializer, THandler>::type interface_t;
+		typedef detail::client_connection<TProtocol, TSerializer, THandler, TThreading> connection_t;
+		typedef typename connection_t::comm_t comm_t;
 
         /**
         Constructor.
+        Resolves and connects in the background; writes made before the connection is up are kept until it is.
         @param [in, out] io_service Facilitates async operations 
-        @param [in]      host       IP or hostname of the server 
-        @param [in]      port       Port number or port protocol name
-        */
-		client(io_service& io_service, const std::string& host, const std::string& port) :
-			host_(host),
-			port_(port),
-			io_service_(io_service),
-			session_(std::make_shared<comm_t>(io_service, TProtocol::socket(io_service))),
-            connected_(false)
+        @param [in]      host       IP or hostname of the server, or the path of a unix domain or shared memory server
+        @param [in]      port       Port number or port protocol name, ignored for unix domain and shared memory servers
+        @param [in]      options    Tunable settings for the session
+        */
+		client(io_service& io_service, const std::string& host, const std::string& port, const comm_options& options = comm_options()) :
+			connection_(std::make_shared<connection_t>(io_service, host, port, options, nullptr))
 		{
-            auto callback = [this](const boost::system::error_code& error) { error_callback(error); };
-            session_->set_error_callback(callback);
-			try_connect();
+			connection_->start();
 		}
 
+        /**
+        Constructor.
+        Every session's handler is a copy of the given one, so handlers can share state with the code that made the client.
+        @param [in, out] io_service Facilitates async operations
+        @param [in]      host       IP or hostname of the server, or the path of a unix domain or shared memory server
+        @param [in]      port       Port number or port protocol name, ignored for unix domain and shared memory servers
+        @param [in]      options    Tunable settings for the session
+        @param [in]      handler    Handler that every session's handler is copied from
+        */
+		client(io_service& io_service, const std::string& host, const std::string& port, const comm_options& options, const THandler& handler) :
+			connection_(std::make_shared<connection_t>(io_service, host, port, options, std::make_shared<const THandler>(handler)))
+		{
+			connection_->start();
+		}
+
+        /**
+        Destructor.
+        Closes the connection and stops reconnecting.
+        */
+		~client()
+		{
+			connection_->stop();
+		}
+
+		client(const client&) = delete;
+		client& operator=(const client&) = delete;
+
         /**
         Writes a message to the connected server.
+        While disconnected the message is kept and written once the client reconnects.
         @param [in] send_msg Message to be sent
+        @return False if the write queue limits or the pending limit kept the message out
         */
-		void write(const send_t& send_msg)
+		bool write(const send_t& send_msg)
 		{
-			session_->write(send_msg);
+			return connection_->write(send_msg);
 		}
 
         /**
-        Closes the socket on the io_service thread.
+        Writes a message to the connected server.
+        The message is moved all the way into the session, so it is never copied.
+        @param [in] send_msg Message to be sent
+        @return False if the write queue limits or the pending limit kept the message out
         */
-		void close()
+		bool write(send_t&& send_msg)
 		{
-			io_service_.post([this] { do_close(); });
+			return connection_->write(std::move(send_msg));
 		}
 
-	private:
-		std::string host_;
-		std::string port_;
-		io_service& io_service_;
-		std::shared_ptr<comm_t> session_;
-		interface_t interface_;
-        bool connected_;
-
         /**
-        Closes the socket.
-        Must be run on the io_service thread.
+        Writes an already serialized message to the connected server.
+        @param [in] serialized Bytes in the format the server's serializer expects
+        @return False if the write queue limits or the pending limit kept the message out
         */
-		void do_close()
+		bool write_frame(std::vector<char>&& serialized)
 		{
-			session_->socket().close();
+			return connection_->write(std::move(serialized));
 		}
 
         /**
-        Tries to connect to the server.
+        Writes a message to the connected server and tells which session it went to.
+        @param [in] send_msg Message to be sent
+        @param [in] written  Called with the id of the session the message is written to, or zero if it is kept
+                             until the client reconnects. Runs while no session can come or go, so it must not use the client
+        @return False if the write queue limits or the pending limit kept the message out
         */
-		void try_connect()
+		template <typename TWritten>
+		bool write(send_t&& send_msg, TWritten&& written)
 		{
-			resolver_t resolver(io_service_);
-			query_t query(host_, port_);
-			iterator_t endpoint_iterator = resolver.resolve(query);
+			return connection_->write(std::move(send_msg), std::forward<TWritten>(written));
+		}
 
-			auto callback = [this](const boost::system::error_code& error, iterator_t it) { connect(error, it); };
-			boost::asio::async_connect(session_->socket(), endpoint_iterator, callback);
+        /**
+        Sets a function to be called with the id of each new session, once the messages kept while
+        disconnected have been written to it and before any other write can go to it.
+        It runs while no session can come or go, so it must not use the client.
+        @param [in] callback Function called with the id of the session
+        */
+		void set_connected_callback(std::function<void(session_id_t session)> callback)
+		{
+			connection_->set_connected_callback(std::move(callback));
 		}
 
         /**
-        Processes an attempt at a connection.
-        If successful, sets up socket options and starts reading.
-        Otherwise tries to connect again.
-        @param [in] error Error status of connection
-        @param [in] it    Iterator to zero or more valid endpoints
+        Gets the counters of the client's sessions without stopping them.
+        Every reconnect starts a new session; the ones before it are included.
+        @return Counters of the sessions
         */
-		void connect(const boost::system::error_code& error, iterator_t it)
+		metrics_snapshot metrics() const
 		{
-			if (!error)
-			{
-                connected_ = true;
-				interface_.set_socket_opts(session_->socket());
-				interface_.set_remote_endpoint(*session_, *it);
-				session_->read();
-			}
-			else
-			{
-				if (connected_)
-					error_print(error);
-                connected_ = false;
-				try_connect();
-			}
+			return connection_->metrics();
 		}
 
         /**
-        Function that is called when the session experiences an error.
-        @param [in] error Error status of communication
+        Gets the local endpoint of the client's socket.
+        This is the endpoint the server sees the client as, so the server can write back to it.
+        @return Local endpoint, or a default endpoint if the client isn't connected
         */
-        void error_callback(const boost::system::error_code& error)
-        {
-            error_print(error);
-            close();
-            try_connect();
-        }
+		endpoint_t local_endpoint() const
+		{
+			return connection_->local_endpoint();
+		}
 
         /**
-        Formats and prints the error code.
-        @param [in] error Error status of communication
+        Closes the connection for good, without reconnecting.
+        Later writes return false.
         */
-        void error_print(const boost::system::error_code& error)
-        {
-            std::cout << error.message() << std::endl;
-        }
+		void close()
+		{
+			connection_->stop();
+		}
+
+	private:
+		std::shared_ptr<connection_t> connection_;
 	};
 }
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "shm_comm.h"
 #include "tcp_comm.h"
 #include "udp_comm.h"
 
@@ -7,14 +12,81 @@ namespace boost_messaging
 {
     namespace detail
     {
-        template <typename TProtocol, typename TSerializer, typename THandler>
-        struct comm_selector
-        {
-            using type =
-                typename std::conditional<
-                std::is_same<TProtocol, ip::tcp>::value,
-                tcp_comm<TSerializer, THandler>,
-                udp_comm<TSerializer, THandler>>::type;
+        /**
+        Picks the communication object for a protocol.
+        Specialize it, along with client_interface_selector and server_interface_selector, to add a protocol.
+        @tparam TProtocol   Protocol type, like boost::asio::ip::tcp
+        @tparam TSerializer Type that fulfils the Serializer concept
+        @tparam THandler    Type that fulfils the Handler concept
+        @tparam TThreading  Either single_threaded or multi_threaded
+        */
+        template <typename TProtocol, typename TSerializer, typename THandler, typename TThreading>
+        struct comm_selector;
+
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct comm_selector<ip::tcp, TSerializer, THandler, TThreading>
+        {
+            using type = tcp_comm<TSerializer, THandler, TThreading, ip::tcp>;
+        };
+
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct comm_selector<ip::udp, TSerializer, THandler, TThreading>
+        {
+            using type = udp_comm<TSerializer, THandler, TThreading, ip::udp>;
         };
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct comm_selector<local::stream_protocol, TSerializer, THandler, TThreading>
+        {
+            using type = tcp_comm<TSerializer, THandler, TThreading, local::stream_protocol>;
+        };
+
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct comm_selector<local::datagram_protocol, TSerializer, THandler, TThreading>
+        {
+            using type = udp_comm<TSerializer, THandler, TThreading, local::datagram_protocol>;
+        };
+#endif
+
+#if defined(__linux__)
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct comm_selector<shared_memory_protocol, TSerializer, THandler, TThreading>
+        {
+            using type = shm_comm<TSerializer, THandler, TThreading>;
+        };
+#endif
+
+        template <typename TComm, typename THandler>
+        std::shared_ptr<TComm> make_session(io_service& io_service, typename TComm::socket_t&& socket, const comm_options& options,
+            const std::shared_ptr<const THandler>& prototype, std::true_type)
+        {
+            if (prototype)
+                return std::make_shared<TComm>(io_service, std::move(socket), options, *prototype);
+            return std::make_shared<TComm>(io_service, std::move(socket), options);
+        }
+
+        template <typename TComm, typename THandler>
+        std::shared_ptr<TComm> make_session(io_service& io_service, typename TComm::socket_t&& socket, const comm_options& options,
+            const std::shared_ptr<const THandler>&, std::false_type)
+        {
+            return std::make_shared<TComm>(io_service, std::move(socket), options);
+        }
+
+        /**
+        Makes a session whose handler is a copy of the prototype, or is default constructed when there is none.
+        Handlers that can't be copied are always default constructed.
+        @param [in, out] io_service Facilitates async operations
+        @param [in]      socket     Socket of the session
+        @param [in]      options    Tunable settings for the session
+        @param [in]      prototype  Handler every session starts as a copy of, or null
+        @return New session
+        */
+        template <typename TComm, typename THandler>
+        std::shared_ptr<TComm> make_session(io_service& io_service, typename TComm::socket_t&& socket, const comm_options& options,
+            const std::shared_ptr<const THandler>& prototype)
+        {
+            return make_session<TComm>(io_service, std::move(socket), options, prototype, std::is_copy_constructible<THandler>());
+        }
     }
 }
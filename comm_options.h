@@ -0,0 +1,222 @@
+/**
+@file comm_options.h
+@author Gary Heckman
+@brief Tunable settings for the communication objects.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "buffer_pool.h"
+#include "session_registry.h"
+
+namespace boost_messaging
+{
+    /**
+    What a session does with writes once its write queue reaches a limit.
+    */
+    enum class overflow_policy
+    {
+        // Writes return false until the queue drains to the low watermark
+        reject,
+        // Writes wait until the queue drains to the low watermark; never write from the io_service's threads with this
+        block,
+        // The oldest frames that aren't being written yet are dropped to make room
+        drop_oldest,
+        // New writes are dropped, and return false, until the queue drains to the low watermark
+        drop_newest,
+        // A new frame replaces a waiting one with the same conflation key; without a match the oldest is dropped
+        conflate,
+        // The session is closed and every later write returns false
+        disconnect
+    };
+
+    /**
+    Changes in a session's write queue reported to the producer.
+    */
+    enum class backpressure_event
+    {
+        high_watermark,
+        low_watermark,
+        dropped,
+        disconnected
+    };
+
+    /**
+    Limits on the frames waiting in a session's write queue.
+    Messages are counted as soon as they are written, bytes once they are serialized.
+    */
+    struct write_queue_limits
+    {
+        /**
+        Most bytes queued on a session, or 0 for no limit.
+        */
+        size_t max_bytes = 0;
+
+        /**
+        Most messages queued on a session, or 0 for no limit.
+        A udp message split into fragments counts once, and is dropped whole by drop_oldest and conflate.
+        */
+        size_t max_messages = 0;
+
+        /**
+        Sizes a session that hit a limit has to drain to before it takes writes normally again.
+        0 means half of the limit.
+        */
+        size_t low_watermark_bytes = 0;
+        size_t low_watermark_messages = 0;
+
+        overflow_policy policy = overflow_policy::reject;
+
+        /**
+        Key of a serialized message, computed from the bytes after the serializer's header.
+        Needed by the conflate policy.
+        */
+        std::function<uint64_t(const char* begin, const char* end)> conflation_key;
+
+        /**
+        Called with the session's id on every backpressure event.
+        Runs on the writing thread or on the session's executor, so it must be thread-safe and must not write to the session.
+        */
+        std::function<void(session_id_t session, backpressure_event event)> callback;
+    };
+
+    /**
+    How a client gets back to its server after a connection attempt fails or a connection is lost.
+    Every attempt waits longer than the one before, until a connection proves stable.
+    */
+    struct reconnect_options
+    {
+        /**
+        Wait after the first failed attempt. Every failure multiplies it by backoff_multiplier, up to max_backoff.
+        */
+        std::chrono::milliseconds initial_backoff = std::chrono::milliseconds(100);
+        std::chrono::milliseconds max_backoff = std::chrono::milliseconds(30000);
+        double backoff_multiplier = 2.0;
+
+        /**
+        Fraction of each wait, from 0 to 1, that is left to chance so that many clients don't retry in step.
+        */
+        double jitter = 0.5;
+
+        /**
+        Longest an attempt to connect to one of the resolved endpoints may take, or 0 for no limit.
+        */
+        std::chrono::milliseconds connect_timeout = std::chrono::milliseconds(5000);
+
+        /**
+        A connection that gets a message, or stays up this long, sets the wait back to initial_backoff once it is lost.
+        One that the server drops straight away keeps backing off.
+        */
+        std::chrono::milliseconds stable_after = std::chrono::milliseconds(5000);
+
+        /**
+        Most messages kept while the client isn't connected. They are written once it connects.
+        Writes past this return false.
+        */
+        size_t max_pending_messages = 1024;
+    };
+
+    /**
+    Tunable settings for a communication object.
+    Clients and servers hand a copy to every session they create.
+    */
+    struct comm_options
+    {
+        /**
+        Upper bound on the bytes gathered into a single tcp write.
+        A frame larger than this is still written, just on its own.
+        */
+        size_t max_write_bytes = 0x10000;
+
+        /**
+        Upper bound on the buffers gathered into a single tcp write or packed udp datagram.
+        */
+        size_t max_write_buffers = 64;
+
+        /**
+        Size of the buffer each tcp session reads into.
+        Every complete frame in a read is handled before the next read starts.
+        The buffer grows if a single frame doesn't fit.
+        Also bounds a udp session's batch of reads, which each take a 16 KiB slot, or an mtu sized one with udp_fragmentation.
+        */
+        size_t read_buffer_size = 0x10000;
+
+        /**
+        Upper bound on the datagrams a udp session receives or sends in a single system call.
+        Receives are further bounded by the slots that fit in read_buffer_size.
+        Batching needs recvmmsg and sendmmsg; without them, or with a value of 1,
+        every datagram takes its own call.
+        */
+        size_t udp_batch_size = 32;
+
+        /**
+        Largest datagram a udp session packs small frames into, or 0 to send every frame on its own.
+        Frames are only packed with the frames queued right after them for the same destination.
+        Receivers always handle every frame in a datagram, so only senders need to set this.
+        */
+        size_t udp_mtu = 0;
+
+        /**
+        Splits udp messages that don't fit in a datagram of udp_mtu bytes, or 1472 when that is 0,
+        into fragments that the receiver puts back together.
+        Every datagram gets an extra byte, so both ends must turn it on.
+        Receivers then only need read buffers the size of the mtu.
+        A message can have at most 65535 fragments. Bigger serialized frames are refused by write_frame
+        and write_shared; bigger messages are thrown away once serialized and reported as backpressure_event::dropped.
+        */
+        bool udp_fragmentation = false;
+
+        /**
+        Most bytes a udp session holds in partly received messages.
+        The oldest are dropped to make room for new ones.
+        */
+        size_t udp_reassembly_bytes = 0x400000;
+
+        /**
+        How long a udp session keeps a partly received message before dropping it.
+        */
+        std::chrono::milliseconds udp_reassembly_timeout = std::chrono::milliseconds(1000);
+
+        /**
+        Bytes in the ring a shared memory session writes into, rounded up to a power of two.
+        Each side picks the size of its own ring. Frames bigger than half of it are split up.
+        */
+        size_t shm_ring_bytes = 0x100000;
+
+        /**
+        How long a shared memory session keeps polling its ring after it runs dry before it
+        waits to be woken up, or 0 to wait straight away.
+        Polling keeps an io thread busy, but a message that arrives in time costs no system call.
+        Only worth it when both sides have a core to spare.
+        */
+        std::chrono::microseconds shm_spin = std::chrono::microseconds(0);
+
+        /**
+        Largest frame a shared memory session puts back together from pieces.
+        A bigger one fails the session, so the other side can't make it allocate without bound.
+        */
+        size_t shm_max_message_bytes = 0x4000000;
+
+        /**
+        Limits on each session's write queue. Unbounded by default.
+        */
+        write_queue_limits write_limits;
+
+        /**
+        How clients reconnect. Servers ignore it.
+        */
+        reconnect_options reconnect;
+
+        /**
+        Pool that frames and read buffers are taken from.
+        When left empty, sessions use the pool shared by their io_service.
+        */
+        std::shared_ptr<buffer_pool> pool;
+    };
+}
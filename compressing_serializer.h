@@ -0,0 +1,378 @@
+/**
+@author Gary Heckman
+@file compressing_serializer.h
+@brief Serializer adaptor that compresses large messages with zlib
+@detail
+	Wraps any type that fulfils the Serializer concept and fulfils it itself.
+	Both ends must use the adaptor with the same inner serializer.
+	Needs zlib at link time.
+
+	Wire format, big endian:
+		size of the rest (4) | flag (1) | frame
+	The flag says whether the frame is compressed. An uncompressed frame is the
+	inner serializer's header and body as is. A compressed frame is
+		inner frame size (4) | deflate stream of the inner frame
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+#include "serializer_traits.h"
+
+namespace boost_messaging
+{
+	namespace detail
+	{
+		/**
+		A deflate and an inflate stream that are set up once and reset for every message.
+		Copies start with fresh streams.
+		*/
+		class zlib_streams
+		{
+		public:
+			explicit zlib_streams(int level) :
+				level_(level),
+				deflate_ready_(false),
+				inflate_ready_(false)
+			{ }
+
+			zlib_streams(const zlib_streams& other) :
+				zlib_streams(other.level_)
+			{ }
+
+			zlib_streams& operator=(const zlib_streams&) = delete;
+
+			~zlib_streams()
+			{
+				if (deflate_ready_)
+					deflateEnd(&deflate_);
+				if (inflate_ready_)
+					inflateEnd(&inflate_);
+			}
+
+			/**
+			Compresses a buffer.
+			@param [in]  first First byte to compress
+			@param [in]  size  Number of bytes to compress
+			@param [out] out   Resized to the compressed bytes, keeps its capacity between calls
+			*/
+			void compress(const char* first, size_t size, std::vector<char>& out)
+			{
+				if (!deflate_ready_)
+				{
+					deflate_ = z_stream();
+					if (deflateInit(&deflate_, level_) != Z_OK)
+						throw std::runtime_error("deflateInit failed");
+					deflate_ready_ = true;
+				}
+				else
+					deflateReset(&deflate_);
+
+				out.resize(deflateBound(&deflate_, static_cast<uLong>(size)));
+				deflate_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(first));
+				deflate_.avail_in = static_cast<uInt>(size);
+				deflate_.next_out = reinterpret_cast<Bytef*>(out.data());
+				deflate_.avail_out = static_cast<uInt>(out.size());
+				if (deflate(&deflate_, Z_FINISH) != Z_STREAM_END)
+					throw std::runtime_error("deflate failed");
+				out.resize(deflate_.total_out);
+			}
+
+			/**
+			Decompresses a buffer.
+			@param [in]  first    First compressed byte
+			@param [in]  size     Number of compressed bytes
+			@param [out] out      Resized to the decompressed bytes, keeps its capacity between calls
+			@param [in]  out_size Number of bytes the data decompresses to
+			@return False if the data is corrupt or doesn't decompress to out_size bytes
+			*/
+			bool decompress(const char* first, size_t size, std::vector<char>& out, size_t out_size)
+			{
+				if (!inflate_ready_)
+				{
+					inflate_ = z_stream();
+					if (inflateInit(&inflate_) != Z_OK)
+						throw std::runtime_error("inflateInit failed");
+					inflate_ready_ = true;
+				}
+				else
+					inflateReset(&inflate_);
+
+				out.resize(out_size);
+				inflate_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(first));
+				inflate_.avail_in = static_cast<uInt>(size);
+				inflate_.next_out = reinterpret_cast<Bytef*>(out.data());
+				inflate_.avail_out = static_cast<uInt>(out.size());
+				return inflate(&inflate_, Z_FINISH) == Z_STREAM_END && inflate_.total_out == out_size;
+			}
+
+		private:
+			int level_;
+			bool deflate_ready_;
+			bool inflate_ready_;
+			z_stream deflate_;
+			z_stream inflate_;
+		};
+	}
+
+	/**
+	Serializer adaptor that compresses messages whose serialized size reaches a threshold.
+	Smaller messages, and messages that don't shrink, are sent as the inner serializer makes them.
+	Every buffer is kept by the adaptor and reused, and since each session has its own
+	serializer, compression doesn't allocate once a session has warmed up.
+	recv_t is the inner serializer's owned_message type, since a decompressed frame only lasts until the next
+	message and a handle_batch call gets every message of a read at once. Views are copied into it.
+	Sessions turn corrupt frames down through try_deserialize, so a bad peer only loses its own session;
+	deserialize throws std::runtime_error on them instead.
+	@tparam TSerializer Type that fulfils the Serializer concept
+	@tparam Threshold   Serialized size in bytes from which messages are compressed
+	@tparam Level       zlib compression level, 1 is fastest and 9 is smallest
+	*/
+	template <typename TSerializer, size_t Threshold = 512, int Level = Z_BEST_SPEED>
+	class compressing_serializer
+	{
+	public:
+		typedef typename TSerializer::send_t send_t;
+		typedef typename owned_message<typename TSerializer::recv_t>::type recv_t;
+
+		compressing_serializer() :
+			streams_(Level)
+		{ }
+
+		/**
+		Gets the header size.
+		@return The header size.
+		*/
+		constexpr size_t header_size() const
+		{
+			return sizeof(uint32_t);
+		}
+
+		/**
+		Gets the body size, which covers the flag and the frame.
+		@tparam FwdIter Forward iterator
+		@param [in] first Iterator to the first character in the header
+		@param [in] last  Iterator past the last character in the header
+		*/
+		template <typename FwdIter>
+		size_t body_size(FwdIter first, FwdIter last) const
+		{
+			return get_size(first, last);
+		}
+
+		/**
+		Checks the header to make sure it is a reasonable value.
+		@tparam FwdIter Forward iterator
+		@param [in] first Iterator to the first character in the header
+		@param [in] last  Iterator past the last character in the header
+		@return True if the header is valid, false otherwise
+		*/
+		template <typename FwdIter>
+		bool validate_header(FwdIter first, FwdIter last) const
+		{
+			return std::distance(first, last) == static_cast<std::ptrdiff_t>(header_size()) && get_size(first, last) != 0;
+		}
+
+		/**
+		Serializes a message into a new buffer.
+		@param [in] send_msg Message to send
+		@return Serialized message
+		*/
+		std::vector<char> serialize(const send_t& send_msg)
+		{
+			std::vector<char> buffer(serialized_size(send_msg));
+			serialize_into(send_msg, buffer.data());
+			return buffer;
+		}
+
+		/**
+		Gets the size of the serialized message.
+		Compresses the message, which serialize_into then reuses if it is called next for the same message.
+		@param [in] send_msg Message to send
+		@return Size of the header and body in bytes
+		*/
+		size_t serialized_size(const send_t& send_msg)
+		{
+			prepare(send_msg);
+			prepared_.keep(send_msg);
+			return header_size() + FLAG_SIZE + (compressed_ ? sizeof(uint32_t) + packed_.size() : frame_size_);
+		}
+
+		/**
+		Serializes a message into a caller-provided buffer.
+		@param [in]  send_msg Message to send
+		@param [out] first    Start of a buffer at least serialized_size(send_msg) bytes long
+		*/
+		void serialize_into(const send_t& send_msg, char* first)
+		{
+			if (!prepared_.take(send_msg))
+				prepare(send_msg);
+
+			auto body = first + header_size();
+			if (compressed_)
+			{
+				put_size(first, static_cast<uint32_t>(FLAG_SIZE + sizeof(uint32_t) + packed_.size()));
+				body[0] = COMPRESSED;
+				put_size(body + FLAG_SIZE, static_cast<uint32_t>(frame_size_));
+				std::copy(packed_.begin(), packed_.end(), body + FLAG_SIZE + sizeof(uint32_t));
+			}
+			else
+			{
+				put_size(first, static_cast<uint32_t>(FLAG_SIZE + frame_size_));
+				body[0] = UNCOMPRESSED;
+				if (frame_in_buffer_)
+					std::copy(frame_.begin(), frame_.begin() + frame_size_, body + FLAG_SIZE);
+				else
+					inner_.serialize_into(send_msg, body + FLAG_SIZE);
+			}
+		}
+
+		/**
+		Deserializes a message, decompressing it first if needed.
+		@param [in] first Pointer to the first character in the body
+		@param [in] last  Pointer past the last character in the body
+		@return Message made by the inner serializer
+		*/
+		recv_t deserialize(const char* first, const char* last)
+		{
+			recv_t message;
+			if (!try_deserialize(first, last, message))
+				throw std::runtime_error("compressed message is corrupt");
+			return message;
+		}
+
+		/**
+		Deserializes a message, decompressing it first if needed, unless the frame is malformed.
+		@param [in]  first   Pointer to the first character in the body
+		@param [in]  last    Pointer past the last character in the body
+		@param [out] message Set to the message made by the inner serializer
+		@return False if the flag is missing, the deflate stream is corrupt or the inner frame doesn't add up
+		*/
+		bool try_deserialize(const char* first, const char* last, recv_t& message)
+		{
+			if (last - first < static_cast<ptrdiff_t>(FLAG_SIZE))
+				return false;
+
+			auto flag = *first++;
+			if (flag == COMPRESSED)
+			{
+				if (last - first < static_cast<ptrdiff_t>(sizeof(uint32_t)))
+					return false;
+
+				size_t size = get_size(first, first + sizeof(uint32_t));
+				first += sizeof(uint32_t);
+
+				// Deflate can't expand data more than about 1032 times
+				if (size > 1032 * static_cast<size_t>(last - first) + 64)
+					return false;
+
+				if (!streams_.decompress(first, last - first, unpacked_, size))
+					return false;
+
+				first = unpacked_.data();
+				last = first + size;
+			}
+			else if (flag != UNCOMPRESSED)
+				return false;
+
+			auto inner_header_size = inner_.header_size();
+			if (static_cast<size_t>(last - first) < inner_header_size)
+				return false;
+
+			auto body_begin = first + inner_header_size;
+			if (!inner_.validate_header(first, body_begin) || inner_.body_size(first, body_begin) != static_cast<size_t>(last - body_begin))
+				return false;
+
+			return deserialize_inner(body_begin, last, message, std::is_same<recv_t, typename TSerializer::recv_t>());
+		}
+
+	private:
+		static const size_t FLAG_SIZE = 1;
+		static const char UNCOMPRESSED = 0;
+		static const char COMPRESSED = 1;
+
+		TSerializer inner_;
+		detail::zlib_streams streams_;
+		// Message whose frame was prepared by serialized_size
+		detail::prepared_message<send_t> prepared_;
+		bool compressed_;
+		bool frame_in_buffer_;
+		size_t frame_size_;
+		std::vector<char> frame_;
+		std::vector<char> packed_;
+		std::vector<char> unpacked_;
+
+		bool deserialize_inner(const char* first, const char* last, recv_t& message, std::true_type)
+		{
+			return detail::deserialize_into(inner_, first, last, message);
+		}
+
+		bool deserialize_inner(const char* first, const char* last, recv_t& message, std::false_type)
+		{
+			typedef typename TSerializer::recv_t inner_recv_t;
+			return detail::deserialize_body(inner_, first, last, [&message](inner_recv_t&& inner) { message = owned_message<inner_recv_t>::own(inner); });
+		}
+
+		// Decides whether to compress a message and compresses it if so.
+		void prepare(const send_t& send_msg)
+		{
+			compressed_ = false;
+			frame_in_buffer_ = false;
+			prepare(send_msg, detail::has_serialize_into<TSerializer>());
+		}
+
+		// Small messages are later serialized straight into the output.
+		void prepare(const send_t& send_msg, std::true_type)
+		{
+			frame_size_ = inner_.serialized_size(send_msg);
+			if (frame_size_ < Threshold)
+				return;
+
+			frame_.resize(frame_size_);
+			inner_.serialize_into(send_msg, frame_.data());
+			frame_in_buffer_ = true;
+			compress();
+		}
+
+		void prepare(const send_t& send_msg, std::false_type)
+		{
+			frame_ = inner_.serialize(send_msg);
+			frame_size_ = frame_.size();
+			frame_in_buffer_ = true;
+			if (frame_size_ >= Threshold)
+				compress();
+		}
+
+		// Only keeps the compressed frame if it is smaller.
+		void compress()
+		{
+			streams_.compress(frame_.data(), frame_size_, packed_);
+			compressed_ = sizeof(uint32_t) + packed_.size() < frame_size_;
+		}
+
+		static void put_size(char* first, uint32_t size)
+		{
+			for (size_t i = 0; i < sizeof(uint32_t); ++i)
+				first[i] = static_cast<char>(size >> (8 * (sizeof(uint32_t) - 1 - i)));
+		}
+
+		template <typename FwdIter>
+		static uint32_t get_size(FwdIter first, FwdIter last)
+		{
+			uint32_t size = 0;
+			for (; first != last; ++first)
+				size = (size << 8) | static_cast<unsigned char>(*first);
+			return size;
+		}
+	};
+}
@@ -0,0 +1,582 @@
+/**
+@file dispatch.h
+@author Gary Heckman
+@brief Runs handlers on a pool of worker threads instead of the io threads.
+@detail
+	dispatching_handler fulfils the Handler concept by copying each message
+	into a bounded lock-free queue that a worker thread drains into the real
+	handler. A slow handler then only holds up its own worker, not the reads
+	of every session on the io thread.
+
+	Messages of one session, or of one key, always go to the same worker, so
+	they are handled in the order they arrived. When a worker's queue is full
+	the session keeps the messages that didn't fit and stops reading until
+	the worker has worked its queue down to half, so the backlog pushes back
+	on the sender without holding up the io thread or the other sessions.
+	Handlers of sessions that can't stop reading, like udp, wait for room.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "handler_traits.h"
+#include "serializer_traits.h"
+
+namespace boost_messaging
+{
+    /**
+    Settings for the workers of a dispatching_handler.
+    */
+    struct dispatch_options
+    {
+        // Number of worker threads, zero for one per hardware thread
+        size_t workers = 0;
+        // Messages each worker's queue holds before sessions stop reading, rounded up to a power of two
+        size_t queue_capacity = 4096;
+    };
+
+    /**
+    Ordering for dispatching_handler that sends all of a session's messages to the same worker.
+    */
+    struct per_session_order {};
+
+    namespace detail
+    {
+        /**
+        Bounded queue that many threads may push to and one thread pops from.
+        Each cell carries a sequence number that says whether it is free or full,
+        so producers only contend on the index they claim.
+        */
+        template <typename T>
+        class mpsc_queue
+        {
+        public:
+            explicit mpsc_queue(size_t capacity) :
+                mask_(round_up(capacity) - 1),
+                cells_(new cell[mask_ + 1]),
+                push_index_(0),
+                pop_index_(0)
+            {
+                for (size_t i = 0; i <= mask_; ++i)
+                    cells_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+
+            ~mpsc_queue()
+            {
+                T value;
+                while (try_pop(value)) {}
+            }
+
+            mpsc_queue(const mpsc_queue&) = delete;
+            mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+            size_t capacity() const { return mask_ + 1; }
+
+            /**
+            Number of values in the queue, counting pushes still being made.
+            Only the consumer may call this.
+            */
+            size_t size() const
+            {
+                return push_index_.load(std::memory_order_relaxed) - pop_index_;
+            }
+
+            /**
+            Adds a value if there is room.
+            @param [in, out] value Value that is moved in on success
+            @return False if the queue is full
+            */
+            bool try_push(T& value)
+            {
+                auto index = push_index_.load(std::memory_order_relaxed);
+                cell* target;
+                for (;;)
+                {
+                    target = &cells_[index & mask_];
+                    auto sequence = target->sequence.load(std::memory_order_acquire);
+                    auto lag = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(index);
+                    if (lag == 0 && push_index_.compare_exchange_weak(index, index + 1, std::memory_order_relaxed))
+                        break;
+                    if (lag < 0)
+                        return false;
+                    if (lag > 0)
+                        index = push_index_.load(std::memory_order_relaxed);
+                }
+
+                new (&target->storage) T(std::move(value));
+                target->sequence.store(index + 1, std::memory_order_release);
+                return true;
+            }
+
+            /**
+            Takes the oldest value. Only the consumer may call this.
+            @param [out] value Gets the value
+            @return False if the queue is empty
+            */
+            bool try_pop(T& value)
+            {
+                auto& source = cells_[pop_index_ & mask_];
+                if (source.sequence.load(std::memory_order_acquire) != pop_index_ + 1)
+                    return false;
+
+                auto stored = reinterpret_cast<T*>(&source.storage);
+                value = std::move(*stored);
+                stored->~T();
+                source.sequence.store(pop_index_ + mask_ + 1, std::memory_order_release);
+                ++pop_index_;
+                return true;
+            }
+
+        private:
+            struct cell
+            {
+                std::atomic<size_t> sequence;
+                typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+            };
+
+            const size_t mask_;
+            std::unique_ptr<cell[]> cells_;
+            std::atomic<size_t> push_index_;
+            // Keeps the producers' index off the consumer's cache line
+            char padding_[64];
+            size_t pop_index_;
+
+            static size_t round_up(size_t capacity)
+            {
+                size_t size = 2;
+                while (size < capacity)
+                    size <<= 1;
+                return size;
+            }
+        };
+
+        /**
+        Worker threads that each drain their own queue of tasks.
+        A task is anything with a run() member.
+        Idle workers sleep, and producers only touch the mutex when a worker is asleep.
+        @tparam TTask Task type
+        */
+        template <typename TTask>
+        class worker_pool
+        {
+        public:
+            explicit worker_pool(const dispatch_options& options)
+            {
+                auto count = options.workers ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+                for (size_t i = 0; i < count; ++i)
+                    workers_.emplace_back(new worker(options.queue_capacity));
+                for (auto& w : workers_)
+                {
+                    auto target = w.get();
+                    w->thread = std::thread([this, target] { run(*target); });
+                }
+            }
+
+            // Finishes every queued task before the workers stop.
+            ~worker_pool()
+            {
+                for (auto& w : workers_)
+                {
+                    std::lock_guard<std::mutex> lock(w->mutex);
+                    w->stopping = true;
+                    w->condition.notify_one();
+                }
+
+                for (auto& w : workers_)
+                    w->thread.join();
+            }
+
+            worker_pool(const worker_pool&) = delete;
+            worker_pool& operator=(const worker_pool&) = delete;
+
+            size_t size() const { return workers_.size(); }
+
+            /**
+            Queues a task on a worker, waiting for room if its queue is full.
+            @param [in] index Worker to run the task, taken modulo the number of workers
+            @param [in] task  Task to run
+            */
+            void push(size_t index, TTask&& task)
+            {
+                auto& w = *workers_[index % workers_.size()];
+                while (!w.queue.try_push(task))
+                    std::this_thread::yield();
+                wake(w);
+            }
+
+            /**
+            Queues a task on a worker if its queue has room.
+            @param [in]      index Worker to run the task, taken modulo the number of workers
+            @param [in, out] task  Task to run, moved from on success
+            @return False if the queue is full
+            */
+            bool try_push(size_t index, TTask& task)
+            {
+                auto& w = *workers_[index % workers_.size()];
+                if (!w.queue.try_push(task))
+                    return false;
+                wake(w);
+                return true;
+            }
+
+            /**
+            Calls a function on a worker's thread once its queue is at most half full.
+            @param [in] index  Worker to wait for, taken modulo the number of workers
+            @param [in] waiter Function to call, which may push to any worker
+            */
+            void when_room(size_t index, std::function<void()>&& waiter)
+            {
+                auto& w = *workers_[index % workers_.size()];
+                std::lock_guard<std::mutex> lock(w.mutex);
+                w.waiters.push_back(std::move(waiter));
+                w.has_waiters.store(true, std::memory_order_relaxed);
+                w.sleeping.store(false, std::memory_order_relaxed);
+                w.condition.notify_one();
+            }
+
+        private:
+            struct worker
+            {
+                explicit worker(size_t capacity) :
+                    queue(capacity),
+                    sleeping(false),
+                    has_waiters(false),
+                    stopping(false)
+                { }
+
+                mpsc_queue<TTask> queue;
+                std::atomic<bool> sleeping;
+                std::atomic<bool> has_waiters;
+                bool stopping;
+                std::mutex mutex;
+                std::condition_variable condition;
+                std::vector<std::function<void()>> waiters;
+                std::thread thread;
+            };
+
+            // Polls this many times before going to sleep
+            static const int SPINS = 64;
+
+            std::vector<std::unique_ptr<worker>> workers_;
+
+            static void wake(worker& w)
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (w.sleeping.load(std::memory_order_relaxed))
+                {
+                    std::lock_guard<std::mutex> lock(w.mutex);
+                    w.sleeping.store(false, std::memory_order_relaxed);
+                    w.condition.notify_one();
+                }
+            }
+
+            // Waiters are called without the lock since they push to the queues.
+            static void call_waiters(worker& w, std::unique_lock<std::mutex>& lock)
+            {
+                std::vector<std::function<void()>> waiters;
+                waiters.swap(w.waiters);
+                w.has_waiters.store(false, std::memory_order_relaxed);
+                lock.unlock();
+                for (auto& waiter : waiters)
+                    waiter();
+            }
+
+            void run(worker& w)
+            {
+                TTask task;
+                for (;;)
+                {
+                    for (int spin = 0; spin < SPINS; ++spin)
+                    {
+                        while (w.queue.try_pop(task))
+                        {
+                            task.run();
+                            spin = 0;
+                            if (w.has_waiters.load(std::memory_order_relaxed) && w.queue.size() <= w.queue.capacity() / 2)
+                            {
+                                std::unique_lock<std::mutex> lock(w.mutex);
+                                call_waiters(w, lock);
+                            }
+                        }
+                        std::this_thread::yield();
+                    }
+
+                    std::unique_lock<std::mutex> lock(w.mutex);
+                    if (!w.waiters.empty())
+                    {
+                        call_waiters(w, lock);
+                        continue;
+                    }
+
+                    w.sleeping.store(true, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (w.queue.try_pop(task))
+                    {
+                        w.sleeping.store(false, std::memory_order_relaxed);
+                        lock.unlock();
+                        task.run();
+                        continue;
+                    }
+                    if (w.stopping)
+                        return;
+
+                    w.condition.wait(lock, [&w] { return !w.sleeping.load(std::memory_order_relaxed) || w.stopping; });
+                    w.sleeping.store(false, std::memory_order_relaxed);
+                }
+            }
+        };
+    }
+
+    /**
+    Handler adaptor that hands messages to a pool of worker threads.
+    Each session gets its own THandler, which is kept alive while its messages are queued.
+    With per_session_order a session's handler is only ever called by one worker.
+    With a key function, messages with the same key stay in order, but a session's
+    handler may be called by several workers at once and must be thread safe.
+    A session whose messages don't fit a worker's queue stops reading until they do.
+    @tparam THandler  Type that fulfils the Handler concept
+    @tparam TOrdering per_session_order, or a functor taking a message and returning its key's hash
+    */
+    template <typename THandler, typename TOrdering = per_session_order>
+    class dispatching_handler
+    {
+    public:
+        dispatching_handler() :
+            handler_(std::make_shared<THandler>()),
+            backlog_(std::make_shared<backlog>()),
+            worker_(next_worker().fetch_add(1, std::memory_order_relaxed))
+        { }
+
+        /**
+        Copy constructor.
+        Copies are handlers for other sessions, so each gets its own THandler, copied from the other's when it can be.
+        */
+        dispatching_handler(const dispatching_handler& other) :
+            handler_(copy(*other.handler_, std::is_copy_constructible<THandler>())),
+            backlog_(std::make_shared<backlog>()),
+            worker_(next_worker().fetch_add(1, std::memory_order_relaxed))
+        { }
+
+        /**
+        Sets up the workers. Must be called before the first message of any dispatching_handler
+        of this THandler, since the workers are started then; later calls would have no effect.
+        @param [in] options Settings for the workers
+        */
+        static void configure(const dispatch_options& options)
+        {
+            assert(!started() && "dispatching_handler::configure called after the workers started");
+            settings() = options;
+        }
+
+        /**
+        Takes the session's writer so the session can be paused, and gives it to the handler if it takes one.
+        Called before the first message is queued.
+        @param [in] session Writer for the session
+        */
+        template <typename TSend>
+        void attach(const session_writer<TSend>& session)
+        {
+            backlog_->pause = [session] { session.pause_reading(); };
+            backlog_->resume = [session] { session.resume_reading(); };
+            attach_handler(session, detail::has_attach<THandler, TSend>());
+        }
+
+        /**
+        Copies the message and queues it for a worker.
+        If that worker's queue is full, the message waits in the session's backlog and the session stops reading.
+        Sessions that were never attached wait for room instead.
+        @param [in] message Message from the serializer
+        */
+        template <typename T>
+        void handle(const T& message)
+        {
+            auto index = worker_for(message, TOrdering());
+            task<T> queued{ handler_, owned_message<T>::own(message) };
+            if (!backlog_->pause)
+                return pool<T>().push(index, std::move(queued));
+
+            if (!backlog_->waiting.load(std::memory_order_acquire) && pool<T>().try_push(index, queued))
+                return;
+            backlog_->add(std::unique_ptr<typename backlog::entry>(new backlog_entry<T>(index, std::move(queued))));
+        }
+
+    private:
+        /**
+        Message queued for a worker along with the handler that takes it.
+        */
+        template <typename T>
+        struct task
+        {
+            std::shared_ptr<THandler> handler;
+            typename owned_message<T>::type message;
+
+            void run()
+            {
+                handler->handle(message);
+                handler.reset();
+            }
+        };
+
+        /**
+        A session's messages that didn't fit their worker's queue, in the order they arrived.
+        The session stops reading while there are any, and reads again once they are all queued.
+        */
+        struct backlog : std::enable_shared_from_this<backlog>
+        {
+            struct entry
+            {
+                virtual ~entry() { }
+
+                // Queues the message if its worker has room
+                virtual bool try_push() = 0;
+
+                // Calls the waiter once the message's worker has room
+                virtual void when_room(std::function<void()>&& waiter) = 0;
+            };
+
+            std::function<void()> pause;
+            std::function<void()> resume;
+            // Set while there are entries, so handle can skip the lock otherwise
+            std::atomic<bool> waiting{ false };
+            std::mutex mutex;
+            std::deque<std::unique_ptr<entry>> entries;
+
+            /**
+            Called from the session's handle, so later messages stay behind the ones already waiting.
+            Pauses again every time, since a resume from the last drain may still be on its way to the session.
+            */
+            void add(std::unique_ptr<entry>&& waiting_entry)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                entries.push_back(std::move(waiting_entry));
+                pause();
+                if (entries.size() != 1)
+                    return;
+                waiting.store(true, std::memory_order_release);
+                wait();
+            }
+
+            // Called on a worker once there is room for the oldest entry.
+            void drain()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                while (!entries.empty() && entries.front()->try_push())
+                    entries.pop_front();
+                if (!entries.empty())
+                    return wait();
+                waiting.store(false, std::memory_order_release);
+                resume();
+            }
+
+            void wait()
+            {
+                auto self = this->shared_from_this();
+                entries.front()->when_room([self] { self->drain(); });
+            }
+        };
+
+        template <typename T>
+        struct backlog_entry : backlog::entry
+        {
+            backlog_entry(size_t index, task<T>&& queued) :
+                index(index),
+                queued(std::move(queued))
+            { }
+
+            bool try_push() override
+            {
+                return pool<T>().try_push(index, queued);
+            }
+
+            void when_room(std::function<void()>&& waiter) override
+            {
+                pool<T>().when_room(index, std::move(waiter));
+            }
+
+            size_t index;
+            task<T> queued;
+        };
+
+        std::shared_ptr<THandler> handler_;
+        std::shared_ptr<backlog> backlog_;
+        size_t worker_;
+
+        template <typename TSend>
+        void attach_handler(const session_writer<TSend>& session, std::true_type)
+        {
+            handler_->attach(session);
+        }
+
+        template <typename TSend>
+        void attach_handler(const session_writer<TSend>&, std::false_type) { }
+
+        template <typename T>
+        size_t worker_for(const T&, per_session_order) const
+        {
+            return worker_;
+        }
+
+        template <typename T, typename TKeyHash>
+        size_t worker_for(const T& message, const TKeyHash& key_hash) const
+        {
+            return static_cast<size_t>(key_hash(message));
+        }
+
+        static std::shared_ptr<THandler> copy(const THandler& handler, std::true_type)
+        {
+            return std::make_shared<THandler>(handler);
+        }
+
+        static std::shared_ptr<THandler> copy(const THandler&, std::false_type)
+        {
+            return std::make_shared<THandler>();
+        }
+
+        static dispatch_options& settings()
+        {
+            static dispatch_options options;
+            return options;
+        }
+
+        static std::atomic<bool>& started()
+        {
+            static std::atomic<bool> flag(false);
+            return flag;
+        }
+
+        static const dispatch_options& start()
+        {
+            started() = true;
+            return settings();
+        }
+
+        static std::atomic<size_t>& next_worker()
+        {
+            static std::atomic<size_t> next(0);
+            return next;
+        }
+
+        template <typename T>
+        static detail::worker_pool<task<T>>& pool()
+        {
+            static detail::worker_pool<task<T>> workers(start());
+            return workers;
+        }
+    };
+}
@@ -0,0 +1,221 @@
+/**
+@file frame.h
+@author Gary Heckman
+@brief Serialized messages waiting to be written.
+*/
+
+#pragma once
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "buffer_pool.h"
+#include "serializer_traits.h"
+
+namespace boost_messaging
+{
+    /**
+    Serialized message that can be queued on many sessions at once.
+    Every session writes the same bytes; they are freed once the last write completes.
+    */
+    typedef std::shared_ptr<const std::vector<char>> shared_frame;
+
+    namespace detail
+    {
+        /**
+        Serialized size under which copying a message costs less than keeping it alive to send it in place.
+        */
+        const size_t SMALL_FRAME_SIZE = 1024;
+
+        /**
+        A serialized message waiting to be written.
+        The bytes in data are sent first, followed by the bytes in body.
+        The body is empty unless the serializer points it at the payload, in which case owner keeps the payload alive.
+        */
+        struct frame
+        {
+            std::vector<char> data;
+            boost::asio::const_buffer body;
+            std::shared_ptr<const void> owner;
+
+            /**
+            Gets the number of bytes that go on the wire.
+            @return Size of the data plus the size of the body
+            */
+            size_t size() const
+            {
+                return data.size() + boost::asio::buffer_size(body);
+            }
+        };
+
+        /**
+        Wraps bytes that were already serialized in a frame.
+        @param [in] serialized Serialized message
+        @return Frame that owns the bytes
+        */
+        inline frame make_frame(std::vector<char>&& serialized)
+        {
+            frame new_frame;
+            new_frame.data = std::move(serialized);
+            return new_frame;
+        }
+
+        /**
+        Wraps a shared serialized message in a frame without copying it.
+        @param [in] serialized Serialized message shared with other frames
+        @return Frame that keeps the shared bytes alive until it is written
+        */
+        inline frame make_frame(const shared_frame& serialized)
+        {
+            frame new_frame;
+            new_frame.body = boost::asio::buffer(*serialized);
+            new_frame.owner = serialized;
+            return new_frame;
+        }
+
+        /**
+        Turns messages into frames using the cheapest method the serializer supports.
+        In order of preference:
+            serialize_header + body_buffer: the payload is never copied
+            serialized_size + serialize_into: the frame is written into a reused buffer
+            serialize: the serializer allocates a new buffer, which still goes back to the pool
+        Messages under SMALL_FRAME_SIZE are written into a reused buffer when the serializer can do both of the first two.
+        Buffers are taken from a pool and given back once their frame has been written.
+        @tparam TSerializer Type that fulfils the Serializer concept
+        */
+        template <typename TSerializer>
+        class frame_builder
+        {
+        public:
+            typedef typename TSerializer::send_t send_t;
+
+            /**
+            Constructor.
+            @param [in] pool Pool that frame buffers are taken from and given back to
+            */
+            explicit frame_builder(std::shared_ptr<buffer_pool> pool) :
+                pool_(std::move(pool))
+            { }
+
+            /**
+            Serializes a message into a frame.
+            @param [in, out] serializer Serializer used for the message
+            @param [in]      message    Message to serialize, moved into the frame if the payload is sent in place
+            @return Frame ready to be written
+            */
+            frame make(TSerializer& serializer, send_t&& message)
+            {
+                return make(serializer, std::move(message), method_t());
+            }
+
+            /**
+            Serializes a message into a single contiguous buffer.
+            @param [in, out] serializer Serializer used for the message
+            @param [in]      message    Message to serialize
+            @return Serialized message
+            */
+            std::vector<char> make_contiguous(TSerializer& serializer, const send_t& message)
+            {
+                return make_contiguous(serializer, message, has_serialize_into<TSerializer>());
+            }
+
+            /**
+            Serializes a message once so it can be written to many sessions.
+            The buffer goes back to the pool when the last session is done with it.
+            @param [in, out] serializer Serializer used for the message
+            @param [in]      message    Message to serialize
+            @return Shared serialized message
+            */
+            shared_frame make_shared(TSerializer& serializer, const send_t& message)
+            {
+                auto pool = pool_;
+                auto release = [pool](std::vector<char>* buffer)
+                {
+                    pool->release(std::move(*buffer));
+                    delete buffer;
+                };
+                return shared_frame(new std::vector<char>(make_contiguous(serializer, message)), release);
+            }
+
+            /**
+            Gives the buffer of a frame that has been written back to the pool.
+            @param [in, out] written Frame that has been written
+            */
+            void recycle(frame& written)
+            {
+                pool_->release(std::move(written.data));
+            }
+
+        private:
+            struct header_tag {};
+            struct into_tag {};
+            struct serialize_tag {};
+
+            typedef typename std::conditional<has_serialize_header<TSerializer>::value, header_tag,
+                typename std::conditional<has_serialize_into<TSerializer>::value, into_tag, serialize_tag>::type>::type method_t;
+
+            std::shared_ptr<buffer_pool> pool_;
+
+            frame make(TSerializer& serializer, send_t&& message, header_tag)
+            {
+                frame new_frame;
+                if (make_small(serializer, message, new_frame, has_serialize_into<TSerializer>()))
+                    return new_frame;
+
+                new_frame.data = pool_->acquire(serializer.header_size());
+                serializer.serialize_header(message, new_frame.data.data());
+
+                auto owner = std::make_shared<const send_t>(std::move(message));
+                new_frame.body = boost::asio::const_buffer(serializer.body_buffer(*owner));
+                new_frame.owner = std::move(owner);
+                return new_frame;
+            }
+
+            bool make_small(TSerializer& serializer, const send_t& message, frame& new_frame, std::true_type)
+            {
+                auto size = serializer.serialized_size(message);
+                if (size >= SMALL_FRAME_SIZE)
+                    return false;
+
+                new_frame.data = pool_->acquire(size);
+                serializer.serialize_into(message, new_frame.data.data());
+                return true;
+            }
+
+            bool make_small(TSerializer&, const send_t&, frame&, std::false_type)
+            {
+                return false;
+            }
+
+            frame make(TSerializer& serializer, send_t&& message, into_tag)
+            {
+                frame new_frame;
+                new_frame.data = make_contiguous(serializer, message, std::true_type());
+                return new_frame;
+            }
+
+            frame make(TSerializer& serializer, send_t&& message, serialize_tag)
+            {
+                frame new_frame;
+                new_frame.data = serializer.serialize(message);
+                return new_frame;
+            }
+
+            std::vector<char> make_contiguous(TSerializer& serializer, const send_t& message, std::true_type)
+            {
+                auto buffer = pool_->acquire(serializer.serialized_size(message));
+                serializer.serialize_into(message, buffer.data());
+                return buffer;
+            }
+
+            std::vector<char> make_contiguous(TSerializer& serializer, const send_t& message, std::false_type)
+            {
+                return serializer.serialize(message);
+            }
+        };
+    }
+}
@@ -0,0 +1,121 @@
+/**
+@file handler_traits.h
+@author Gary Heckman
+@brief Compile-time detection of the optional parts of the Handler concept.
+*/
+
+#pragma once
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "metrics.h"
+#include "serializer_traits.h"
+#include "session_writer.h"
+
+namespace boost_messaging
+{
+    namespace detail
+    {
+        /**
+        Detects a handler that can take many messages in one call.
+        Requires void handle_batch(const TMessage* first, const TMessage* last).
+        @tparam THandler Type that fulfils the Handler concept
+        @tparam TMessage recv_t of the serializer
+        */
+        template <typename THandler, typename TMessage, typename = void>
+        struct has_handle_batch : std::false_type {};
+
+        template <typename THandler, typename TMessage>
+        struct has_handle_batch<THandler, TMessage, void_t<
+            decltype(std::declval<THandler&>().handle_batch(std::declval<const TMessage*>(), std::declval<const TMessage*>()))>> : std::true_type {};
+
+        /**
+        Detects a handler that wants to write back to its own session.
+        Requires void attach(const session_writer<TSend>& session).
+        @tparam THandler Type that fulfils the Handler concept
+        @tparam TSend    send_t of the serializer
+        */
+        template <typename THandler, typename TSend, typename = void>
+        struct has_attach : std::false_type {};
+
+        template <typename THandler, typename TSend>
+        struct has_attach<THandler, TSend, void_t<
+            decltype(std::declval<THandler&>().attach(std::declval<const session_writer<TSend>&>()))>> : std::true_type {};
+
+        template <typename THandler, typename TComm>
+        void attach_session(THandler& handler, const std::shared_ptr<TComm>& session, std::true_type)
+        {
+            handler.attach(session_writer<typename TComm::send_t>(session));
+        }
+
+        template <typename THandler, typename TComm>
+        void attach_session(THandler&, const std::shared_ptr<TComm>&, std::false_type) { }
+
+        /**
+        Gives a handler a writer for its session, if it takes one.
+        Sessions call this once, before the first message is handled.
+        @param [in, out] handler Handler of the session
+        @param [in]      session Session the handler belongs to
+        */
+        template <typename THandler, typename TComm>
+        void attach_session(THandler& handler, const std::shared_ptr<TComm>& session)
+        {
+            attach_session(handler, session, has_attach<THandler, typename TComm::send_t>());
+        }
+
+        /**
+        Hands decoded messages to a session's handler.
+        Handlers with handle_batch get every message of a read in one call when flush is called;
+        the rest get one handle call per message straight away.
+        Messages that point into a buffer must be flushed before the buffer changes.
+        @tparam THandler Type that fulfils the Handler concept
+        @tparam TMessage recv_t of the serializer
+        */
+        template <typename THandler, typename TMessage>
+        class message_delivery
+        {
+        public:
+            void deliver(THandler& handler, session_metrics& metrics, TMessage&& message)
+            {
+                deliver(handler, metrics, std::move(message), has_handle_batch<THandler, TMessage>());
+            }
+
+            void flush(THandler& handler, session_metrics& metrics)
+            {
+                flush(handler, metrics, has_handle_batch<THandler, TMessage>());
+            }
+
+        private:
+            // Kept between reads so its storage is reused
+            std::vector<TMessage> batch_;
+
+            void deliver(THandler& handler, session_metrics& metrics, TMessage&& message, std::false_type)
+            {
+                auto started = metrics.handler_started();
+                handler.handle(message);
+                metrics.handler_finished(started);
+            }
+
+            void deliver(THandler&, session_metrics&, TMessage&& message, std::true_type)
+            {
+                batch_.push_back(std::move(message));
+            }
+
+            void flush(THandler&, session_metrics&, std::false_type) { }
+
+            void flush(THandler& handler, session_metrics& metrics, std::true_type)
+            {
+                if (batch_.empty())
+                    return;
+
+                auto started = metrics.handler_started();
+                handler.handle_batch(batch_.data(), batch_.data() + batch_.size());
+                metrics.handler_finished(started);
+                batch_.clear();
+            }
+        };
+    }
+}
@@ -0,0 +1,251 @@
+/**
+@file metrics.h
+@author Gary Heckman
+@brief Counters kept by every session.
+@detail
+	Every session counts what it reads and writes with relaxed atomics, so
+	the io threads never wait on anyone reading the counters. Clients and
+	servers add their sessions' counters up into a metrics_snapshot.
+	Define BOOST_MESSAGING_NO_METRICS to compile the counters out.
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace boost_messaging
+{
+    /**
+    Counters of one or more sessions at a point in time.
+    Every counter is zero when metrics are compiled out.
+    */
+    struct metrics_snapshot
+    {
+        // Bucket i counts handler calls that took [2^i, 2^(i + 1)) nanoseconds
+        static const size_t HANDLER_BUCKETS = 40;
+
+        uint64_t sessions = 0;
+        uint64_t messages_in = 0;
+        uint64_t bytes_in = 0;
+        uint64_t messages_out = 0;
+        uint64_t bytes_out = 0;
+        // Messages waiting to be written
+        uint64_t write_queue_depth = 0;
+        // Deepest the write queue has been; the largest one when sessions are added up
+        uint64_t write_queue_high_water = 0;
+        uint64_t handler_calls = 0;
+        uint64_t handler_nanoseconds = 0;
+        std::array<uint64_t, HANDLER_BUCKETS> handler_histogram{};
+
+        /**
+        Adds another snapshot's counters to this one.
+        @param [in] other Snapshot to add
+        @return This snapshot
+        */
+        metrics_snapshot& operator+=(const metrics_snapshot& other)
+        {
+            sessions += other.sessions;
+            messages_in += other.messages_in;
+            bytes_in += other.bytes_in;
+            messages_out += other.messages_out;
+            bytes_out += other.bytes_out;
+            write_queue_depth += other.write_queue_depth;
+            if (other.write_queue_high_water > write_queue_high_water)
+                write_queue_high_water = other.write_queue_high_water;
+            handler_calls += other.handler_calls;
+            handler_nanoseconds += other.handler_nanoseconds;
+            for (size_t i = 0; i < HANDLER_BUCKETS; ++i)
+                handler_histogram[i] += other.handler_histogram[i];
+            return *this;
+        }
+
+        /**
+        Estimates a percentile of the handler time from the histogram.
+        @param [in] fraction Percentile between 0 and 1, like 0.99
+        @return Upper bound in nanoseconds of the bucket the percentile falls in, 0 if there were no calls
+        */
+        uint64_t handler_percentile(double fraction) const
+        {
+            uint64_t total = 0;
+            for (auto count : handler_histogram)
+                total += count;
+            if (total == 0)
+                return 0;
+
+            auto rank = static_cast<uint64_t>(fraction * (total - 1));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < HANDLER_BUCKETS; ++i)
+            {
+                seen += handler_histogram[i];
+                if (seen > rank)
+                    return uint64_t(2) << i;
+            }
+            return uint64_t(2) << (HANDLER_BUCKETS - 1);
+        }
+    };
+
+    namespace detail
+    {
+#ifndef BOOST_MESSAGING_NO_METRICS
+        /**
+        Counters of a single session.
+        Only the session's executor updates them; anyone may take a snapshot at any time.
+        */
+        class session_metrics
+        {
+        public:
+            typedef std::chrono::steady_clock clock_type;
+            typedef clock_type::time_point time_point;
+
+            session_metrics() :
+                messages_in_(0),
+                bytes_in_(0),
+                messages_out_(0),
+                bytes_out_(0),
+                write_queue_depth_(0),
+                write_queue_high_water_(0),
+                handler_calls_(0),
+                handler_nanoseconds_(0)
+            {
+                for (auto& bucket : handler_histogram_)
+                    bucket.store(0, std::memory_order_relaxed);
+            }
+
+            void received(size_t bytes)
+            {
+                add(messages_in_, 1);
+                add(bytes_in_, bytes);
+            }
+
+            void sent(size_t messages, size_t bytes)
+            {
+                add(messages_out_, messages);
+                add(bytes_out_, bytes);
+            }
+
+            void write_queue_depth(size_t depth)
+            {
+                write_queue_depth_.store(depth, std::memory_order_relaxed);
+                if (depth > write_queue_high_water_.load(std::memory_order_relaxed))
+                    write_queue_high_water_.store(depth, std::memory_order_relaxed);
+            }
+
+            time_point handler_started() const
+            {
+                return clock_type::now();
+            }
+
+            void handler_finished(time_point started)
+            {
+                auto nanoseconds = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - started).count());
+                add(handler_calls_, 1);
+                add(handler_nanoseconds_, nanoseconds);
+                add(handler_histogram_[bucket(nanoseconds)], 1);
+            }
+
+            /**
+            Adds this session's counters to a snapshot.
+            @param [in, out] snapshot Snapshot to add to
+            */
+            void snapshot(metrics_snapshot& snapshot) const
+            {
+                metrics_snapshot own;
+                own.sessions = 1;
+                own.messages_in = messages_in_.load(std::memory_order_relaxed);
+                own.bytes_in = bytes_in_.load(std::memory_order_relaxed);
+                own.messages_out = messages_out_.load(std::memory_order_relaxed);
+                own.bytes_out = bytes_out_.load(std::memory_order_relaxed);
+                own.write_queue_depth = write_queue_depth_.load(std::memory_order_relaxed);
+                own.write_queue_high_water = write_queue_high_water_.load(std::memory_order_relaxed);
+                own.handler_calls = handler_calls_.load(std::memory_order_relaxed);
+                own.handler_nanoseconds = handler_nanoseconds_.load(std::memory_order_relaxed);
+                for (size_t i = 0; i < metrics_snapshot::HANDLER_BUCKETS; ++i)
+                    own.handler_histogram[i] = handler_histogram_[i].load(std::memory_order_relaxed);
+                snapshot += own;
+            }
+
+        private:
+            std::atomic<uint64_t> messages_in_;
+            std::atomic<uint64_t> bytes_in_;
+            std::atomic<uint64_t> messages_out_;
+            std::atomic<uint64_t> bytes_out_;
+            std::atomic<uint64_t> write_queue_depth_;
+            std::atomic<uint64_t> write_queue_high_water_;
+            std::atomic<uint64_t> handler_calls_;
+            std::atomic<uint64_t> handler_nanoseconds_;
+            std::array<std::atomic<uint64_t>, metrics_snapshot::HANDLER_BUCKETS> handler_histogram_;
+
+            // There is a single writer, so a load and a store is enough and avoids a locked add.
+            static void add(std::atomic<uint64_t>& counter, uint64_t amount)
+            {
+                counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+            }
+
+            static size_t bucket(uint64_t nanoseconds)
+            {
+                size_t i = 0;
+                while (nanoseconds > 1 && i + 1 < metrics_snapshot::HANDLER_BUCKETS)
+                {
+                    nanoseconds >>= 1;
+                    ++i;
+                }
+                return i;
+            }
+        };
+
+        /**
+        Counters of sessions that have closed, so the totals never go backwards.
+        Any thread may add to it.
+        */
+        class retired_metrics
+        {
+        public:
+            void retire(const session_metrics& metrics)
+            {
+                metrics_snapshot snapshot;
+                metrics.snapshot(snapshot);
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                snapshot.sessions = 0;
+                snapshot.write_queue_depth = 0;
+                totals_ += snapshot;
+            }
+
+            void snapshot(metrics_snapshot& snapshot) const
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                snapshot += totals_;
+            }
+
+        private:
+            mutable std::mutex mutex_;
+            metrics_snapshot totals_;
+        };
+#else
+        class session_metrics
+        {
+        public:
+            struct time_point {};
+
+            void received(size_t) {}
+            void sent(size_t, size_t) {}
+            void write_queue_depth(size_t) {}
+            time_point handler_started() const { return time_point(); }
+            void handler_finished(time_point) {}
+            void snapshot(metrics_snapshot&) const {}
+        };
+
+        class retired_metrics
+        {
+        public:
+            void retire(const session_metrics&) {}
+            void snapshot(metrics_snapshot&) const {}
+        };
+#endif
+    }
+}
@@ -0,0 +1,203 @@
+/**
+@author Gary Heckman
+@file pod_serializer.h
+@brief Binary serializer for fixed-layout messages
+@detail
+	Serializer for use with the boost messaging library. It fulfils the
+	Serializer concept. See README for more information.
+
+	Wire format:
+		type id (4, big endian) | bytes of the struct
+	The type id is the index of the struct's type in the serializer's list, so
+	both ends must list the same types in the same order. The struct itself is
+	copied as is, so both ends must also agree on its layout and byte order.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+
+#include <boost/endian/conversion.hpp>
+#include <boost/variant.hpp>
+
+namespace boost_messaging
+{
+	namespace detail
+	{
+		template <bool... Bs>
+		struct bool_pack;
+
+		/**
+		True if every value is true.
+		*/
+		template <bool... Bs>
+		struct all_true : std::is_same<bool_pack<true, Bs...>, bool_pack<Bs..., true>> {};
+
+		/**
+		Gets the address of whichever struct a variant holds.
+		*/
+		struct pod_address_visitor : boost::static_visitor<const void*>
+		{
+			template <typename T>
+			const void* operator()(const T& value) const
+			{
+				return &value;
+			}
+		};
+	}
+
+	/**
+	Serializer for trivially copyable structs.
+	Messages are a variant of the listed structs. The header holds the index of the
+	struct's type, which also fixes the body size, and the body is copied with memcpy.
+	Decoding a message is a single load, a table lookup and a memcpy.
+	@tparam Ts Trivially copyable structs, without duplicates
+	*/
+	template <typename... Ts>
+	class pod_serializer
+	{
+		static_assert(sizeof...(Ts) > 0, "pod_serializer needs at least one type");
+		static_assert(detail::all_true<std::is_trivially_copyable<Ts>::value...>::value, "pod_serializer only handles trivially copyable types");
+
+	public:
+		typedef boost::variant<Ts...> send_t;
+		typedef send_t recv_t;
+
+		pod_serializer() :
+			type_id_(0)
+		{ }
+
+		/**
+		Gets the header size.
+		@return The header size.
+		*/
+		constexpr size_t header_size() const
+		{
+			return sizeof(uint32_t);
+		}
+
+		/**
+		Gets the body size, which is the size of the struct named by the header.
+		The type id is remembered for the deserialize call that follows.
+		@tparam FwdIter Forward iterator
+		@param [in] first Iterator to the first character in the header
+		@param [in] last  Iterator past the last character in the header
+		*/
+		template <typename FwdIter>
+		size_t body_size(FwdIter first, FwdIter last)
+		{
+			uint32_t type_id = 0;
+			for (; first != last; ++first)
+				type_id = (type_id << 8) | static_cast<unsigned char>(*first);
+			return body_size(type_id);
+		}
+
+		/**
+		Gets the body size straight out of a buffer with a single load.
+		@param [in] first Pointer to the first character in the header, which is always a whole header
+		*/
+		size_t body_size(const char* first, const char*)
+		{
+			uint32_t type_id;
+			std::memcpy(&type_id, first, sizeof(type_id));
+			return body_size(boost::endian::big_to_native(type_id));
+		}
+
+		/**
+		Checks that the header names one of the types.
+		@tparam FwdIter Forward iterator
+		@param [in] first Iterator to the first character in the header
+		@param [in] last  Iterator past the last character in the header
+		@return True if the header is valid, false otherwise
+		*/
+		template <typename FwdIter>
+		bool validate_header(FwdIter first, FwdIter last) const
+		{
+			if (std::distance(first, last) != static_cast<std::ptrdiff_t>(header_size()))
+				return false;
+
+			uint32_t type_id = 0;
+			for (; first != last; ++first)
+				type_id = (type_id << 8) | static_cast<unsigned char>(*first);
+			return type_id < sizeof...(Ts);
+		}
+
+		/**
+		Serializes a message into a new buffer.
+		@param [in] send_msg Message to send
+		@return Serialized message
+		*/
+		std::vector<char> serialize(const send_t& send_msg) const
+		{
+			std::vector<char> buffer(serialized_size(send_msg));
+			serialize_into(send_msg, buffer.data());
+			return buffer;
+		}
+
+		/**
+		Gets the size of the serialized message.
+		@param [in] send_msg Message to send
+		@return Size of the header and body in bytes
+		*/
+		size_t serialized_size(const send_t& send_msg) const
+		{
+			return header_size() + sizes()[send_msg.which()];
+		}
+
+		/**
+		Serializes a message into a caller-provided buffer.
+		@param [in]  send_msg Message to send
+		@param [out] first    Start of a buffer at least serialized_size(send_msg) bytes long
+		*/
+		void serialize_into(const send_t& send_msg, char* first) const
+		{
+			auto type_id = boost::endian::native_to_big(static_cast<uint32_t>(send_msg.which()));
+			std::memcpy(first, &type_id, sizeof(type_id));
+			std::memcpy(first + header_size(), boost::apply_visitor(detail::pod_address_visitor(), send_msg), sizes()[send_msg.which()]);
+		}
+
+		/**
+		Deserializes the struct named by the header passed to the last body_size call.
+		@param [in] first Pointer to the first character in the body
+		@param [in] last  Pointer past the last character in the body
+		@return Deserialized message
+		*/
+		recv_t deserialize(const char* first, const char* last) const
+		{
+			typedef recv_t(*decoder_t)(const char*, size_t);
+			static const decoder_t decoders[] = { &decode<Ts>... };
+			return decoders[type_id_](first, static_cast<size_t>(last - first));
+		}
+
+	private:
+		uint32_t type_id_;
+
+		static const size_t* sizes()
+		{
+			static const size_t sizes[] = { sizeof(Ts)... };
+			return sizes;
+		}
+
+		// Unknown ids get a body size of 0 and decode as the first type; validate_header rejects them.
+		size_t body_size(uint32_t type_id)
+		{
+			type_id_ = type_id < sizeof...(Ts) ? type_id : 0;
+			return type_id < sizeof...(Ts) ? sizes()[type_id] : 0;
+		}
+
+		// A short body leaves the rest of the struct zeroed rather than reading past the buffer
+		template <typename T>
+		static recv_t decode(const char* first, size_t size)
+		{
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type storage = {};
+			std::memcpy(&storage, first, std::min(size, sizeof(T)));
+			return recv_t(*reinterpret_cast<const T*>(&storage));
+		}
+	};
+}
@@ -0,0 +1,829 @@
+/**
+@file pubsub.h
+@author Gary Heckman
+@brief Topic subscriptions that the server filters on.
+@detail
+	Clients tell the server which topics they want with subscribe and
+	unsubscribe control frames, and the server keeps an index from topics to
+	sessions. pubsub_server::publish serializes a message once and writes it
+	only to the sessions with a matching subscription, instead of to every
+	client for them to filter.
+
+	Topics are levels split by '/'. A subscription is either an exact topic
+	or a pattern, where a '+' level matches any one level and a final '#'
+	level matches any number of levels, including none, so "prices/#" is a
+	prefix subscription. Exact subscriptions are found with one hash lookup
+	and patterns with a walk down a trie of levels.
+
+	topic_serializer wraps any type that fulfils the Serializer concept.
+	Both ends must use the adaptor with the same inner serializer.
+	Wire format, big endian:
+		kind (1) | topic size (2) | size of the rest (4) | topic | inner frame
+	Control frames have no inner frame.
+
+	Subscriptions belong to sessions, so this works over the connection
+	protocols: tcp, unix domain stream and shared memory.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include "client.h"
+#include "dispatch.h"
+#include "handler_traits.h"
+#include "server.h"
+#include "session_writer.h"
+
+namespace boost_messaging
+{
+    /**
+    What a topic frame is for.
+    */
+    enum class topic_kind : uint8_t
+    {
+        message = 0,
+        subscribe = 1,
+        unsubscribe = 2
+    };
+
+    /**
+    Message along with its topic. Control frames carry a subscription in topic and leave body empty.
+    @tparam T Message of the inner serializer
+    */
+    template <typename T>
+    struct topic_message
+    {
+        topic_kind kind;
+        std::string topic;
+        T body;
+    };
+
+    template <typename T>
+    struct owned_message<topic_message<T>>
+    {
+        typedef topic_message<typename owned_message<T>::type> type;
+
+        static type own(const topic_message<T>& message) { return type{ message.kind, message.topic, owned_message<T>::own(message.body) }; }
+    };
+
+    /**
+    Serializer adaptor that carries a topic, and subscription control frames, around the inner serializer's frames.
+    recv_t's body is the inner serializer's; a view points into the read buffer as usual.
+    Sessions turn malformed frames down through try_deserialize, so a bad peer only loses its own session;
+    deserialize throws std::runtime_error on them instead. Topics longer than MAX_TOPIC_SIZE can't be sent.
+    @tparam TSerializer Type that fulfils the Serializer concept
+    */
+    template <typename TSerializer>
+    class topic_serializer
+    {
+    public:
+        typedef topic_message<typename TSerializer::send_t> send_t;
+        typedef topic_message<typename TSerializer::recv_t> recv_t;
+
+        static const size_t MAX_TOPIC_SIZE = 0xffff;
+
+        topic_serializer() :
+            kind_(topic_kind::message),
+            topic_size_(0),
+            inner_size_(0)
+        { }
+
+        /**
+        Gets the header size.
+        @return The header size.
+        */
+        constexpr size_t header_size() const
+        {
+            return HEADER_SIZE;
+        }
+
+        /**
+        Gets the body size, which covers the topic and the inner frame, and keeps the kind and topic size for deserialize.
+        @tparam FwdIter Forward iterator
+        @param [in] first Iterator to the first character in the header, which is always a whole header
+        */
+        template <typename FwdIter>
+        size_t body_size(FwdIter first, FwdIter)
+        {
+            kind_ = static_cast<topic_kind>(static_cast<unsigned char>(*first++));
+            topic_size_ = get(first, 2);
+            return topic_size_ + get(std::next(first, 2), 4);
+        }
+
+        /**
+        Checks the header to make sure it is a reasonable value.
+        @tparam FwdIter Forward iterator
+        @param [in] first Iterator to the first character in the header
+        @param [in] last  Iterator past the last character in the header
+        @return True if the header is valid, false otherwise
+        */
+        template <typename FwdIter>
+        bool validate_header(FwdIter first, FwdIter last) const
+        {
+            return std::distance(first, last) == static_cast<std::ptrdiff_t>(HEADER_SIZE) && static_cast<unsigned char>(*first) <= static_cast<unsigned char>(topic_kind::unsubscribe);
+        }
+
+        /**
+        Serializes a message into a new buffer.
+        @param [in] send_msg Message to send
+        @return Serialized message
+        */
+        std::vector<char> serialize(const send_t& send_msg)
+        {
+            if (send_msg.kind != topic_kind::message)
+            {
+                std::vector<char> frame(HEADER_SIZE + send_msg.topic.size());
+                put_header(send_msg, 0, frame.data());
+                return frame;
+            }
+
+            auto inner = inner_.serialize(send_msg.body);
+            std::vector<char> frame(HEADER_SIZE + send_msg.topic.size() + inner.size());
+            put_header(send_msg, inner.size(), frame.data());
+            std::copy(inner.begin(), inner.end(), frame.begin() + HEADER_SIZE + send_msg.topic.size());
+            return frame;
+        }
+
+        /**
+        Gets the size of the serialized message, when the inner serializer can write into a buffer.
+        @param [in] send_msg Message to send
+        @return Size of the header and body in bytes
+        */
+        template <typename S = TSerializer>
+        auto serialized_size(const send_t& send_msg) -> decltype(std::declval<S&>().serialized_size(send_msg.body), size_t())
+        {
+            size_inner(send_msg);
+            prepared_.keep(send_msg);
+            return HEADER_SIZE + send_msg.topic.size() + inner_size_;
+        }
+
+        template <typename S = TSerializer>
+        auto serialize_into(const send_t& send_msg, char* first) -> decltype(std::declval<S&>().serialize_into(send_msg.body, first), void())
+        {
+            // The inner size was just worked out for the same message, unless serialize_into was called on its own
+            if (!prepared_.take(send_msg))
+                size_inner(send_msg);
+
+            put_header(send_msg, inner_size_, first);
+            if (send_msg.kind == topic_kind::message)
+                inner_.serialize_into(send_msg.body, first + HEADER_SIZE + send_msg.topic.size());
+        }
+
+        /**
+        Deserializes a message with the kind and topic size from the last header.
+        @param [in] first Pointer to the first character in the body
+        @param [in] last  Pointer past the last character in the body
+        @return Message with its topic, and a body made by the inner serializer if it has one
+        */
+        recv_t deserialize(const char* first, const char* last)
+        {
+            recv_t message = recv_t();
+            if (!try_deserialize(first, last, message))
+                throw std::runtime_error("topic message is malformed");
+            return message;
+        }
+
+        /**
+        Deserializes a message with the kind and topic size from the last header, unless the frame is malformed.
+        @param [in]  first   Pointer to the first character in the body
+        @param [in]  last    Pointer past the last character in the body
+        @param [out] message Set to the message with its topic, and a body made by the inner serializer if it has one
+        @return False if the topic or the inner frame doesn't fit the body, or the inner serializer turned it down
+        */
+        bool try_deserialize(const char* first, const char* last, recv_t& message)
+        {
+            if (static_cast<size_t>(last - first) < topic_size_)
+                return false;
+
+            message.kind = kind_;
+            message.topic.assign(first, topic_size_);
+            first += topic_size_;
+            if (kind_ != topic_kind::message)
+                return first == last;
+
+            auto inner_header_size = inner_.header_size();
+            if (static_cast<size_t>(last - first) < inner_header_size)
+                return false;
+
+            auto body_begin = first + inner_header_size;
+            if (!inner_.validate_header(first, body_begin) || inner_.body_size(first, body_begin) != static_cast<size_t>(last - body_begin))
+                return false;
+
+            return detail::deserialize_into(inner_, body_begin, last, message.body);
+        }
+
+    private:
+        static const size_t HEADER_SIZE = 7;
+
+        TSerializer inner_;
+        // Read from the header by body_size
+        topic_kind kind_;
+        size_t topic_size_;
+        // Inner frame size of the message serialized_size was last called for
+        detail::prepared_message<send_t> prepared_;
+        size_t inner_size_;
+
+        // Works out the inner frame size, when the inner serializer can write into a buffer.
+        template <typename S = TSerializer>
+        auto size_inner(const send_t& send_msg) -> decltype(std::declval<S&>().serialized_size(send_msg.body), void())
+        {
+            inner_size_ = send_msg.kind == topic_kind::message ? inner_.serialized_size(send_msg.body) : 0;
+        }
+
+        template <typename FwdIter>
+        static size_t get(FwdIter first, size_t bytes)
+        {
+            size_t value = 0;
+            for (size_t i = 0; i < bytes; ++i, ++first)
+                value = (value << 8) | static_cast<unsigned char>(*first);
+            return value;
+        }
+
+        static void put(char* first, size_t value, size_t bytes)
+        {
+            for (size_t i = bytes; i-- > 0; value >>= 8)
+                first[i] = static_cast<char>(value & 0xff);
+        }
+
+        // The topic must be at most MAX_TOPIC_SIZE bytes long; pubsub_server and pubsub_client check it before writing.
+        static void put_header(const send_t& send_msg, size_t inner_size, char* first)
+        {
+            first[0] = static_cast<char>(send_msg.kind);
+            put(first + 1, send_msg.topic.size(), 2);
+            put(first + 3, inner_size, 4);
+            std::copy(send_msg.topic.begin(), send_msg.topic.end(), first + HEADER_SIZE);
+        }
+    };
+
+    namespace detail
+    {
+        /**
+        Thread-safe index from subscriptions to the sessions that made them.
+        Exact topics are kept in a hash map; patterns in a trie with one node per level,
+        where '+' and '#' are children like any other level.
+        */
+        class topic_index
+        {
+        public:
+            /**
+            Checks whether a subscription has wildcards.
+            @param [in] subscription Topic or pattern
+            @return True if any level is '+' or '#'
+            */
+            static bool is_pattern(boost::string_view subscription)
+            {
+                bool pattern = false;
+                for_each_level(subscription, [&pattern](boost::string_view level) { pattern = pattern || level == "+" || level == "#"; });
+                return pattern;
+            }
+
+            /**
+            Adds a subscription for a session.
+            @param [in] subscription Topic or pattern; '#' may only be the last level
+            @param [in] id           Id of the session
+            @return False if the session already had it, or the pattern is malformed
+            */
+            bool subscribe(const std::string& subscription, session_id_t id)
+            {
+                if (!is_pattern(subscription))
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    return add(exact_[subscription], id);
+                }
+
+                auto levels = split(subscription);
+                for (size_t i = 0; i + 1 < levels.size(); ++i)
+                    if (levels[i] == "#")
+                        return false;
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto target = &root_;
+                for (auto level : levels)
+                {
+                    auto& child = target->children[level.to_string()];
+                    if (!child)
+                        child.reset(new node());
+                    target = child.get();
+                }
+                return add(target->sessions, id);
+            }
+
+            /**
+            Removes a subscription of a session.
+            @param [in] subscription Topic or pattern, as it was subscribed
+            @param [in] id           Id of the session
+            @return False if the session didn't have it
+            */
+            bool unsubscribe(const std::string& subscription, session_id_t id)
+            {
+                if (!is_pattern(subscription))
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto found = exact_.find(subscription);
+                    if (found == exact_.end() || !remove(found->second, id))
+                        return false;
+                    if (found->second.empty())
+                        exact_.erase(found);
+                    return true;
+                }
+
+                auto levels = split(subscription);
+                std::lock_guard<std::mutex> lock(mutex_);
+                bool removed = false;
+                prune(root_, levels, 0, id, removed);
+                return removed;
+            }
+
+            /**
+            Finds every session with a subscription that matches a topic.
+            @param [in]  topic Topic of a message
+            @param [out] ids   Gets the ids of the sessions, each once, in ascending order
+            */
+            void match(boost::string_view topic, std::vector<session_id_t>& ids)
+            {
+                ids.clear();
+                // Reused between calls so publishing doesn't allocate
+                thread_local std::vector<boost::string_view> levels;
+                thread_local std::string key;
+                levels.clear();
+                for_each_level(topic, [](boost::string_view level) { levels.push_back(level); });
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    key.assign(topic.data(), topic.size());
+                    auto found = exact_.find(key);
+                    if (found != exact_.end())
+                        ids.insert(ids.end(), found->second.begin(), found->second.end());
+                    if (!root_.children.empty())
+                        walk(root_, levels, 0, key, ids);
+                }
+
+                // A session with several matching subscriptions gets the message once
+                std::sort(ids.begin(), ids.end());
+                ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            }
+
+        private:
+            struct node
+            {
+                std::unordered_map<std::string, std::unique_ptr<node>> children;
+                std::vector<session_id_t> sessions;
+            };
+
+            std::mutex mutex_;
+            std::unordered_map<std::string, std::vector<session_id_t>> exact_;
+            node root_;
+
+            template <typename TFunction>
+            static void for_each_level(boost::string_view topic, TFunction&& function)
+            {
+                for (;;)
+                {
+                    auto end = topic.find('/');
+                    function(topic.substr(0, end));
+                    if (end == boost::string_view::npos)
+                        return;
+                    topic.remove_prefix(end + 1);
+                }
+            }
+
+            static std::vector<boost::string_view> split(boost::string_view topic)
+            {
+                std::vector<boost::string_view> levels;
+                for_each_level(topic, [&levels](boost::string_view level) { levels.push_back(level); });
+                return levels;
+            }
+
+            static bool add(std::vector<session_id_t>& sessions, session_id_t id)
+            {
+                if (std::find(sessions.begin(), sessions.end(), id) != sessions.end())
+                    return false;
+                sessions.push_back(id);
+                return true;
+            }
+
+            static bool remove(std::vector<session_id_t>& sessions, session_id_t id)
+            {
+                auto found = std::find(sessions.begin(), sessions.end(), id);
+                if (found == sessions.end())
+                    return false;
+                *found = sessions.back();
+                sessions.pop_back();
+                return true;
+            }
+
+            // Removes the subscription and any nodes it leaves empty. Returns true if this node is now empty.
+            static bool prune(node& current, const std::vector<boost::string_view>& levels, size_t depth, session_id_t id, bool& removed)
+            {
+                if (depth == levels.size())
+                    removed = remove(current.sessions, id);
+                else
+                {
+                    auto child = current.children.find(levels[depth].to_string());
+                    if (child != current.children.end() && prune(*child->second, levels, depth + 1, id, removed))
+                        current.children.erase(child);
+                }
+                return current.sessions.empty() && current.children.empty();
+            }
+
+            // '#' matches the rest of the topic, '+' and the level itself match one level.
+            static void walk(const node& current, const std::vector<boost::string_view>& levels, size_t depth, std::string& key, std::vector<session_id_t>& ids)
+            {
+                key.assign("#");
+                auto rest = current.children.find(key);
+                if (rest != current.children.end())
+                    ids.insert(ids.end(), rest->second->sessions.begin(), rest->second->sessions.end());
+
+                if (depth == levels.size())
+                {
+                    ids.insert(ids.end(), current.sessions.begin(), current.sessions.end());
+                    return;
+                }
+
+                key.assign(levels[depth].data(), levels[depth].size());
+                auto exact = current.children.find(key);
+                if (exact != current.children.end())
+                    walk(*exact->second, levels, depth + 1, key, ids);
+
+                key.assign("+");
+                auto any = current.children.find(key);
+                if (any != current.children.end())
+                    walk(*any->second, levels, depth + 1, key, ids);
+            }
+        };
+
+        /**
+        Handler of a pubsub_server's sessions.
+        Keeps the index up to date with the session's control frames and hands messages to THandler.
+        The session's subscriptions are dropped when the session goes away.
+        @tparam THandler    Type that fulfils the Handler concept for topic_message<recv_t>
+        @tparam TSerializer Inner serializer of the server's topic_serializer
+        */
+        template <typename THandler, typename TSerializer>
+        class subscription_handler
+        {
+        public:
+            typedef topic_message<typename TSerializer::send_t> send_t;
+
+            subscription_handler() :
+                id_(0)
+            { }
+
+            explicit subscription_handler(std::shared_ptr<topic_index> index) :
+                index_(std::move(index)),
+                id_(0)
+            { }
+
+            // Copies are handlers for other sessions, so they start with no subscriptions and a new THandler.
+            subscription_handler(const subscription_handler& other) :
+                index_(other.index_),
+                id_(0)
+            { }
+
+            subscription_handler& operator=(const subscription_handler&) = delete;
+
+            ~subscription_handler()
+            {
+                if (!index_)
+                    return;
+                for (const auto& subscription : subscriptions_)
+                    index_->unsubscribe(subscription, id_);
+            }
+
+            void attach(const session_writer<send_t>& session)
+            {
+                id_ = session.id();
+                attach_session(session, has_attach<THandler, send_t>());
+            }
+
+            template <typename T>
+            void handle(const topic_message<T>& message)
+            {
+                switch (message.kind)
+                {
+                case topic_kind::subscribe:
+                    if (index_ && id_ != 0 && index_->subscribe(message.topic, id_))
+                        subscriptions_.insert(message.topic);
+                    break;
+                case topic_kind::unsubscribe:
+                    if (subscriptions_.erase(message.topic) != 0)
+                        index_->unsubscribe(message.topic, id_);
+                    break;
+                default:
+                    handler_.handle(message);
+                    break;
+                }
+            }
+
+        private:
+            std::shared_ptr<topic_index> index_;
+            session_id_t id_;
+            std::set<std::string> subscriptions_;
+            THandler handler_;
+
+            void attach_session(const session_writer<send_t>& session, std::true_type)
+            {
+                handler_.attach(session);
+            }
+
+            void attach_session(const session_writer<send_t>&, std::false_type) { }
+        };
+
+        /**
+        Subscriptions of a pubsub_client, kept so every new session can make them again.
+        */
+        class subscription_set
+        {
+        public:
+            /**
+            Adds or removes a subscription and tells the server while still holding the set,
+            so a session that is starting sees either the set before or after the change, and the
+            control frames go out in the order the changes were made.
+            @param [in] subscription Topic or pattern
+            @param [in] add          True to subscribe, false to unsubscribe
+            @param [in] tell         Writes the control frame, returns false if it was kept out
+            @return False if nothing changed, or the control frame was kept out and the change undone
+            */
+            template <typename TTell>
+            bool change(const std::string& subscription, bool add, TTell&& tell)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto changed = add ? subscriptions_.insert(subscription).second : subscriptions_.erase(subscription) != 0;
+                if (!changed)
+                    return false;
+                if (tell())
+                    return true;
+
+                if (add)
+                    subscriptions_.erase(subscription);
+                else
+                    subscriptions_.insert(subscription);
+                return false;
+            }
+
+            /**
+            Calls a function with every subscription, holding the set.
+            @param [in] function Called with a const std::string& for each subscription
+            */
+            template <typename TFunction>
+            void for_each(TFunction&& function) const
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (const auto& subscription : subscriptions_)
+                    function(subscription);
+            }
+
+        private:
+            mutable std::mutex mutex_;
+            std::set<std::string> subscriptions_;
+        };
+
+        /**
+        Handler of a pubsub_client's sessions.
+        Subscribes every new session to the client's subscriptions before anything else is written, then hands messages to THandler.
+        @tparam THandler    Type that fulfils the Handler concept for topic_message<recv_t>
+        @tparam TSerializer Inner serializer of the client's topic_serializer
+        */
+        template <typename THandler, typename TSerializer>
+        class subscriber_handler
+        {
+        public:
+            typedef topic_message<typename TSerializer::send_t> send_t;
+
+            subscriber_handler() { }
+
+            explicit subscriber_handler(std::shared_ptr<const subscription_set> subscriptions) :
+                subscriptions_(std::move(subscriptions))
+            { }
+
+            // Copies are handlers for other sessions, so they get a new THandler.
+            subscriber_handler(const subscriber_handler& other) :
+                subscriptions_(other.subscriptions_)
+            { }
+
+            subscriber_handler& operator=(const subscriber_handler&) = delete;
+
+            void attach(const session_writer<send_t>& session)
+            {
+                if (subscriptions_)
+                {
+                    subscriptions_->for_each([&session](const std::string& subscription)
+                    {
+                        session.write(send_t{ topic_kind::subscribe, subscription, typename TSerializer::send_t() });
+                    });
+                }
+                attach_session(session, has_attach<THandler, send_t>());
+            }
+
+            template <typename T>
+            void handle(const topic_message<T>& message)
+            {
+                handler_.handle(message);
+            }
+
+        private:
+            std::shared_ptr<const subscription_set> subscriptions_;
+            THandler handler_;
+
+            void attach_session(const session_writer<send_t>& session, std::true_type)
+            {
+                handler_.attach(session);
+            }
+
+            void attach_session(const session_writer<send_t>&, std::false_type) { }
+        };
+    }
+
+    /**
+    Server that writes each published message only to the sessions subscribed to its topic.
+    Messages that clients write go to THandler like on any server.
+    @tparam TProtocol   boost::asio::ip::tcp, boost::asio::local::stream_protocol or shared_memory_protocol
+    @tparam TSerializer Inner serializer, the same as the clients'
+    @tparam THandler    Type that fulfils the Handler concept for topic_message<recv_t>; use dispatching_handler to run it on workers
+    @tparam TThreading  Either single_threaded or multi_threaded
+    */
+    template <typename TProtocol, typename TSerializer, typename THandler, typename TThreading = single_threaded>
+    class pubsub_server
+    {
+    public:
+        typedef typename TSerializer::send_t body_t;
+        typedef topic_message<body_t> send_t;
+        typedef server<TProtocol, topic_serializer<TSerializer>, detail::subscription_handler<THandler, TSerializer>, TThreading> server_t;
+        typedef typename server_t::endpoint_t endpoint_t;
+
+        /**
+        Constructor.
+        @param [in, out] io_service Facilitates async operations
+        @param [in]      endpoint   Endpoint to accept connections on
+        @param [in]      options    Tunable settings for each session
+        */
+        pubsub_server(io_service& io_service, const endpoint_t& endpoint, const comm_options& options = comm_options()) :
+            index_(std::make_shared<detail::topic_index>()),
+            server_(io_service, endpoint, options, detail::subscription_handler<THandler, TSerializer>(index_))
+        { }
+
+        pubsub_server(const pubsub_server&) = delete;
+        pubsub_server& operator=(const pubsub_server&) = delete;
+
+        /**
+        Writes a message to every session subscribed to its topic.
+        The message is serialized once, and not at all if nobody is subscribed.
+        @param [in] topic    Topic of the message, without wildcards, at most topic_serializer's MAX_TOPIC_SIZE bytes long
+        @param [in] send_msg Message to be sent
+        @return True if any message was written, false otherwise.
+        */
+        bool publish(const std::string& topic, body_t send_msg)
+        {
+            if (topic.size() > topic_serializer<TSerializer>::MAX_TOPIC_SIZE)
+                return false;
+
+            thread_local std::vector<session_id_t> ids;
+            index_->match(topic, ids);
+            return !ids.empty() && server_.write_sessions(send_t{ topic_kind::message, topic, std::move(send_msg) }, ids);
+        }
+
+        /**
+        Counts the sessions that a message on a topic would go to.
+        @param [in] topic Topic of a message
+        @return Number of subscribed sessions
+        */
+        size_t subscribers(const std::string& topic) const
+        {
+            std::vector<session_id_t> ids;
+            index_->match(topic, ids);
+            return ids.size();
+        }
+
+        /**
+        Gets the counters of the server's sessions without stopping them.
+        @return Counters added up over every session
+        */
+        metrics_snapshot metrics() const
+        {
+            return server_.metrics();
+        }
+
+        /**
+        Gets the endpoint the server is bound to.
+        @return Local endpoint
+        */
+        endpoint_t local_endpoint() const
+        {
+            return server_.local_endpoint();
+        }
+
+    private:
+        std::shared_ptr<detail::topic_index> index_;
+        server_t server_;
+    };
+
+    /**
+    Client that gets the messages of the topics it subscribes to.
+    Subscriptions are kept and made again every time the client reconnects.
+    @tparam TProtocol   boost::asio::ip::tcp, boost::asio::local::stream_protocol or shared_memory_protocol
+    @tparam TSerializer Inner serializer, the same as the server's
+    @tparam THandler    Type that fulfils the Handler concept for topic_message<recv_t>
+    @tparam TThreading  Either single_threaded or multi_threaded
+    */
+    template <typename TProtocol, typename TSerializer, typename THandler, typename TThreading = single_threaded>
+    class pubsub_client
+    {
+    public:
+        typedef typename TSerializer::send_t body_t;
+        typedef topic_message<body_t> send_t;
+        typedef client<TProtocol, topic_serializer<TSerializer>, detail::subscriber_handler<THandler, TSerializer>, TThreading> client_t;
+
+        /**
+        Constructor.
+        Resolves and connects in the background, like client.
+        @param [in, out] io_service Facilitates async operations
+        @param [in]      host       IP or hostname of the server, or the path of a unix domain or shared memory server
+        @param [in]      port       Port number or port protocol name, ignored for unix domain and shared memory servers
+        @param [in]      options    Tunable settings for the session
+        */
+        pubsub_client(io_service& io_service, const std::string& host, const std::string& port, const comm_options& options = comm_options()) :
+            subscriptions_(std::make_shared<detail::subscription_set>()),
+            client_(io_service, host, port, options, detail::subscriber_handler<THandler, TSerializer>(subscriptions_))
+        { }
+
+        pubsub_client(const pubsub_client&) = delete;
+        pubsub_client& operator=(const pubsub_client&) = delete;
+
+        /**
+        Subscribes to a topic or pattern.
+        @param [in] subscription Topic, or pattern where a '+' level matches one level and a final '#' level matches the rest
+        @return False if the client was already subscribed, the subscription is longer than topic_serializer's MAX_TOPIC_SIZE,
+                or the write queue limits or the pending limit kept the request out and it wasn't made
+        */
+        bool subscribe(const std::string& subscription)
+        {
+            if (subscription.size() > topic_serializer<TSerializer>::MAX_TOPIC_SIZE)
+                return false;
+
+            return subscriptions_->change(subscription, true, [&] { return client_.write(send_t{ topic_kind::subscribe, subscription, body_t() }); });
+        }
+
+        /**
+        Drops a subscription made with subscribe.
+        @param [in] subscription Topic or pattern, as it was subscribed
+        @return False if the client wasn't subscribed, or the write queue limits or the pending limit kept the request out and it wasn't dropped
+        */
+        bool unsubscribe(const std::string& subscription)
+        {
+            if (subscription.size() > topic_serializer<TSerializer>::MAX_TOPIC_SIZE)
+                return false;
+
+            return subscriptions_->change(subscription, false, [&] { return client_.write(send_t{ topic_kind::unsubscribe, subscription, body_t() }); });
+        }
+
+        /**
+        Writes a message to the server's handler.
+        @param [in] topic    Topic of the message, at most topic_serializer's MAX_TOPIC_SIZE bytes long
+        @param [in] send_msg Message to be sent, moved all the way into the session
+        @return False if the topic is too long, or the write queue limits or the pending limit kept the message out
+        */
+        bool write(const std::string& topic, body_t send_msg)
+        {
+            if (topic.size() > topic_serializer<TSerializer>::MAX_TOPIC_SIZE)
+                return false;
+
+            return client_.write(send_t{ topic_kind::message, topic, std::move(send_msg) });
+        }
+
+        /**
+        Gets the counters of the client's sessions without stopping them.
+        @return Counters of the sessions
+        */
+        metrics_snapshot metrics() const
+        {
+            return client_.metrics();
+        }
+
+        /**
+        Closes the connection for good, without reconnecting.
+        */
+        void close()
+        {
+            client_.close();
+        }
+
+    private:
+        std::shared_ptr<detail::subscription_set> subscriptions_;
+        client_t client_;
+    };
+}
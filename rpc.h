@@ -0,0 +1,707 @@
+/**
+@file rpc.h
+@author Gary Heckman
+@brief Request and response calls over a connection.
+@detail
+	rpc_serializer wraps any type that fulfils the Serializer concept and puts
+	a correlation id in front of every frame, so many calls can be in flight
+	on one connection and their responses can come back in any order.
+	Both ends must use the adaptor with the same inner serializer.
+
+	Wire format, big endian:
+		correlation id (8) | inner frame
+	Id zero is a one-way message that gets no response.
+
+	rpc_client sends requests without waiting for earlier ones and hands each
+	response to the future or callback of the call with the same id, or fails
+	the call if its timeout runs out first. On the server, rpc_handler gives
+	a service every request along with an rpc_reply that writes the response
+	back to the session the request came from, straight away or later from
+	any thread.
+
+	Responses go back over the session a request came in on, so calls only
+	work over connection protocols: tcp, unix domain stream and shared memory.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/system/system_error.hpp>
+
+#include "client.h"
+#include "dispatch.h"
+#include "server.h"
+#include "session_writer.h"
+
+namespace boost_messaging
+{
+    /**
+    Message along with the correlation id that ties a response to its request.
+    @tparam T Message of the inner serializer
+    */
+    template <typename T>
+    struct rpc_message
+    {
+        uint64_t id;
+        T body;
+    };
+
+    template <typename T>
+    struct owned_message<rpc_message<T>>
+    {
+        typedef rpc_message<typename owned_message<T>::type> type;
+
+        static type own(const rpc_message<T>& message) { return type{ message.id, owned_message<T>::own(message.body) }; }
+    };
+
+    /**
+    Serializer adaptor that carries a correlation id in the header of every frame.
+    Takes the faster ways out of serializing from the inner serializer when it has them.
+    recv_t's body is the inner serializer's; a view points into the read buffer as usual.
+    @tparam TSerializer Type that fulfils the Serializer concept
+    */
+    template <typename TSerializer>
+    class rpc_serializer
+    {
+    public:
+        typedef rpc_message<typename TSerializer::send_t> send_t;
+        typedef rpc_message<typename TSerializer::recv_t> recv_t;
+
+        static const size_t ID_SIZE = sizeof(uint64_t);
+
+        rpc_serializer() :
+            id_(0)
+        { }
+
+        /**
+        Gets the header size.
+        @return The id and the inner serializer's header
+        */
+        size_t header_size()
+        {
+            return ID_SIZE + inner_.header_size();
+        }
+
+        /**
+        Gets the body size from the inner header, and keeps the id for deserialize.
+        @tparam FwdIter Forward iterator
+        @param [in] first Iterator to the first character in the header
+        @param [in] last  Iterator past the last character in the header
+        */
+        template <typename FwdIter>
+        size_t body_size(FwdIter first, FwdIter last)
+        {
+            id_ = 0;
+            for (size_t i = 0; i < ID_SIZE; ++i, ++first)
+                id_ = (id_ << 8) | static_cast<unsigned char>(*first);
+            return inner_.body_size(first, last);
+        }
+
+        /**
+        Checks the inner header.
+        @tparam FwdIter Forward iterator
+        @param [in] first Iterator to the first character in the header
+        @param [in] last  Iterator past the last character in the header
+        @return True if the header is valid, false otherwise
+        */
+        template <typename FwdIter>
+        bool validate_header(FwdIter first, FwdIter last)
+        {
+            return std::distance(first, last) == static_cast<std::ptrdiff_t>(header_size()) && inner_.validate_header(std::next(first, ID_SIZE), last);
+        }
+
+        /**
+        Serializes a message into a new buffer.
+        @param [in] send_msg Message to send
+        @return Serialized message
+        */
+        std::vector<char> serialize(const send_t& send_msg)
+        {
+            auto frame = inner_.serialize(send_msg.body);
+            frame.insert(frame.begin(), ID_SIZE, 0);
+            put_id(frame.data(), send_msg.id);
+            return frame;
+        }
+
+        /**
+        Writes the header, when the inner serializer can leave the payload in place.
+        @param [in]  send_msg Message to send
+        @param [out] first    Start of a buffer at least header_size() bytes long
+        */
+        template <typename S = TSerializer>
+        auto serialize_header(const send_t& send_msg, char* first) -> decltype(std::declval<S&>().serialize_header(send_msg.body, first), void())
+        {
+            put_id(first, send_msg.id);
+            inner_.serialize_header(send_msg.body, first + ID_SIZE);
+        }
+
+        template <typename S = TSerializer>
+        auto body_buffer(const send_t& send_msg) -> decltype(std::declval<S&>().body_buffer(send_msg.body))
+        {
+            return inner_.body_buffer(send_msg.body);
+        }
+
+        /**
+        Gets the size of the serialized message, when the inner serializer can write into a buffer.
+        @param [in] send_msg Message to send
+        @return Size of the header and body in bytes
+        */
+        template <typename S = TSerializer>
+        auto serialized_size(const send_t& send_msg) -> decltype(std::declval<S&>().serialized_size(send_msg.body), size_t())
+        {
+            return ID_SIZE + inner_.serialized_size(send_msg.body);
+        }
+
+        template <typename S = TSerializer>
+        auto serialize_into(const send_t& send_msg, char* first) -> decltype(std::declval<S&>().serialize_into(send_msg.body, first), void())
+        {
+            put_id(first, send_msg.id);
+            inner_.serialize_into(send_msg.body, first + ID_SIZE);
+        }
+
+        /**
+        Deserializes a message with the id from the last header.
+        @tparam FwdIter Forward iterator
+        @param [in] first Iterator to the first character in the body
+        @param [in] last  Iterator past the last character in the body
+        @return Message made by the inner serializer, with its id
+        */
+        template <typename FwdIter>
+        recv_t deserialize(FwdIter first, FwdIter last)
+        {
+            return recv_t{ id_, inner_.deserialize(first, last) };
+        }
+
+        /**
+        Deserializes a message with the id from the last header, when the inner serializer can turn a body down.
+        @param [in]  first   Pointer to the first character in the body
+        @param [in]  last    Pointer past the last character in the body
+        @param [out] message Set to the message made by the inner serializer, with its id
+        @return False if the inner serializer turned the body down
+        */
+        template <typename S = TSerializer>
+        auto try_deserialize(const char* first, const char* last, recv_t& message) -> decltype(bool(std::declval<S&>().try_deserialize(first, last, message.body)))
+        {
+            message.id = id_;
+            return inner_.try_deserialize(first, last, message.body);
+        }
+
+    private:
+        TSerializer inner_;
+        // Id from the header body_size last read
+        uint64_t id_;
+
+        static void put_id(char* first, uint64_t id)
+        {
+            for (size_t i = ID_SIZE; i-- > 0; id >>= 8)
+                first[i] = static_cast<char>(id & 0xff);
+        }
+    };
+
+    /**
+    Writes the response to one request back to the session it came from.
+    Copies may be kept and used later from any thread; only the first response counts on the client.
+    @tparam TSend send_t of the inner serializer
+    */
+    template <typename TSend>
+    class rpc_reply
+    {
+    public:
+        rpc_reply(const session_writer<rpc_message<TSend>>& session, uint64_t id) :
+            session_(session),
+            id_(id)
+        { }
+
+        /**
+        Whether the caller waits for a response. One-way messages don't get one.
+        */
+        bool expected() const { return id_ != 0; }
+
+        /**
+        Id of the session the request came from.
+        */
+        session_id_t session() const { return session_.id(); }
+
+        /**
+        Sends the response.
+        @param [in] response Response to the request, moved all the way into the session
+        @return False if no response is expected, the session is gone or its write queue limits kept the response out
+        */
+        bool write(TSend&& response) const
+        {
+            return expected() && session_.write(rpc_message<TSend>{ id_, std::move(response) });
+        }
+
+        bool write(const TSend& response) const
+        {
+            return write(TSend(response));
+        }
+
+    private:
+        session_writer<rpc_message<TSend>> session_;
+        uint64_t id_;
+    };
+
+    /**
+    Handler that hands requests to a service along with a way to reply.
+    Each session gets its own TService, default constructed or copied from the server's prototype handler.
+    The service defines, for T the inner serializer's recv_t:
+        template <typename T>
+        void handle(const T& request, const rpc_reply<typename TSerializer::send_t>& reply)
+    Use dispatching_handler<rpc_handler<...>> to serve requests on worker threads.
+    @tparam TService    Type that serves requests
+    @tparam TSerializer Inner serializer of the server's rpc_serializer
+    */
+    template <typename TService, typename TSerializer>
+    class rpc_handler
+    {
+    public:
+        typedef typename TSerializer::send_t response_t;
+        typedef rpc_reply<response_t> reply_t;
+
+        rpc_handler() { }
+
+        explicit rpc_handler(const TService& service) :
+            service_(service)
+        { }
+
+        void attach(const session_writer<rpc_message<response_t>>& session)
+        {
+            session_ = session;
+        }
+
+        template <typename T>
+        void handle(const rpc_message<T>& request)
+        {
+            service_.handle(request.body, reply_t(session_, request.id));
+        }
+
+    private:
+        TService service_;
+        session_writer<rpc_message<response_t>> session_;
+    };
+
+    /**
+    Server that answers rpc_client calls.
+    @tparam TProtocol   boost::asio::ip::tcp, boost::asio::local::stream_protocol or shared_memory_protocol
+    @tparam TSerializer Inner serializer, the same as the clients'
+    @tparam TService    Type that serves requests, see rpc_handler
+    @tparam TThreading  Either single_threaded or multi_threaded
+    */
+    template <typename TProtocol, typename TSerializer, typename TService, typename TThreading = single_threaded>
+    using rpc_server = server<TProtocol, rpc_serializer<TSerializer>, rpc_handler<TService, TSerializer>, TThreading>;
+
+    namespace detail
+    {
+        /**
+        Calls in flight on an rpc_client, and the timer that fails them when they take too long.
+        Shared with the handlers of the client's sessions, which complete calls from the io threads.
+        One timer is kept for the earliest deadline, so a call costs no timer of its own.
+        Each call is tagged with the session the client wrote it to, or zero while it is kept for the next one,
+        so the calls of a session that goes away can fail straight away.
+        @tparam TResponse Type a response is kept in
+        */
+        template <typename TResponse>
+        class rpc_calls : public std::enable_shared_from_this<rpc_calls<TResponse>>
+        {
+        public:
+            typedef std::function<void(const boost::system::error_code& error, TResponse&& response)> callback_t;
+            typedef std::chrono::steady_clock clock_t;
+
+            explicit rpc_calls(io_service& io_service) :
+                timer_(io_service),
+                next_id_(1),
+                stopped_(false)
+            { }
+
+            rpc_calls(const rpc_calls&) = delete;
+            rpc_calls& operator=(const rpc_calls&) = delete;
+
+            /**
+            Starts a call.
+            @param [in, out] callback Moved from if the call starts
+            @param [in]      timeout  Time the call has to finish, or zero for no limit
+            @return Id of the call, or zero if the calls were stopped
+            */
+            uint64_t add(callback_t& callback, std::chrono::milliseconds timeout)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stopped_)
+                    return 0;
+
+                auto id = next_id_++;
+                auto& started = calls_[id];
+                started.callback = std::move(callback);
+                started.deadline = deadlines_.end();
+                started.written = false;
+                started.session = 0;
+                if (timeout.count() > 0)
+                {
+                    // Calls usually share a timeout, so deadlines mostly go in at the end
+                    started.deadline = deadlines_.emplace_hint(deadlines_.end(), clock_t::now() + timeout, id);
+                    if (started.deadline == deadlines_.begin())
+                        arm();
+                }
+                return id;
+            }
+
+            /**
+            Finishes a call. Does nothing if it already finished, like when a response comes after the timeout.
+            @param [in] id       Id of the call
+            @param [in] error    Why the call failed, or success
+            @param [in] response Response to hand over
+            */
+            void complete(uint64_t id, const boost::system::error_code& error, TResponse&& response)
+            {
+                callback_t callback;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto found = calls_.find(id);
+                    if (found == calls_.end())
+                        return;
+
+                    callback = std::move(found->second.callback);
+                    if (found->second.deadline != deadlines_.end())
+                        deadlines_.erase(found->second.deadline);
+                    calls_.erase(found);
+                }
+                callback(error, std::move(response));
+            }
+
+            /**
+            Tags a call with the session the client wrote it to.
+            @param [in] id      Id of the call
+            @param [in] session Id of the session, or zero if the client kept the call until it reconnects
+            */
+            void written(uint64_t id, session_id_t session)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto found = calls_.find(id);
+                if (found == calls_.end())
+                    return;
+
+                found->second.written = true;
+                found->second.session = session;
+            }
+
+            /**
+            Tags the calls the client kept while disconnected with the new session, since they were written to it.
+            @param [in] session Id of the session
+            */
+            void attached(session_id_t session)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto& entry : calls_)
+                {
+                    if (entry.second.written && entry.second.session == 0)
+                        entry.second.session = session;
+                }
+            }
+
+            /**
+            Fails the calls that went out on a session with connection_reset, since their responses can't come back.
+            @param [in] session Id of the session
+            */
+            void detached(session_id_t session)
+            {
+                std::vector<callback_t> failed;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    for (auto found = calls_.begin(); found != calls_.end();)
+                    {
+                        if (!found->second.written || found->second.session != session)
+                        {
+                            ++found;
+                            continue;
+                        }
+
+                        failed.push_back(std::move(found->second.callback));
+                        if (found->second.deadline != deadlines_.end())
+                            deadlines_.erase(found->second.deadline);
+                        found = calls_.erase(found);
+                    }
+                }
+
+                for (auto& callback : failed)
+                    callback(boost::asio::error::connection_reset, TResponse());
+            }
+
+            /**
+            Fails every call with operation_aborted and refuses new ones.
+            */
+            void stop()
+            {
+                std::unordered_map<uint64_t, call> stopped;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    stopped_ = true;
+                    stopped.swap(calls_);
+                    deadlines_.clear();
+                    boost::system::error_code ignored;
+                    timer_.cancel(ignored);
+                }
+
+                for (auto& entry : stopped)
+                    entry.second.callback(boost::asio::error::operation_aborted, TResponse());
+            }
+
+            size_t size() const
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return calls_.size();
+            }
+
+        private:
+            typedef std::multimap<clock_t::time_point, uint64_t> deadlines_t;
+
+            struct call
+            {
+                callback_t callback;
+                typename deadlines_t::iterator deadline;
+                // Calls are only tagged once the client has taken them
+                bool written;
+                session_id_t session;
+            };
+
+            // Guards everything below, including the timer, since calls come from any thread
+            mutable std::mutex mutex_;
+            boost::asio::steady_timer timer_;
+            std::unordered_map<uint64_t, call> calls_;
+            deadlines_t deadlines_;
+            uint64_t next_id_;
+            bool stopped_;
+
+            // Sets the timer for the earliest deadline. Must hold the mutex.
+            void arm()
+            {
+                timer_.expires_at(deadlines_.begin()->first);
+                std::weak_ptr<rpc_calls> weak_this = this->shared_from_this();
+                timer_.async_wait([weak_this](const boost::system::error_code& error)
+                {
+                    auto sp = weak_this.lock();
+                    if (!error && sp)
+                        sp->expire();
+                });
+            }
+
+            void expire()
+            {
+                std::vector<callback_t> expired;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto now = clock_t::now();
+                    while (!deadlines_.empty() && deadlines_.begin()->first <= now)
+                    {
+                        auto found = calls_.find(deadlines_.begin()->second);
+                        expired.push_back(std::move(found->second.callback));
+                        calls_.erase(found);
+                        deadlines_.erase(deadlines_.begin());
+                    }
+
+                    if (!deadlines_.empty())
+                        arm();
+                }
+
+                for (auto& callback : expired)
+                    callback(boost::asio::error::timed_out, TResponse());
+            }
+        };
+
+        /**
+        Handler of an rpc_client's sessions that finishes calls with their responses,
+        and fails the calls of its session when the session goes away.
+        @tparam TResponse Type a response is kept in
+        */
+        template <typename TResponse>
+        class rpc_response_handler
+        {
+        public:
+            rpc_response_handler() :
+                session_(0)
+            { }
+
+            explicit rpc_response_handler(std::shared_ptr<rpc_calls<TResponse>> calls) :
+                calls_(std::move(calls)),
+                session_(0)
+            { }
+
+            // Copies are handlers for other sessions, so they start out unattached.
+            rpc_response_handler(const rpc_response_handler& other) :
+                calls_(other.calls_),
+                session_(0)
+            { }
+
+            rpc_response_handler& operator=(const rpc_response_handler&) = delete;
+
+            // The session is gone once its handler is
+            ~rpc_response_handler()
+            {
+                if (calls_ && session_ != 0)
+                    calls_->detached(session_);
+            }
+
+            template <typename TSend>
+            void attach(const session_writer<TSend>& session)
+            {
+                session_ = session.id();
+            }
+
+            template <typename T>
+            void handle(const rpc_message<T>& response)
+            {
+                if (calls_ && response.id != 0)
+                    calls_->complete(response.id, boost::system::error_code(), TResponse(owned_message<T>::own(response.body)));
+            }
+
+        private:
+            std::shared_ptr<rpc_calls<TResponse>> calls_;
+            session_id_t session_;
+        };
+    }
+
+    /**
+    Client that makes calls to an rpc_server.
+    Calls don't wait for each other, so any number can be in flight on the connection.
+    Calls made while disconnected are sent once the client reconnects, as with client.
+    Calls that were in flight when a connection drops aren't sent again; they fail with connection_reset.
+    Callbacks run on an io thread, or on the calling thread when a call fails straight away.
+    @tparam TProtocol   boost::asio::ip::tcp, boost::asio::local::stream_protocol or shared_memory_protocol
+    @tparam TSerializer Inner serializer, the same as the server's
+    @tparam TThreading  Either single_threaded or multi_threaded
+    */
+    template <typename TProtocol, typename TSerializer, typename TThreading = single_threaded>
+    class rpc_client
+    {
+    public:
+        typedef typename TSerializer::send_t request_t;
+        // Responses outlive the read they came from, so views are copied
+        typedef typename owned_message<typename TSerializer::recv_t>::type response_t;
+        typedef typename detail::rpc_calls<response_t>::callback_t callback_t;
+        typedef client<TProtocol, rpc_serializer<TSerializer>, detail::rpc_response_handler<response_t>, TThreading> client_t;
+
+        /**
+        Constructor.
+        Resolves and connects in the background, like client.
+        @param [in, out] io_service Facilitates async operations
+        @param [in]      host       IP or hostname of the server, or the path of a unix domain or shared memory server
+        @param [in]      port       Port number or port protocol name, ignored for unix domain and shared memory servers
+        @param [in]      options    Tunable settings for the session
+        */
+        rpc_client(io_service& io_service, const std::string& host, const std::string& port, const comm_options& options = comm_options()) :
+            calls_(std::make_shared<detail::rpc_calls<response_t>>(io_service)),
+            client_(io_service, host, port, options, detail::rpc_response_handler<response_t>(calls_))
+        {
+            std::weak_ptr<detail::rpc_calls<response_t>> calls = calls_;
+            client_.set_connected_callback([calls](session_id_t session)
+            {
+                if (auto sp = calls.lock())
+                    sp->attached(session);
+            });
+        }
+
+        /**
+        Destructor.
+        Closes the connection and fails every call in flight with operation_aborted.
+        */
+        ~rpc_client()
+        {
+            close();
+        }
+
+        rpc_client(const rpc_client&) = delete;
+        rpc_client& operator=(const rpc_client&) = delete;
+
+        /**
+        Sends a request and calls back once with its response or an error.
+        Errors are timed_out when the timeout ran out, no_buffer_space when the write queue limits
+        or the pending limit kept the request out, connection_reset when the connection the request
+        went out on dropped, and operation_aborted when the client closed.
+        @param [in] request  Request to be sent, moved all the way into the session
+        @param [in] timeout  Time the response has to come back in, or zero to wait as long as it takes
+        @param [in] callback Called with the response
+        */
+        void call(request_t request, std::chrono::milliseconds timeout, callback_t callback)
+        {
+            auto id = calls_->add(callback, timeout);
+            if (id == 0)
+                callback(boost::asio::error::operation_aborted, response_t());
+            else if (!client_.write(typename client_t::send_t{ id, std::move(request) }, [this, id](session_id_t session) { calls_->written(id, session); }))
+                calls_->complete(id, boost::asio::error::no_buffer_space, response_t());
+        }
+
+        /**
+        Sends a request.
+        @param [in] request Request to be sent, moved all the way into the session
+        @param [in] timeout Time the response has to come back in, or zero to wait as long as it takes
+        @return Future of the response, which throws boost::system::system_error with the error from call if the call fails
+        */
+        std::future<response_t> call(request_t request, std::chrono::milliseconds timeout)
+        {
+            auto promise = std::make_shared<std::promise<response_t>>();
+            auto result = promise->get_future();
+            call(std::move(request), timeout, [promise](const boost::system::error_code& error, response_t&& response)
+            {
+                if (error)
+                    promise->set_exception(std::make_exception_ptr(boost::system::system_error(error)));
+                else
+                    promise->set_value(std::move(response));
+            });
+            return result;
+        }
+
+        /**
+        Sends a one-way message that the server doesn't respond to.
+        @param [in] request Message to be sent, moved all the way into the session
+        @return False if the write queue limits or the pending limit kept the message out
+        */
+        bool notify(request_t request)
+        {
+            return client_.write(typename client_t::send_t{ 0, std::move(request) });
+        }
+
+        /**
+        Gets the number of calls waiting for a response.
+        */
+        size_t in_flight() const
+        {
+            return calls_->size();
+        }
+
+        /**
+        Gets the counters of the client's sessions without stopping them.
+        @return Counters of the sessions
+        */
+        metrics_snapshot metrics() const
+        {
+            return client_.metrics();
+        }
+
+        /**
+        Closes the connection for good and fails every call in flight with operation_aborted.
+        Later calls fail the same way.
+        */
+        void close()
+        {
+            client_.close();
+            calls_->stop();
+        }
+
+    private:
+        std::shared_ptr<detail::rpc_calls<response_t>> calls_;
+        client_t client_;
+    };
+}
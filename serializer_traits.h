@@ -0,0 +1,214 @@
+/**
+@file serializer_traits.h
+@author Gary Heckman
+@brief Compile-time detection of the optional parts of the Serializer concept, and helpers for serializers that use them.
+*/
+
+#pragma once
+
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <boost/utility/string_view.hpp>
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define BOOST_MESSAGING_STD_STRING_VIEW
+#endif
+
+namespace boost_messaging
+{
+    /**
+    Detects a recv_t that points into the read buffer instead of owning its bytes, so it is only valid during handle.
+    Every basic_string_view is one. Specialize this for other views, like spans, along with owned_message.
+    @tparam T recv_t of the serializer
+    */
+    template <typename T>
+    struct is_view : std::false_type {};
+
+    template <typename TChar, typename TTraits>
+    struct is_view<boost::basic_string_view<TChar, TTraits>> : std::true_type {};
+
+#ifdef BOOST_MESSAGING_STD_STRING_VIEW
+    template <typename TChar, typename TTraits>
+    struct is_view<std::basic_string_view<TChar, TTraits>> : std::true_type {};
+#endif
+
+    /**
+    Type a received message is copied into when it has to outlive the buffer it was read from,
+    like before it leaves the io thread.
+    Messages are used as is and string views become strings. Any other view into
+    the read buffer isn't valid once the handle call returns, so it fails to
+    compile until owned_message is specialized for it.
+    @tparam T recv_t of the serializer
+    */
+    template <typename T>
+    struct owned_message
+    {
+        static_assert(!is_view<T>::value, "specialize owned_message for views that serializers hand out");
+
+        typedef T type;
+
+        static const T& own(const T& message) { return message; }
+    };
+
+    template <typename TChar, typename TTraits>
+    struct owned_message<boost::basic_string_view<TChar, TTraits>>
+    {
+        typedef std::basic_string<TChar, TTraits> type;
+
+        static type own(boost::basic_string_view<TChar, TTraits> message) { return type(message.data(), message.size()); }
+    };
+
+#ifdef BOOST_MESSAGING_STD_STRING_VIEW
+    template <typename TChar, typename TTraits>
+    struct owned_message<std::basic_string_view<TChar, TTraits>>
+    {
+        typedef std::basic_string<TChar, TTraits> type;
+
+        static type own(std::basic_string_view<TChar, TTraits> message) { return type(message.data(), message.size()); }
+    };
+#endif
+
+    namespace detail
+    {
+        /**
+        Maps any well-formed list of types to void.
+        Used to detect members through SFINAE.
+        */
+        template <typename... Ts>
+        struct make_void
+        {
+            typedef void type;
+        };
+
+        template <typename... Ts>
+        using void_t = typename make_void<Ts...>::type;
+
+        /**
+        Detects a serializer that can write a whole frame into a caller-provided buffer.
+        Requires size_t serialized_size(const send_t&) and void serialize_into(const send_t&, char*).
+        @tparam TSerializer Type that fulfils the Serializer concept
+        */
+        template <typename TSerializer, typename = void>
+        struct has_serialize_into : std::false_type {};
+
+        template <typename TSerializer>
+        struct has_serialize_into<TSerializer, void_t<
+            decltype(std::declval<TSerializer&>().serialized_size(std::declval<const typename TSerializer::send_t&>())),
+            decltype(std::declval<TSerializer&>().serialize_into(std::declval<const typename TSerializer::send_t&>(), std::declval<char*>()))>> : std::true_type {};
+
+        /**
+        Detects a serializer that can write just the header and point at the payload in place.
+        Requires void serialize_header(const send_t&, char*) and const_buffer body_buffer(const send_t&).
+        @tparam TSerializer Type that fulfils the Serializer concept
+        */
+        template <typename TSerializer, typename = void>
+        struct has_serialize_header : std::false_type {};
+
+        template <typename TSerializer>
+        struct has_serialize_header<TSerializer, void_t<
+            decltype(std::declval<TSerializer&>().serialize_header(std::declval<const typename TSerializer::send_t&>(), std::declval<char*>())),
+            decltype(boost::asio::const_buffer(std::declval<TSerializer&>().body_buffer(std::declval<const typename TSerializer::send_t&>())))>> : std::true_type {};
+
+        /**
+        Remembers which message serialized_size last worked a frame out for, so that serialize_into can
+        reuse the work when it is called next for the same message. frame_builder always makes the two
+        calls back to back on the same object; a serialize_into on its own does the work again.
+        @tparam TMessage send_t of the serializer
+        */
+        template <typename TMessage>
+        class prepared_message
+        {
+        public:
+            prepared_message() :
+                message_(nullptr)
+            { }
+
+            /**
+            Marks a message as the one whose work is kept, from serialized_size.
+            @param [in] message Message that was just sized
+            */
+            void keep(const TMessage& message)
+            {
+                message_ = &message;
+            }
+
+            /**
+            Checks whether the kept work is for a message, from serialize_into. Forgets the message either way.
+            @param [in] message Message about to be written
+            @return True if the work kept is for this message
+            */
+            bool take(const TMessage& message)
+            {
+                auto kept = message_ == &message;
+                message_ = nullptr;
+                return kept;
+            }
+
+        private:
+            const TMessage* message_;
+        };
+
+        /**
+        Detects a serializer that can turn down a malformed body instead of throwing.
+        Requires bool try_deserialize(const char* first, const char* last, recv_t& message).
+        @tparam TSerializer Type that fulfils the Serializer concept
+        */
+        template <typename TSerializer, typename = void>
+        struct has_try_deserialize : std::false_type {};
+
+        template <typename TSerializer>
+        struct has_try_deserialize<TSerializer, void_t<
+            decltype(bool(std::declval<TSerializer&>().try_deserialize(std::declval<const char*>(), std::declval<const char*>(), std::declval<typename TSerializer::recv_t&>())))>> : std::true_type {};
+
+        template <typename TSerializer, typename TFunction>
+        bool deserialize_body(TSerializer& serializer, const char* first, const char* last, TFunction&& function, std::true_type)
+        {
+            typename TSerializer::recv_t message;
+            if (!serializer.try_deserialize(first, last, message))
+                return false;
+
+            function(std::move(message));
+            return true;
+        }
+
+        template <typename TSerializer, typename TFunction>
+        bool deserialize_body(TSerializer& serializer, const char* first, const char* last, TFunction&& function, std::false_type)
+        {
+            function(serializer.deserialize(first, last));
+            return true;
+        }
+
+        /**
+        Deserializes a body and hands the message on, unless the serializer turns the body down.
+        recv_t only has to be default constructible for serializers with try_deserialize.
+        @param [in, out] serializer Serializer of the session
+        @param [in]      first      Pointer to the first character in the body
+        @param [in]      last       Pointer past the last character in the body
+        @param [in]      function   Called with the message as an rvalue
+        @return False if the body was malformed, in which case function isn't called
+        */
+        template <typename TSerializer, typename TFunction>
+        bool deserialize_body(TSerializer& serializer, const char* first, const char* last, TFunction&& function)
+        {
+            return deserialize_body(serializer, first, last, std::forward<TFunction>(function), has_try_deserialize<TSerializer>());
+        }
+
+        /**
+        Deserializes a body into a message, for adaptors that hand the body on to an inner serializer.
+        @param [in, out] serializer Serializer to deserialize with
+        @param [in]      first      Pointer to the first character in the body
+        @param [in]      last       Pointer past the last character in the body
+        @param [out]     message    Set to the message
+        @return False if the body was malformed
+        */
+        template <typename TSerializer>
+        bool deserialize_into(TSerializer& serializer, const char* first, const char* last, typename TSerializer::recv_t& message)
+        {
+            return deserialize_body(serializer, first, last, [&message](typename TSerializer::recv_t&& result) { message = std::move(result); });
+        }
+    }
+}
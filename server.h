@@ -6,14 +6,22 @@
 
 #pragma once
 
-#include <list>
+#include <algorithm>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
-#include <boost\asio.hpp>
+#include <boost/asio.hpp>
+#include <boost/optional.hpp>
 
 #include "comm.h"
+#include "comm_options.h"
+#include "frame.h"
+#include "metrics.h"
+#include "session_registry.h"
 
 using namespace boost::asio;
 
@@ -22,102 +30,294 @@ namespace boost_messaging
     namespace detail
     {
         /**
-        Exposes functions for servers that use the tcp protocol.
+        Writes a message to a session.
+        @param [in, out] session  Session to write to
+        @param [in]      send_msg Message to be sent
+        @param [in]      args     Extra arguments for the session's write, like a udp endpoint
+        @return False if the session's write queue limits kept the message out
+        */
+        template <typename TComm, typename... TArgs>
+        bool write_to(TComm& session, const typename TComm::send_t& send_msg, const TArgs&... args)
+        {
+            return session.write(send_msg, args...);
+        }
+
+        template <typename TComm, typename... TArgs>
+        bool write_to(TComm& session, typename TComm::send_t&& send_msg, const TArgs&... args)
+        {
+            return session.write(std::move(send_msg), args...);
+        }
+
+        /**
+        Writes an already serialized message to a session.
+        @param [in, out] session    Session to write to
+        @param [in]      serialized Bytes in the format the session's serializer expects
+        @param [in]      args       Extra arguments for the session's write, like a udp endpoint
+        @return False if the session's write queue limits kept the message out
+        */
+        template <typename TComm, typename... TArgs>
+        bool write_to(TComm& session, std::vector<char>&& serialized, const TArgs&... args)
+        {
+            return session.write_frame(std::move(serialized), args...);
+        }
+
+        template <typename TComm, typename... TArgs>
+        bool write_to(TComm& session, const shared_frame& serialized, const TArgs&... args)
+        {
+            return session.write_shared(serialized, args...);
+        }
+
+        /**
+        Exposes functions for servers that accept connections, like tcp.
         This server type generates multiple sessions: one for each connection.
         @tparam TSerializer Type that fulfils the Serializer concept
         @tparam THandler    Type that fulfils the Handler concept
+        @tparam TThreading  Either single_threaded or multi_threaded
+        @tparam TProtocol   boost::asio::ip::tcp, boost::asio::local::stream_protocol or shared_memory_protocol
         */
-        template <typename TSerializer, typename THandler>
+        template <typename TSerializer, typename THandler, typename TThreading, typename TProtocol = ip::tcp>
         class server_tcp_interface
         {
         public:
-            typedef tcp_comm<TSerializer, THandler> comm_t;
+            typedef typename comm_selector<TProtocol, TSerializer, THandler, TThreading>::type comm_t;
+            typedef typename TProtocol::endpoint endpoint_t;
+            typedef typename TProtocol::acceptor acceptor_t;
+            typedef typename TSerializer::send_t send_t;
 
             /**
             Constructor.
             @param [in, out] io_service Facilitates async operations 
             @param [in]      endpoint   Endpoint used to accept connections
+            @param [in]      options    Tunable settings for each session
+            @param [in]      handler    Handler that every session's handler is copied from, or null to default construct them
+            */
+            server_tcp_interface(io_service& io_service, const endpoint_t& endpoint, const comm_options& options,
+                std::shared_ptr<const THandler> handler = nullptr) :
+                acceptor_(io_service, endpoint),
+                io_service_(io_service),
+                options_(options),
+                handler_(std::move(handler)),
+                frame_builder_(options.pool ? options.pool : buffer_pool::shared(io_service)),
+                registry_(std::make_shared<registry_t>()),
+                retired_(std::make_shared<retired_metrics>())
+            { }
+
+            /**
+            Constructor.
+            @param [in, out] io_service Facilitates async operations
+            @param [in]      acceptor   Acceptor that is already listening, or a closed one to only take adopted connections
+            @param [in]      options    Tunable settings for each session
+            @param [in]      handler    Handler that every session's handler is copied from, or null to default construct them
             */
-            server_tcp_interface(io_service& io_service, const ip::tcp::endpoint& endpoint) :
+            server_tcp_interface(io_service& io_service, acceptor_t&& acceptor, const comm_options& options,
+                std::shared_ptr<const THandler> handler = nullptr) :
+                acceptor_(std::move(acceptor)),
                 io_service_(io_service),
-                acceptor_(io_service, endpoint)
+                options_(options),
+                handler_(std::move(handler)),
+                frame_builder_(options.pool ? options.pool : buffer_pool::shared(io_service)),
+                registry_(std::make_shared<registry_t>()),
+                retired_(std::make_shared<retired_metrics>())
             { }
 
+            /**
+            Adds up the counters of every session, including the ones that have closed.
+            @return Counters of the server's sessions
+            */
+            metrics_snapshot metrics() const
+            {
+                metrics_snapshot snapshot;
+                retired_->snapshot(snapshot);
+                registry_->for_each([&snapshot](const std::shared_ptr<comm_t>& session) { session->metrics().snapshot(snapshot); });
+                return snapshot;
+            }
+
+            /**
+            Gets the endpoint the acceptor is bound to.
+            @return Local endpoint, or a default endpoint if the acceptor isn't open
+            */
+            endpoint_t local_endpoint() const
+            {
+                boost::system::error_code error;
+                auto endpoint = acceptor_.local_endpoint(error);
+                return error ? endpoint_t() : endpoint;
+            }
+
             /**
             Asynchronously waits for new incoming connections.
+            Does nothing if the acceptor isn't open.
             */
             void start_accept()
             {
-                auto new_session = std::make_shared<comm_t>(io_service_, ip::tcp::socket(io_service_));
+                if (!acceptor_.is_open())
+                    return;
+
+                auto new_session = make_session<comm_t>(io_service_, typename TProtocol::socket(io_service_), options_, handler_);
                 auto callback = [this, new_session](const boost::system::error_code& error) { handle_accept(new_session, error); };
                 acceptor_.async_accept(new_session->socket(), callback);
             }
 
-        private:
-            ip::tcp::acceptor acceptor_;
-            io_service& io_service_;
-            std::list<std::weak_ptr<comm_t>> sessions_;
-
             /**
-            Erases expired sessions.
+            Starts a session on a connection that was accepted somewhere else.
+            The socket must belong to this interface's io_service.
+            @param [in] socket Connected socket
             */
-            void clean()
+            void adopt(typename TProtocol::socket&& socket)
             {
-                auto is_expired = [](std::weak_ptr<comm_t> session) { return session.expired(); };
-                auto end_it = std::remove(sessions_.begin(), sessions_.end(), is_expired);
-                sessions_.erase(end_it, sessions_.end());
+                start_session(make_session<comm_t>(io_service_, std::move(socket), options_, handler_));
             }
 
             /**
             Writes to each active session.
-            Removes expired sessions.
+            The message is serialized once and every session shares the result.
+            @param [in] send_msg Message to be sent
             @return True if any message was written, false otherwise.
             */
-            bool write()
+            bool write(const send_t& send_msg)
+            {
+                return write(send_msg, nullptr);
+            }
+
+            /**
+            Writes to each active session and reports the sessions that kept the message out.
+            @param [in]  send_msg      Message to be sent
+            @param [out] backpressured Ids of the sessions whose write queue limits kept the message out
+            @return True if any message was written, false otherwise.
+            */
+            bool write(const send_t& send_msg, std::vector<session_id_t>& backpressured)
+            {
+                return write(send_msg, &backpressured);
+            }
+
+            /**
+            Writes an already serialized message to each active session.
+            @param [in]  serialized    Serialized message shared by every session
+            @param [out] backpressured Ids of the sessions whose write queue limits kept the message out, or null
+            @return True if any message was written, false otherwise.
+            */
+            bool write(const shared_frame& serialized, std::vector<session_id_t>* backpressured = nullptr)
             {
                 bool did_write = false;
-                clean();
+                registry_->for_each([&](const std::shared_ptr<comm_t>& session)
+                {
+                    if (session->write_shared(serialized))
+                        did_write = true;
+                    else if (backpressured)
+                        backpressured->push_back(session->id());
+                });
+                return did_write;
+            }
 
-                for (auto session : sessions_)
+            /**
+            Writes to every session that matches one of the endpoints.
+            The message is serialized once and every session shares the result.
+            @param [in] send_msg  Message to be sent
+            @param [in] endpoints Remote endpoints to write to
+            @return True if any message was written, false otherwise.
+            */
+            bool write(const send_t& send_msg, const std::vector<endpoint_t>& endpoints)
+            {
+                bool did_write = false;
+
+                shared_frame serialized;
+                for (const auto& endpoint : endpoints)
                 {
-                    // Must still check if the session expired since cleaning.
-                    // If the session is still alive, write to it
-                    if (auto sp = session.lock())
+                    auto session = registry_->find(endpoint);
+                    if (!session)
+                        continue;
+
+                    if (!serialized)
                     {
-                        sp->write();
-                        did_write = true;
+                        std::lock_guard<std::mutex> lock(serializer_mutex_);
+                        serialized = frame_builder_.make_shared(serializer_, send_msg);
                     }
+                    if (session->write_shared(serialized))
+                        did_write = true;
                 }
 
                 return did_write;
             }
 
+            /**
+            Writes to every live session out of a list of ids.
+            The message is serialized once, and only if there is a session to write to.
+            @param [in] send_msg Message to be sent
+            @param [in] ids      Ids of the sessions to write to
+            @return True if any message was written, false otherwise.
+            */
+            bool write_sessions(const send_t& send_msg, const std::vector<session_id_t>& ids)
+            {
+                bool did_write = false;
+
+                shared_frame serialized;
+                registry_->for_each(ids, [&](const std::shared_ptr<comm_t>& session)
+                {
+                    if (!serialized)
+                    {
+                        std::lock_guard<std::mutex> lock(serializer_mutex_);
+                        serialized = frame_builder_.make_shared(serializer_, send_msg);
+                    }
+                    if (session->write_shared(serialized))
+                        did_write = true;
+                });
+                return did_write;
+            }
+
             /**
             Writes to the session that matches the endpoint.
-            Removes expired sessions.
+            @tparam TMessage Either send_t or std::vector<char> holding an already serialized message
+            @param [in] send_msg Message to be sent
             @param [in] endpoint Remote endpoint to write to
             @return True if the message was written, false otherwise.
             */
-            bool write(const ip::tcp::endpoint& endpoint)
+            template <typename TMessage>
+            bool write(TMessage&& send_msg, const endpoint_t& endpoint)
             {
-                bool did_write = false;
-                clean();
+                auto session = registry_->find(endpoint);
+                return session && write_to(*session, std::forward<TMessage>(send_msg));
+            }
+
+            /**
+            Writes to the session with the id.
+            @tparam TMessage Either send_t or std::vector<char> holding an already serialized message
+            @param [in] send_msg Message to be sent
+            @param [in] id       Id of the session, from comm_t::id()
+            @return True if the message was written, false otherwise.
+            */
+            template <typename TMessage>
+            bool write(TMessage&& send_msg, session_id_t id)
+            {
+                auto session = registry_->find(id);
+                return session && write_to(*session, std::forward<TMessage>(send_msg));
+            }
 
-                auto lock_compare_endpoints = [&](std::weak_ptr<comm_t> session) { auto sp = session.lock(); return sp && sp->socket().remote_endpoint() == endpoint; };
-                auto it = std::find_if(sessions_.begin(), sessions_.end(), lock_compare_endpoints);
+        private:
+            typedef session_registry<comm_t, endpoint_t> registry_t;
 
-                if (it != sessions_.end())
+            acceptor_t acceptor_;
+            io_service& io_service_;
+            comm_options options_;
+            std::shared_ptr<const THandler> handler_;
+            TSerializer serializer_;
+            frame_builder<TSerializer> frame_builder_;
+            // Guarded because writes can come from any thread
+            std::mutex serializer_mutex_;
+            // Shared so sessions that close after the server is gone don't touch a dead registry
+            std::shared_ptr<registry_t> registry_;
+            // Counters of the sessions that have left the registry
+            std::shared_ptr<retired_metrics> retired_;
+
+            bool write(const send_t& send_msg, std::vector<session_id_t>* backpressured)
+            {
+                if (registry_->empty())
+                    return false;
+
+                shared_frame serialized;
                 {
-                    // Must still check if the session expired since cleaning.
-                    // If the session is still alive, write to it
-                    if (auto sp = it->lock())
-                    {
-                        sp->write();
-                        did_write = true;
-                    }
+                    std::lock_guard<std::mutex> lock(serializer_mutex_);
+                    serialized = frame_builder_.make_shared(serializer_, send_msg);
                 }
-
-                return did_write;
+                return write(serialized, backpressured);
             }
 
             /**
@@ -127,33 +327,94 @@ namespace boost_messaging
             */
             void handle_accept(std::shared_ptr<comm_t> session, const boost::system::error_code& error)
             {
-                sessions_.emplace_back(session);
-                session->read();
+                if (error == boost::asio::error::operation_aborted)
+                    return;
+
+                if (!error)
+                    start_session(std::move(session));
                 start_accept();
             }
+
+            /**
+            Registers a new session and starts reading from it.
+            The session leaves the registry when its connection fails or closes.
+            @param [in] session Session with a connected socket
+            */
+            void start_session(std::shared_ptr<comm_t> session)
+            {
+                std::weak_ptr<registry_t> registry = registry_;
+                std::weak_ptr<retired_metrics> retired = retired_;
+                auto id = session->id();
+                std::weak_ptr<comm_t> weak_session = session;
+                session->set_error_callback([registry, retired, id, weak_session](const boost::system::error_code&)
+                {
+                    auto sp = weak_session.lock();
+                    auto registry_sp = registry.lock();
+                    if (!registry_sp || !registry_sp->remove(id, sp ? sp->remote_endpoint() : endpoint_t()))
+                        return;
+
+                    // Keeps the server's totals from going backwards when a session leaves
+                    auto retired_sp = retired.lock();
+                    if (sp && retired_sp)
+                        retired_sp->retire(sp->metrics());
+                });
+
+                // Reading caches the remote endpoint the registry is keyed on
+                session->read();
+                registry_->add(session);
+            }
         };
 
         /**
-        Exposes functions for servers that use the udp protocol.
+        Exposes functions for servers that use a datagram protocol, like udp.
         This server type has a single, connectionless session.
         @tparam TSerializer Type that fulfils the Serializer concept
         @tparam THandler    Type that fulfils the Handler concept
+        @tparam TThreading  Either single_threaded or multi_threaded
+        @tparam TProtocol   Either boost::asio::ip::udp or boost::asio::local::datagram_protocol
         */
-        template <typename TSerializer, typename THandler>
+        template <typename TSerializer, typename THandler, typename TThreading, typename TProtocol = ip::udp>
         class server_udp_interface
         {
         public:
-            typedef udp_comm<TSerializer, THandler> comm_t;
+            typedef udp_comm<TSerializer, THandler, TThreading, TProtocol> comm_t;
+            typedef typename TProtocol::endpoint endpoint_t;
+            typedef typename TSerializer::send_t send_t;
 
             /**
             Constructor.
             @param [in, out] io_service Facilitates async operations
             @param [in]      endpoint   Endpoint of the server session
+            @param [in]      options    Tunable settings for the session
+            @param [in]      handler    Handler that the session's handler is copied from, or null to default construct it
+            */
+            server_udp_interface(io_service& io_service, const endpoint_t& endpoint, const comm_options& options,
+                const std::shared_ptr<const THandler>& handler = nullptr) :
+                broadcast_(broadcast_endpoint(endpoint)),
+                session_(make_session<comm_t>(io_service, typename TProtocol::socket(io_service, endpoint), options, handler)),
+                frame_builder_(options.pool ? options.pool : buffer_pool::shared(io_service))
+            { }
+
+            /**
+            Gets the counters of the server's session.
+            @return Counters of the session
             */
-            server_udp_interface(io_service& io_service, const ip::udp::endpoint& endpoint) :
-                session_(std::make_shared<comm_t>(io_service, ip::udp::socket(io_service, endpoint)))
+            metrics_snapshot metrics() const
             {
-                port_ = endpoint.port();         
+                metrics_snapshot snapshot;
+                session_->metrics().snapshot(snapshot);
+                return snapshot;
+            }
+
+            /**
+            Gets the endpoint the session's socket is bound to.
+            @return Local endpoint, or a default endpoint if the socket isn't open
+            */
+            endpoint_t local_endpoint() const
+            {
+                boost::system::error_code error;
+                auto endpoint = session_->socket().local_endpoint(error);
+                return error ? endpoint_t() : endpoint;
             }
 
             /**
@@ -166,93 +427,349 @@ namespace boost_messaging
 
             /**
             Broadcasts.
-            @return True
+            Unix domain sockets can't broadcast, so this writes nothing for them.
+            @param [in] send_msg Message to be sent
+            @return False if the session's write queue limits kept the message out, or there is nowhere to broadcast
             */
-            bool write()
+            bool write(const send_t& send_msg)
             {
-                ip::udp::endpoint boradcast_endpoint(ip::address_v4::broadcast(), port_);
-                session_->set_remote_endpoint(boradcast_endpoint);
-                session_->write();
-                return true;
+                return broadcast_ && session_->write(send_msg, *broadcast_);
             }
 
             /**
-            Writes to the session.
-            @return True
+            Broadcasts and reports the session if it kept the message out.
+            @param [in]  send_msg      Message to be sent
+            @param [out] backpressured Gets the session's id if its write queue limits kept the message out
+            @return False if the session's write queue limits kept the message out
             */
-            bool write(const ip::udp::endpoint& endpoint)
+            bool write(const send_t& send_msg, std::vector<session_id_t>& backpressured)
             {
-                session_->set_remote_endpoint(endpoint);
-                session_->write();
-                return true;
+                return broadcast_ && report(write(send_msg), &backpressured);
+            }
+
+            /**
+            Broadcasts an already serialized message.
+            @param [in]  serialized    Serialized message
+            @param [out] backpressured Gets the session's id if its write queue limits kept the message out, or null
+            @return False if the session's write queue limits kept the message out
+            */
+            bool write(const shared_frame& serialized, std::vector<session_id_t>* backpressured = nullptr)
+            {
+                return broadcast_ && report(session_->write_shared(serialized, *broadcast_), backpressured);
+            }
+
+            /**
+            Writes to the endpoint.
+            @tparam TMessage Either send_t, std::vector<char> or shared_frame holding an already serialized message
+            @param [in] send_msg Message to be sent
+            @param [in] endpoint Remote endpoint to write to
+            @return False if the session's write queue limits kept the message out
+            */
+            template <typename TMessage>
+            bool write(TMessage&& send_msg, const endpoint_t& endpoint)
+            {
+                return write_to(*session_, std::forward<TMessage>(send_msg), endpoint);
+            }
+
+            /**
+            Writes to each of the endpoints.
+            The message is serialized once and every datagram shares the result.
+            @param [in] send_msg  Message to be sent
+            @param [in] endpoints Remote endpoints to write to
+            @return True if any message was written, false otherwise.
+            */
+            bool write(const send_t& send_msg, const std::vector<endpoint_t>& endpoints)
+            {
+                if (endpoints.empty())
+                    return false;
+
+                shared_frame serialized;
+                {
+                    std::lock_guard<std::mutex> lock(serializer_mutex_);
+                    serialized = frame_builder_.make_shared(serializer_, send_msg);
+                }
+
+                bool did_write = false;
+                for (const auto& endpoint : endpoints)
+                    did_write = session_->write_shared(serialized, endpoint) || did_write;
+                return did_write;
             }
 
         private:
-            uint16_t port_;
+            boost::optional<endpoint_t> broadcast_;
             std::shared_ptr<comm_t> session_;
+            TSerializer serializer_;
+            frame_builder<TSerializer> frame_builder_;
+            // Guarded because writes come from the caller's thread
+            std::mutex serializer_mutex_;
+
+            // Broadcasts go to the server's port on every host.
+            static boost::optional<endpoint_t> broadcast_endpoint(const ip::udp::endpoint& endpoint)
+            {
+                return ip::udp::endpoint(ip::address_v4::broadcast(), endpoint.port());
+            }
+
+            template <typename TEndpoint>
+            static boost::optional<endpoint_t> broadcast_endpoint(const TEndpoint&)
+            {
+                return boost::none;
+            }
+
+            bool report(bool did_write, std::vector<session_id_t>* backpressured) const
+            {
+                if (!did_write && backpressured)
+                    backpressured->push_back(session_->id());
+                return did_write;
+            }
         };
 
         /**
-        Switches between server interfaces that use different communicaton protocols.
-        @tparam TProtocol   Either boost::asio::ip::tcp or boost::asio::ip::udp
+        Picks the server interface for a protocol.
+        @tparam TProtocol   Protocol type, like boost::asio::ip::tcp
         @tparam TSerializer Type that fulfils the Serializer concept
         @tparam THandler    Type that fulfils the Handler concept
+        @tparam TThreading  Either single_threaded or multi_threaded
         */
-        template <typename TProtocol, typename TSerializer, typename THandler>
-        struct server_interface_selector
+        template <typename TProtocol, typename TSerializer, typename THandler, typename TThreading>
+        struct server_interface_selector;
+
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct server_interface_selector<ip::tcp, TSerializer, THandler, TThreading>
+        {
+            using type = server_tcp_interface<TSerializer, THandler, TThreading, ip::tcp>;
+        };
+
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct server_interface_selector<ip::udp, TSerializer, THandler, TThreading>
+        {
+            using type = server_udp_interface<TSerializer, THandler, TThreading, ip::udp>;
+        };
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct server_interface_selector<local::stream_protocol, TSerializer, THandler, TThreading>
+        {
+            using type = server_tcp_interface<TSerializer, THandler, TThreading, local::stream_protocol>;
+        };
+
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct server_interface_selector<local::datagram_protocol, TSerializer, THandler, TThreading>
+        {
+            using type = server_udp_interface<TSerializer, THandler, TThreading, local::datagram_protocol>;
+        };
+#endif
+
+#if defined(__linux__)
+        template <typename TSerializer, typename THandler, typename TThreading>
+        struct server_interface_selector<shared_memory_protocol, TSerializer, THandler, TThreading>
         {
-            using type =
-                typename std::conditional<
-                std::is_same<TProtocol, ip::tcp>::value,
-                server_tcp_interface<TSerializer, THandler>,
-                server_udp_interface<TSerializer, THandler>>::type;
+            using type = server_tcp_interface<TSerializer, THandler, TThreading, shared_memory_protocol>;
         };
+#endif
     }
 
     /**
     Generic server based on boost asio.
-    @tparam TProtocol   Either boost::asio::ip::tcp or boost::asio::ip::udp
+    A unix domain or shared memory server binds to a path, which must not exist yet; remove it once the server is done.
+    @tparam TProtocol   boost::asio::ip::tcp, boost::asio::ip::udp, boost::asio::local::stream_protocol,
+                        boost::asio::local::datagram_protocol or shared_memory_protocol
     @tparam TSerializer Type that fulfils the Serializer concept
     @tparam THandler    Type that fulfils the Handler concept
+    @tparam TThreading  Either single_threaded or multi_threaded
     */
-	template <typename TProtocol, typename TSerializer, typename THandler>
+	template <typename TProtocol, typename TSerializer, typename THandler, typename TThreading = single_threaded>
 	class server
 	{
 	public:
 		typedef typename TProtocol::endpoint endpoint_t;
-		typedef typename detail::comm_selector<TProtocol, TSerializer, THandler>::type comm_t;
-		typedef typename detail::server_interface_selector<TProtocol, TSerializer, THandler>::type interface_t;
+		typedef typename TSerializer::send_t send_t;
+		typedef typename detail::comm_selector<TProtocol, TSerializer, THandler, TThreading>::type comm_t;
+		typedef typename detail::server_interface_selector<TProtocol, TSerializer, THandler, TThreading>::type interface_t;
 
         /**
         Constructor.
         @param [in, out] io_service Facilitates async operations
         @param [in]      host       IP or hostname of the server
         @param [in]      port       Port number or port protocol name
+        @param [in]      options    Tunable settings for each session
+        */
+		server(io_service& io_service, const endpoint_t& endpoint, const comm_options& options = comm_options()) :
+			interface_(io_service, endpoint, options)
+		{
+			interface_.start_accept();
+		}
+
+        /**
+        Constructor.
+        Every session's handler is a copy of the given one, so handlers can share state with the code that made the server.
+        @param [in, out] io_service Facilitates async operations
+        @param [in]      endpoint   Endpoint to accept connections on, or of the datagram session
+        @param [in]      options    Tunable settings for each session
+        @param [in]      handler    Handler that every session's handler is copied from
         */
-		server(io_service& io_service, const endpoint_t& endpoint) :
-			interface_(io_service, endpoint)
+		server(io_service& io_service, const endpoint_t& endpoint, const comm_options& options, const THandler& handler) :
+			interface_(io_service, endpoint, options, std::make_shared<const THandler>(handler))
 		{
 			interface_.start_accept();
 		}
 
         /**
-        Writes to the session.
+        Gets the counters of the server's sessions without stopping them.
+        @return Counters added up over every session
+        */
+        metrics_snapshot metrics() const
+        {
+            return interface_.metrics();
+        }
+
+        /**
+        Gets the endpoint the server is bound to.
+        Useful when the server was given port 0 and the system picked one.
+        @return Local endpoint
         */
-        void write()
+        endpoint_t local_endpoint() const
         {
-            interface_.write();
+            return interface_.local_endpoint();
+        }
+
+        /**
+        Writes to every session.
+        For udp this is a broadcast, and unix domain datagram servers can't do it.
+        The message is serialized once and every session shares the result.
+        @param [in] send_msg Message to be sent
+        @return True if any message was written, false otherwise.
+        */
+        bool write(const send_t& send_msg)
+        {
+            return interface_.write(send_msg);
+        }
+
+        /**
+        Writes to every session and reports the ones that are backpressured.
+        @param [in]  send_msg      Message to be sent
+        @param [out] backpressured Gets the ids of the sessions whose write queue limits kept the message out
+        @return True if any message was written, false otherwise.
+        */
+        bool write(const send_t& send_msg, std::vector<session_id_t>& backpressured)
+        {
+            return interface_.write(send_msg, backpressured);
         }
 
         /**
         Writes to a specific session based on endpoint.
+        @param [in] send_msg Message to be sent
         @param [in] endpoint Endpoint of the client
+        @return True if the message was written, false otherwise.
+        */
+        bool write(const send_t& send_msg, const endpoint_t& endpoint)
+        {
+            return interface_.write(send_msg, endpoint);
+        }
+
+        /**
+        Writes to a specific session based on endpoint.
+        @param [in] send_msg Message to be sent, moved all the way into the session
+        @param [in] endpoint Endpoint of the client
+        @return True if the message was written, false otherwise.
+        */
+        bool write(send_t&& send_msg, const endpoint_t& endpoint)
+        {
+            return interface_.write(std::move(send_msg), endpoint);
+        }
+
+        /**
+        Writes to a specific session based on its id.
+        Only servers that use the tcp protocol have sessions with ids.
+        @param [in] send_msg Message to be sent
+        @param [in] id       Id of the session
+        @return True if the message was written, false otherwise.
+        */
+        bool write(const send_t& send_msg, session_id_t id)
+        {
+            return interface_.write(send_msg, id);
+        }
+
+        /**
+        Writes to a specific session based on its id.
+        Only servers that use the tcp protocol have sessions with ids.
+        @param [in] send_msg Message to be sent, moved all the way into the session
+        @param [in] id       Id of the session
+        @return True if the message was written, false otherwise.
+        */
+        bool write(send_t&& send_msg, session_id_t id)
+        {
+            return interface_.write(std::move(send_msg), id);
+        }
+
+        /**
+        Writes to several specific sessions based on endpoint.
+        The message is serialized once and every session shares the result.
+        @param [in] send_msg  Message to be sent
+        @param [in] endpoints Endpoints of the clients
+        @return True if any message was written, false otherwise.
+        */
+        bool write(const send_t& send_msg, const std::vector<endpoint_t>& endpoints)
+        {
+            return interface_.write(send_msg, endpoints);
+        }
+
+        /**
+        Writes to several specific sessions based on their ids.
+        Only servers of connection protocols have sessions with ids.
+        The message is serialized once and every session shares the result.
+        @param [in] send_msg Message to be sent
+        @param [in] ids      Ids of the sessions
+        @return True if any message was written, false otherwise.
+        */
+        bool write_sessions(const send_t& send_msg, const std::vector<session_id_t>& ids)
+        {
+            return interface_.write_sessions(send_msg, ids);
+        }
+
+        /**
+        Writes an already serialized message to every session.
+        @param [in] serialized Bytes in the format the clients' serializer expects
+        @return True if any message was written, false otherwise.
+        */
+        bool write_frame(std::vector<char>&& serialized)
+        {
+            return interface_.write(std::make_shared<const std::vector<char>>(std::move(serialized)));
+        }
+
+        /**
+        Writes an already serialized message to a specific session based on endpoint.
+        @param [in] serialized Bytes in the format the client's serializer expects
+        @param [in] endpoint   Endpoint of the client
+        @return True if the message was written, false otherwise.
+        */
+        bool write_frame(std::vector<char>&& serialized, const endpoint_t& endpoint)
+        {
+            return interface_.write(std::move(serialized), endpoint);
+        }
+
+        /**
+        Writes a shared serialized message to every session without copying it.
+        The same frame can be written by several servers.
+        @param [in] serialized Bytes in the format the clients' serializer expects
+        @return True if any message was written, false otherwise.
+        */
+        bool write_shared(const shared_frame& serialized)
+        {
+            return interface_.write(serialized);
+        }
+
+        /**
+        Writes a shared serialized message to a specific session based on endpoint.
+        @param [in] serialized Bytes in the format the client's serializer expects
+        @param [in] endpoint   Endpoint of the client
+        @return True if the message was written, false otherwise.
         */
-        void write(const endpoint_t& endpoint)
+        bool write_shared(const shared_frame& serialized, const endpoint_t& endpoint)
         {
-            interface_.write(endpoint);
+            return interface_.write(serialized, endpoint);
         }
 
 	private:
-		typename interface_t interface_;
+		interface_t interface_;
 	};
 }
@@ -0,0 +1,232 @@
+/**
+@file session_registry.h
+@author Gary Heckman
+@brief Index of a server's live sessions.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/functional/hash.hpp>
+
+namespace boost_messaging
+{
+    /**
+    Identifies a session for as long as the process runs.
+    Never reused, unlike an endpoint.
+    */
+    typedef uint64_t session_id_t;
+
+    namespace detail
+    {
+        /**
+        Hands out session ids that are unique across every server in the process.
+        @return New session id
+        */
+        inline session_id_t next_session_id()
+        {
+            static std::atomic<session_id_t> next_id(1);
+            return next_id.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /**
+        Hashes an ip endpoint by its address and port, and a unix domain endpoint by its path.
+        */
+        struct endpoint_hash
+        {
+            template <typename TProtocol>
+            size_t operator()(const boost::asio::ip::basic_endpoint<TProtocol>& endpoint) const
+            {
+                size_t seed = endpoint.port();
+                auto address = endpoint.address();
+                if (address.is_v4())
+                    boost::hash_combine(seed, address.to_v4().to_uint());
+                else
+                {
+                    auto bytes = address.to_v6().to_bytes();
+                    boost::hash_combine(seed, boost::hash_range(bytes.begin(), bytes.end()));
+                }
+                return seed;
+            }
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+            template <typename TProtocol>
+            size_t operator()(const boost::asio::local::basic_endpoint<TProtocol>& endpoint) const
+            {
+                return boost::hash_value(endpoint.path());
+            }
+#endif
+        };
+
+        /**
+        Thread-safe index of live sessions by session id and by remote endpoint.
+        Lookups are constant time and don't touch the sockets.
+        Sessions are removed when they close; any that die without closing
+        are dropped the next time a lookup or broadcast runs into them.
+        @tparam TComm     Communication object type, must have id() and remote_endpoint()
+        @tparam TEndpoint Remote endpoint type
+        */
+        template <typename TComm, typename TEndpoint>
+        class session_registry
+        {
+        public:
+            /**
+            Adds a session.
+            @param [in] session Session with a connected socket
+            */
+            void add(const std::shared_ptr<TComm>& session)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                by_id_[session->id()] = session;
+                by_endpoint_[session->remote_endpoint()] = session->id();
+            }
+
+            /**
+            Removes a session.
+            Does nothing if the session was already removed.
+            @param [in] id       Id of the session
+            @param [in] endpoint Remote endpoint of the session
+            @return True if the session was removed by this call
+            */
+            bool remove(session_id_t id, const TEndpoint& endpoint)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (by_id_.erase(id) == 0)
+                    return false;
+
+                // The endpoint may already belong to a newer session
+                auto it = by_endpoint_.find(endpoint);
+                if (it != by_endpoint_.end() && it->second == id)
+                    by_endpoint_.erase(it);
+                return true;
+            }
+
+            /**
+            Finds a session by id.
+            @param [in] id Id of the session
+            @return The session, or null if it isn't alive
+            */
+            std::shared_ptr<TComm> find(session_id_t id)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return find_locked(id);
+            }
+
+            /**
+            Finds a session by remote endpoint.
+            @param [in] endpoint Remote endpoint of the session
+            @return The session, or null if it isn't alive
+            */
+            std::shared_ptr<TComm> find(const TEndpoint& endpoint)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = by_endpoint_.find(endpoint);
+                if (it == by_endpoint_.end())
+                    return nullptr;
+
+                auto session = find_locked(it->second);
+                if (!session)
+                    by_endpoint_.erase(it);
+                return session;
+            }
+
+            /**
+            Calls a function on every live session.
+            The calls happen after the registry is unlocked, so they may block or call back into it.
+            @param [in] function Called with a std::shared_ptr<TComm>& for each session
+            @return Number of sessions the function was called on
+            */
+            template <typename TFunction>
+            size_t for_each(TFunction&& function)
+            {
+                // Reused between calls so broadcasting doesn't allocate
+                thread_local std::vector<std::shared_ptr<TComm>> sessions;
+                sessions.clear();
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    for (auto it = by_id_.begin(); it != by_id_.end();)
+                    {
+                        if (auto session = it->second.lock())
+                        {
+                            sessions.push_back(std::move(session));
+                            ++it;
+                        }
+                        else
+                            it = by_id_.erase(it);
+                    }
+                }
+
+                // Moved out first in case the function broadcasts on this thread too
+                auto live = std::move(sessions);
+                for (auto& session : live)
+                    function(session);
+                auto count = live.size();
+                live.clear();
+                sessions = std::move(live);
+                return count;
+            }
+
+            /**
+            Calls a function on every live session out of a list of ids.
+            The registry is locked once for the whole list, and unlocked for the calls.
+            @param [in] ids      Ids of the sessions; ones that aren't alive are skipped
+            @param [in] function Called with a std::shared_ptr<TComm>& for each live session
+            @return Number of sessions the function was called on
+            */
+            template <typename TFunction>
+            size_t for_each(const std::vector<session_id_t>& ids, TFunction&& function)
+            {
+                thread_local std::vector<std::shared_ptr<TComm>> sessions;
+                sessions.clear();
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    for (auto id : ids)
+                        if (auto session = find_locked(id))
+                            sessions.push_back(std::move(session));
+                }
+
+                auto live = std::move(sessions);
+                for (auto& session : live)
+                    function(session);
+                auto count = live.size();
+                live.clear();
+                sessions = std::move(live);
+                return count;
+            }
+
+            /**
+            Checks whether there are any sessions.
+            @return True if no session is registered
+            */
+            bool empty()
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return by_id_.empty();
+            }
+
+        private:
+            std::mutex mutex_;
+            std::unordered_map<session_id_t, std::weak_ptr<TComm>> by_id_;
+            std::unordered_map<TEndpoint, session_id_t, endpoint_hash> by_endpoint_;
+
+            std::shared_ptr<TComm> find_locked(session_id_t id)
+            {
+                auto it = by_id_.find(id);
+                if (it == by_id_.end())
+                    return nullptr;
+
+                auto session = it->second.lock();
+                if (!session)
+                    by_id_.erase(it);
+                return session;
+            }
+        };
+    }
+}
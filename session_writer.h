@@ -0,0 +1,137 @@
+/**
+@file session_writer.h
+@author Gary Heckman
+@brief Handle a handler keeps to write back to its own session.
+*/
+
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "session_registry.h"
+
+namespace boost_messaging
+{
+    /**
+    Writes to one session without owning it, so a handler can keep it without keeping its session alive.
+    Copies may be kept anywhere and used from any thread. Writes return false once the session is gone.
+    @tparam TSend send_t of the session's serializer
+    */
+    template <typename TSend>
+    class session_writer
+    {
+    public:
+        session_writer() :
+            id_(0),
+            write_(nullptr),
+            write_frame_(nullptr),
+            pause_reading_(nullptr),
+            resume_reading_(nullptr)
+        { }
+
+        /**
+        Constructor.
+        @param [in] session Session to write to
+        */
+        template <typename TComm>
+        explicit session_writer(const std::shared_ptr<TComm>& session) :
+            id_(session->id()),
+            session_(session),
+            write_(&write_to<TComm>),
+            write_frame_(&write_frame_to<TComm>),
+            pause_reading_(&pause_reading_of<TComm>),
+            resume_reading_(&resume_reading_of<TComm>)
+        { }
+
+        /**
+        Id of the session, or zero for a writer that was never attached.
+        */
+        session_id_t id() const { return id_; }
+
+        /**
+        Writes a message to the session.
+        @param [in] message Message to be sent, moved all the way into the session
+        @return False if the session is gone or its write queue limits kept the message out
+        */
+        bool write(TSend&& message) const
+        {
+            auto session = session_.lock();
+            return session && write_(session.get(), std::move(message));
+        }
+
+        bool write(const TSend& message) const
+        {
+            return write(TSend(message));
+        }
+
+        /**
+        Writes an already serialized message to the session.
+        @param [in] serialized Bytes in the format the peer's serializer expects
+        @return False if the session is gone or its write queue limits kept the message out
+        */
+        bool write_frame(std::vector<char>&& serialized) const
+        {
+            auto session = session_.lock();
+            return session && write_frame_(session.get(), std::move(serialized));
+        }
+
+        /**
+        Stops reading from the session once the frames already read have been handled, until resume_reading.
+        Only the session's own handler may call this, from its handle call.
+        @return False if the session is gone
+        */
+        bool pause_reading() const
+        {
+            auto session = session_.lock();
+            if (session)
+                pause_reading_(session.get());
+            return static_cast<bool>(session);
+        }
+
+        /**
+        Reads from the session again after pause_reading. May be called from any thread.
+        @return False if the session is gone
+        */
+        bool resume_reading() const
+        {
+            auto session = session_.lock();
+            if (session)
+                resume_reading_(session.get());
+            return static_cast<bool>(session);
+        }
+
+    private:
+        session_id_t id_;
+        std::weak_ptr<void> session_;
+        bool (*write_)(void* session, TSend&& message);
+        bool (*write_frame_)(void* session, std::vector<char>&& serialized);
+        void (*pause_reading_)(void* session);
+        void (*resume_reading_)(void* session);
+
+        template <typename TComm>
+        static bool write_to(void* session, TSend&& message)
+        {
+            return static_cast<TComm*>(session)->write(std::move(message));
+        }
+
+        template <typename TComm>
+        static bool write_frame_to(void* session, std::vector<char>&& serialized)
+        {
+            return static_cast<TComm*>(session)->write_frame(std::move(serialized));
+        }
+
+        template <typename TComm>
+        static void pause_reading_of(void* session)
+        {
+            static_cast<TComm*>(session)->pause_reading();
+        }
+
+        template <typename TComm>
+        static void resume_reading_of(void* session)
+        {
+            static_cast<TComm*>(session)->resume_reading();
+        }
+    };
+}
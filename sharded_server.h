@@ -0,0 +1,299 @@
+/**
+@file sharded_server.h
+@author Gary Heckman
+@brief Tcp server that spreads its connections over one io_service per core.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "comm_options.h"
+#include "frame.h"
+#include "server.h"
+#include "threading.h"
+
+using namespace boost::asio;
+
+namespace boost_messaging
+{
+    namespace detail
+    {
+#ifdef SO_REUSEPORT
+        typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
+        /**
+        Pins a thread to a single cpu.
+        Does nothing on platforms that don't support it.
+        @param [in, out] thread Thread to pin
+        @param [in]      cpu    Index of the cpu
+        */
+        inline void pin_thread(std::thread& thread, size_t cpu)
+        {
+#if defined(__linux__)
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu % CPU_SETSIZE, &cpus);
+            pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#elif defined(_WIN32)
+            SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << (cpu % (sizeof(DWORD_PTR) * 8)));
+#endif
+        }
+    }
+
+    /**
+    Tcp server that runs one io_service per shard, each on its own thread.
+    Where SO_REUSEPORT is available every shard has its own acceptor on the same
+    endpoint and the kernel spreads new connections over them. Elsewhere a
+    single acceptor hands connections to the shards in turn.
+    Each shard keeps its own sessions, so shards never contend with each other.
+    @tparam TSerializer Type that fulfils the Serializer concept
+    @tparam THandler    Type that fulfils the Handler concept
+    @tparam TThreading  Either single_threaded or multi_threaded
+    */
+    template <typename TSerializer, typename THandler, typename TThreading = single_threaded>
+    class sharded_server
+    {
+    public:
+        typedef ip::tcp::endpoint endpoint_t;
+        typedef typename TSerializer::send_t send_t;
+        typedef detail::server_tcp_interface<TSerializer, THandler, TThreading> interface_t;
+
+        /**
+        Constructor.
+        Starts a thread for every shard.
+        @param [in] endpoint    Endpoint used to accept connections
+        @param [in] shard_count Number of io_services, zero for one per hardware thread
+        @param [in] pin_threads Whether to pin each shard's thread to its own cpu
+        @param [in] options     Tunable settings for each session
+        */
+        sharded_server(const endpoint_t& endpoint, size_t shard_count = 0, bool pin_threads = true, const comm_options& options = comm_options()) :
+            frame_builder_(options.pool ? options.pool : std::make_shared<buffer_pool>()),
+            next_shard_(0)
+        {
+            if (shard_count == 0)
+                shard_count = std::max(1u, std::thread::hardware_concurrency());
+
+            for (size_t i = 0; i < shard_count; ++i)
+                shards_.emplace_back(new shard());
+
+#ifdef SO_REUSEPORT
+            for (auto& s : shards_)
+            {
+                ip::tcp::acceptor acceptor(s->io_service);
+                acceptor.open(endpoint.protocol());
+                acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+                acceptor.set_option(detail::reuse_port(true));
+                acceptor.bind(endpoint);
+                acceptor.listen();
+                s->interface.reset(new interface_t(s->io_service, std::move(acceptor), options));
+            }
+#else
+            for (auto& s : shards_)
+                s->interface.reset(new interface_t(s->io_service, ip::tcp::acceptor(s->io_service), options));
+
+            acceptor_.reset(new ip::tcp::acceptor(shards_.front()->io_service, endpoint));
+            accept_next();
+#endif
+
+            for (size_t i = 0; i < shards_.size(); ++i)
+            {
+                auto& s = *shards_[i];
+                s.interface->start_accept();
+                s.thread = std::thread([&s] { s.io_service.run(); });
+                if (pin_threads)
+                    detail::pin_thread(s.thread, i);
+            }
+        }
+
+        /**
+        Destructor.
+        Stops every shard and waits for its thread.
+        */
+        ~sharded_server()
+        {
+            for (auto& s : shards_)
+                s->io_service.stop();
+
+            for (auto& s : shards_)
+                if (s->thread.joinable())
+                    s->thread.join();
+
+            acceptor_.reset();
+            for (auto& s : shards_)
+                s->interface.reset();
+        }
+
+        sharded_server(const sharded_server&) = delete;
+        sharded_server& operator=(const sharded_server&) = delete;
+
+        /**
+        Writes to every session on every shard.
+        The message is serialized once and every session shares the result.
+        Each session's write is posted to the shard that owns it.
+        @param [in] send_msg Message to be sent
+        @return True if any message was written, false otherwise.
+        */
+        bool write(const send_t& send_msg)
+        {
+            return write_shared(serialize(send_msg));
+        }
+
+        /**
+        Writes to every session on every shard and reports the ones that are backpressured.
+        @param [in]  send_msg      Message to be sent
+        @param [out] backpressured Gets the ids of the sessions whose write queue limits kept the message out
+        @return True if any message was written, false otherwise.
+        */
+        bool write(const send_t& send_msg, std::vector<session_id_t>& backpressured)
+        {
+            return write_shared(serialize(send_msg), &backpressured);
+        }
+
+        /**
+        Writes a shared serialized message to every session on every shard without copying it.
+        @param [in]  serialized    Bytes in the format the clients' serializer expects
+        @param [out] backpressured Gets the ids of the sessions whose write queue limits kept the message out, or null
+        @return True if any message was written, false otherwise.
+        */
+        bool write_shared(const shared_frame& serialized, std::vector<session_id_t>* backpressured = nullptr)
+        {
+            bool did_write = false;
+            for (auto& s : shards_)
+                did_write |= s->interface->write(serialized, backpressured);
+            return did_write;
+        }
+
+        /**
+        Writes to a specific session based on endpoint, whichever shard owns it.
+        @param [in] send_msg Message to be sent
+        @param [in] endpoint Endpoint of the client
+        @return True if the message was written, false otherwise.
+        */
+        bool write(const send_t& send_msg, const endpoint_t& endpoint)
+        {
+            for (auto& s : shards_)
+                if (s->interface->write(send_msg, endpoint))
+                    return true;
+            return false;
+        }
+
+        /**
+        Writes to a specific session based on endpoint, whichever shard owns it.
+        @param [in] send_msg Message to be sent, moved all the way into the session
+        @param [in] endpoint Endpoint of the client
+        @return True if the message was written, false otherwise.
+        */
+        bool write(send_t&& send_msg, const endpoint_t& endpoint)
+        {
+            // A shard only moves from the message when it owns the session
+            for (auto& s : shards_)
+                if (s->interface->write(std::move(send_msg), endpoint))
+                    return true;
+            return false;
+        }
+
+        /**
+        Writes to a specific session based on its id, whichever shard owns it.
+        @param [in] send_msg Message to be sent
+        @param [in] id       Id of the session
+        @return True if the message was written, false otherwise.
+        */
+        bool write(const send_t& send_msg, session_id_t id)
+        {
+            for (auto& s : shards_)
+                if (s->interface->write(send_msg, id))
+                    return true;
+            return false;
+        }
+
+        /**
+        Adds up the counters of every session on every shard without stopping them.
+        @return Counters of the server's sessions
+        */
+        metrics_snapshot metrics() const
+        {
+            metrics_snapshot snapshot;
+            for (auto& s : shards_)
+                snapshot += s->interface->metrics();
+            return snapshot;
+        }
+
+        /**
+        Gets the number of shards.
+        @return Number of io_services
+        */
+        size_t shard_count() const
+        {
+            return shards_.size();
+        }
+
+    private:
+        /**
+        One io_service with its thread and sessions.
+        */
+        struct shard
+        {
+            shard() :
+                io_service(1),
+                work(io_service)
+            { }
+
+            boost::asio::io_service io_service;
+            boost::asio::io_service::work work;
+            std::unique_ptr<interface_t> interface;
+            std::thread thread;
+        };
+
+        std::vector<std::unique_ptr<shard>> shards_;
+        TSerializer serializer_;
+        detail::frame_builder<TSerializer> frame_builder_;
+        std::mutex serializer_mutex_;
+        std::unique_ptr<ip::tcp::acceptor> acceptor_;
+        size_t next_shard_;
+
+        shared_frame serialize(const send_t& send_msg)
+        {
+            std::lock_guard<std::mutex> lock(serializer_mutex_);
+            return frame_builder_.make_shared(serializer_, send_msg);
+        }
+
+        /**
+        Accepts the next connection straight onto the io_service of the next shard.
+        Only used when the kernel can't spread connections itself.
+        */
+        void accept_next()
+        {
+            auto& s = *shards_[next_shard_];
+            next_shard_ = (next_shard_ + 1) % shards_.size();
+
+            auto callback = [this, &s](const boost::system::error_code& error, ip::tcp::socket socket)
+            {
+                if (error == boost::asio::error::operation_aborted)
+                    return;
+
+                if (!error)
+                    s.interface->adopt(std::move(socket));
+                accept_next();
+            };
+            acceptor_->async_accept(s.io_service, callback);
+        }
+    };
+}
@@ -0,0 +1,693 @@
+/**
+@file shm_comm.h
+@author Gary Heckman
+@brief Session that moves messages through shared memory rings.
+@detail
+	Each side of a session makes a ring to write into and hands it to the
+	other side over a unix domain stream socket, along with an eventfd to
+	wake the reader and one to wake the writer. From then on frames are
+	copied straight into the ring and handled in place on the other side,
+	without a system call unless one side has gone to sleep. The socket
+	only carries the news that the other side has gone away.
+
+	Linux only, since it needs memfd_create and eventfd.
+*/
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "backpressure.h"
+#include "comm_options.h"
+#include "frame.h"
+#include "handler_traits.h"
+#include "metrics.h"
+#include "session_registry.h"
+#include "shm_ring.h"
+#include "threading.h"
+
+using namespace boost::asio;
+
+namespace boost_messaging
+{
+    /**
+    Protocol for a client and server on the same host that pass messages through shared memory.
+    Endpoints are paths of unix domain sockets, which are only used to set sessions up and to notice when they end.
+    */
+    struct shared_memory_protocol
+    {
+        typedef local::stream_protocol::endpoint endpoint;
+        typedef local::stream_protocol::socket socket;
+        typedef local::stream_protocol::acceptor acceptor;
+    };
+
+    namespace detail
+    {
+        /**
+        Sends descriptors over a unix domain socket, along with a single byte to carry them.
+        @param [in]  socket Connected unix domain socket
+        @param [in]  fds    Descriptors to send
+        @param [in]  count  Number of descriptors
+        @param [out] error  Set if they couldn't be sent
+        */
+        inline void send_descriptors(int socket, const int* fds, size_t count, boost::system::error_code& error)
+        {
+            char byte = 0;
+            iovec payload = { &byte, 1 };
+            std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+
+            msghdr message = msghdr();
+            message.msg_iov = &payload;
+            message.msg_iovlen = 1;
+            message.msg_control = control.data();
+            message.msg_controllen = control.size();
+            auto header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(count * sizeof(int));
+            std::memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+
+            if (::sendmsg(socket, &message, MSG_NOSIGNAL) != 1)
+                error = boost::system::error_code(errno, boost::asio::error::get_system_category());
+        }
+
+        /**
+        Receives descriptors sent with send_descriptors, without blocking.
+        @param [in]  socket Connected unix domain socket
+        @param [out] fds    Gets the descriptors, which the caller owns
+        @param [in]  count  Most descriptors to take
+        @param [out] error  Set to would_block if nothing has arrived yet, or eof if the other side closed
+        @return Number of descriptors received
+        */
+        inline size_t receive_descriptors(int socket, int* fds, size_t count, boost::system::error_code& error)
+        {
+            char byte;
+            iovec payload = { &byte, 1 };
+            std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+
+            msghdr message = msghdr();
+            message.msg_iov = &payload;
+            message.msg_iovlen = 1;
+            message.msg_control = control.data();
+            message.msg_controllen = control.size();
+
+            auto received = ::recvmsg(socket, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+            if (received < 0)
+            {
+                error = boost::system::error_code(errno, boost::asio::error::get_system_category());
+                return 0;
+            }
+            if (received == 0)
+            {
+                error = boost::asio::error::eof;
+                return 0;
+            }
+
+            size_t taken = 0;
+            for (auto header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+            {
+                if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+                    continue;
+
+                auto available = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (size_t i = 0; i < available; ++i)
+                {
+                    int fd;
+                    std::memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+                    if (taken < count)
+                        fds[taken++] = fd;
+                    else
+                        ::close(fd);
+                }
+            }
+            return taken;
+        }
+
+        template <typename TSerializer, typename THandler, typename TThreading = single_threaded>
+        class shm_comm : public std::enable_shared_from_this<shm_comm<TSerializer, THandler, TThreading>>
+        {
+        public:
+            typedef shared_memory_protocol::socket socket_t;
+            typedef shared_memory_protocol::endpoint endpoint_t;
+            typedef typename TSerializer::send_t send_t;
+            typedef typename TSerializer::recv_t recv_t;
+            typedef typename std::function<void(const boost::system::error_code& error)> error_callback_t;
+            typedef typename TThreading::executor_t executor_t;
+
+            /**
+            Constructor.
+            @param [in, out] io_service   Facilitates async operations
+            @param [in]      socket       Socket of the session
+            @param [in]      options      Tunable settings for the session
+            @param [in]      handler_args Arguments for the handler's constructor, usually none or a handler to copy
+            */
+            template <typename... THandlerArgs>
+            shm_comm(io_service& io_service, socket_t&& socket, const comm_options& options = comm_options(), THandlerArgs&&... handler_args) :
+                io_service_(io_service),
+                id_(next_session_id()),
+                executor_(io_service),
+                socket_(std::move(socket)),
+                options_(options),
+                pool_(options.pool ? options.pool : buffer_pool::shared(io_service)),
+                serializer_(),
+                handler_(std::forward<THandlerArgs>(handler_args)...),
+                tx_data_(io_service),
+                tx_space_(io_service),
+                rx_data_(io_service),
+                rx_space_(io_service),
+                frame_builder_(pool_),
+                written_(0),
+                waiting_for_room_(false),
+                failed_(false),
+                paused_(false),
+                limiter_(options.write_limits, id_),
+                error_callback_(nullptr)
+            {}
+
+            ~shm_comm()
+            {
+                pool_->release(std::move(assembly_));
+                for (auto& queued : write_queue_)
+                    frame_builder_.recycle(queued);
+            }
+
+            // Hands this side's ring to the other side, then reads once the other side's ring arrives.
+            void read()
+            {
+                // Cached so lookups by endpoint don't have to ask the socket
+                boost::system::error_code error;
+                remote_endpoint_ = socket_.remote_endpoint(error);
+                attach_session(handler_, this->shared_from_this());
+
+                executor_.post([this, sp = this->shared_from_this()] { start(); });
+            }
+
+            // Every write returns false if the write queue's limits kept the message out.
+            bool write(const send_t& message)
+            {
+                return write(send_t(message));
+            }
+
+            bool write(send_t&& message)
+            {
+                return post_write(std::move(message));
+            }
+
+            // Queues bytes that were already serialized, they are written as is.
+            bool write_frame(std::vector<char>&& serialized)
+            {
+                return post_write(std::move(serialized));
+            }
+
+            // Queues bytes that are shared with other sessions, they are only copied into the ring.
+            bool write_shared(shared_frame serialized)
+            {
+                return post_write(std::move(serialized));
+            }
+
+            // Writes accepted before the session existed go in past the write queue's limits.
+            void write_accepted(send_t&& message)
+            {
+                post_write(std::move(message), true);
+            }
+
+            void write_frame_accepted(std::vector<char>&& serialized)
+            {
+                post_write(std::move(serialized), true);
+            }
+
+            inline socket_t& socket() { return socket_; }
+
+            inline session_id_t id() const { return id_; }
+
+            // Remote endpoint as of the last call to read().
+            inline const endpoint_t& remote_endpoint() const { return remote_endpoint_; }
+
+            // Counters may be read from any thread.
+            inline const session_metrics& metrics() const { return metrics_; }
+
+            // Anything outside the session that shares its state must run its handlers through here.
+            inline executor_t& executor() { return executor_; }
+
+            void close()
+            {
+                executor_.post([this, sp = this->shared_from_this()] { close_all(); });
+            }
+
+            // Only the handler may pause, from inside its handle call, so the flag is only touched on the executor.
+            void pause_reading()
+            {
+                paused_ = true;
+            }
+
+            void resume_reading()
+            {
+                executor_.post([this, sp = this->shared_from_this()]
+                {
+                    paused_ = false;
+                    if (paused_read_)
+                    {
+                        paused_read_.reset();
+                        read_ring();
+                    }
+                });
+            }
+
+            void set_error_callback(const error_callback_t& error_callback)
+            {
+                error_callback_ = error_callback;
+            }
+
+        private:
+            typedef std::chrono::steady_clock clock_type;
+
+            // Records handled before the reader lets other handlers run
+            static const size_t MAX_RECORDS_PER_READ = 1024;
+
+            io_service & io_service_;
+            const session_id_t id_;
+            executor_t executor_;
+            socket_t socket_;
+            endpoint_t remote_endpoint_;
+            comm_options options_;
+            std::shared_ptr<buffer_pool> pool_;
+            TSerializer serializer_;
+            THandler handler_;
+            message_delivery<THandler, recv_t> delivery_;
+            // Ring this side writes into, with the eventfds that wake the reader and that the reader wakes this side with
+            shm_ring tx_;
+            posix::stream_descriptor tx_data_;
+            posix::stream_descriptor tx_space_;
+            // Ring the other side writes into
+            shm_ring rx_;
+            posix::stream_descriptor rx_data_;
+            posix::stream_descriptor rx_space_;
+            uint64_t tx_event_;
+            uint64_t rx_event_;
+            char control_byte_;
+            // Frame that is split over several records is put back together here
+            std::vector<char> assembly_;
+            clock_type::time_point spin_until_;
+            frame_builder<TSerializer> frame_builder_;
+            std::deque<frame> write_queue_;
+            // Bytes of the frame at the front of the queue that are already in the ring
+            size_t written_;
+            bool waiting_for_room_;
+            bool failed_;
+            bool paused_;
+            // Keeps the session alive while its reading is paused, since nothing else may be pending
+            std::shared_ptr<void> paused_read_;
+            write_limiter limiter_;
+            session_metrics metrics_;
+            error_callback_t error_callback_;
+
+            // Writers blocked on a full queue are let go since it won't drain any more.
+            void fail(const boost::system::error_code& error)
+            {
+                if (failed_)
+                    return;
+                failed_ = true;
+
+                close_all();
+                limiter_.shut_down();
+                if (error_callback_)
+                    error_callback_(error);
+            }
+
+            // Closing the socket tells the other side the session is over.
+            void close_all()
+            {
+                boost::system::error_code ignored;
+                socket_.close(ignored);
+                tx_data_.close(ignored);
+                tx_space_.close(ignored);
+                rx_data_.close(ignored);
+                rx_space_.close(ignored);
+            }
+
+            static void signal(posix::stream_descriptor& event)
+            {
+                uint64_t one = 1;
+                // A full counter already wakes the other side, so a failed write is fine
+                auto written = ::write(event.native_handle(), &one, sizeof(one));
+                (void)written;
+            }
+
+            void start()
+            {
+                if (failed_ || !socket_.is_open())
+                    return;
+
+                boost::system::error_code error;
+                int fds[3] = { tx_.create(options_.shm_ring_bytes, error), -1, -1 };
+                if (fds[0] < 0)
+                    return fail(error);
+
+                fds[1] = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+                if (fds[1] >= 0)
+                    tx_data_.assign(fds[1]);
+                fds[2] = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+                if (fds[2] >= 0)
+                    tx_space_.assign(fds[2]);
+
+                if (fds[1] < 0 || fds[2] < 0)
+                    error = boost::system::error_code(errno, boost::asio::error::get_system_category());
+                else
+                    send_descriptors(socket_.native_handle(), fds, 3, error);
+                ::close(fds[0]);
+                if (error)
+                    return fail(error);
+
+                // Anything written before the ring was ready goes in now
+                write_ring();
+                wait_for_ring();
+            }
+
+            void wait_for_ring()
+            {
+                auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error) { attach(error); });
+                socket_.async_wait(socket_base::wait_read, callback);
+            }
+
+            // Maps the other side's ring once its descriptors arrive.
+            void attach(boost::system::error_code error)
+            {
+                if (error)
+                    return fail(error);
+
+                int fds[3] = { -1, -1, -1 };
+                auto count = receive_descriptors(socket_.native_handle(), fds, 3, error);
+                if (error == boost::asio::error::would_block || error == boost::asio::error::try_again)
+                    return wait_for_ring();
+
+                if (!error && count != 3)
+                    error = boost::asio::error::invalid_argument;
+                if (!error)
+                    rx_.attach(fds[0], error);
+                if (!error)
+                {
+                    rx_data_.assign(fds[1]);
+                    rx_space_.assign(fds[2]);
+                    fds[1] = fds[2] = -1;
+                }
+                for (auto fd : fds)
+                {
+                    if (fd >= 0)
+                        ::close(fd);
+                }
+                if (error)
+                    return fail(error);
+
+                watch();
+                read_ring();
+            }
+
+            // The other side never sends anything else, so the read only ends when it goes away.
+            void watch()
+            {
+                auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t)
+                {
+                    if (error)
+                        fail(error);
+                    else
+                        watch();
+                });
+                socket_.async_read_some(boost::asio::buffer(&control_byte_, 1), callback);
+            }
+
+            // Handles every frame in the ring, then polls or sleeps until more arrive.
+            void read_ring()
+            {
+                if (failed_)
+                    return;
+
+                size_t records = 0;
+                shm_record record;
+                bool corrupt = false;
+                while (records < MAX_RECORDS_PER_READ && rx_.peek(record, corrupt))
+                {
+                    if (record.kind == shm_record_kind::whole)
+                        corrupt = !deliver(record.data, record.size);
+                    else if (record.kind == shm_record_kind::more || record.kind == shm_record_kind::end)
+                    {
+                        if (assembly_.size() + record.size > options_.shm_max_message_bytes)
+                        {
+                            corrupt = true;
+                            break;
+                        }
+                        assembly_.insert(assembly_.end(), record.data, record.data + record.size);
+                        if (record.kind == shm_record_kind::end)
+                        {
+                            corrupt = !deliver(assembly_.data(), assembly_.size());
+                            // Batched messages may point into the assembled frame
+                            delivery_.flush(handler_, metrics_);
+                            assembly_.clear();
+                        }
+                    }
+                    rx_.next(record);
+                    ++records;
+                    if (corrupt)
+                        break;
+                }
+
+                // Batched messages may point into the ring, so they go out before the space is freed
+                delivery_.flush(handler_, metrics_);
+                if (rx_.release())
+                    signal(rx_space_);
+
+                if (corrupt)
+                    return fail(boost::asio::error::invalid_argument);
+
+                // The records left in the ring wait there, and once it fills the other side waits for room
+                if (paused_)
+                {
+                    paused_read_ = this->shared_from_this();
+                    return;
+                }
+
+                if (records != 0)
+                {
+                    spin_until_ = clock_type::now() + options_.shm_spin;
+                    if (records == MAX_RECORDS_PER_READ)
+                    {
+                        executor_.post([this, sp = this->shared_from_this()] { read_ring(); });
+                        return;
+                    }
+                }
+
+                // Polls through the executor so other handlers still get to run
+                if (options_.shm_spin.count() != 0 && clock_type::now() < spin_until_)
+                {
+                    executor_.post([this, sp = this->shared_from_this()] { read_ring(); });
+                    return;
+                }
+
+                if (rx_.sleep())
+                {
+                    executor_.post([this, sp = this->shared_from_this()] { read_ring(); });
+                    return;
+                }
+
+                auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t)
+                {
+                    // The socket reports the other side going away, so errors here only stop the reading
+                    if (error)
+                        return;
+                    rx_.wake();
+                    spin_until_ = clock_type::now() + options_.shm_spin;
+                    read_ring();
+                });
+                rx_data_.async_read_some(boost::asio::buffer(&rx_event_, sizeof(rx_event_)), callback);
+            }
+
+            // Frames that don't match their record, or are malformed, fail the session since the other side can't be trusted after one.
+            bool deliver(const char* begin, size_t size)
+            {
+                auto header_size = serializer_.header_size();
+                if (size < header_size)
+                    return false;
+
+                const char* body_begin = begin + header_size;
+                if (!serializer_.validate_header(begin, body_begin) || serializer_.body_size(begin, body_begin) != size - header_size)
+                    return false;
+
+                metrics_.received(size);
+                return deserialize_body(serializer_, body_begin, begin + size, [this](recv_t&& message) { delivery_.deliver(handler_, metrics_, std::move(message)); });
+            }
+
+            // Serialization happens on the session's executor since the serializer belongs to the session.
+            template <typename TMessage>
+            bool post_write(TMessage&& message, bool accepted = false)
+            {
+                auto admission = accepted ? limiter_.admit_anyway() : limiter_.admit();
+                if (admission == write_limiter::disconnect)
+                    close();
+                if (admission != write_limiter::admitted)
+                    return false;
+
+                executor_.post([this, sp = this->shared_from_this(), message = std::move(message)]() mutable { enter_write_loop(to_frame(std::move(message))); });
+                return true;
+            }
+
+            frame to_frame(send_t&& message) { return frame_builder_.make(serializer_, std::move(message)); }
+            frame to_frame(std::vector<char>&& serialized) { return make_frame(std::move(serialized)); }
+            frame to_frame(shared_frame&& serialized) { return make_frame(serialized); }
+
+            // Frames from here on can still be replaced or dropped; the one before is partly in the ring.
+            size_t first_waiting() const
+            {
+                return written_ != 0 ? 1 : 0;
+            }
+
+            void enter_write_loop(frame&& new_frame)
+            {
+                if (limiter_.backpressured() && limiter_.policy() == overflow_policy::conflate && conflate(new_frame))
+                    return;
+
+                auto bytes = new_frame.size();
+                write_queue_.push_back(std::move(new_frame));
+                limiter_.queued(bytes);
+                drop_overflow();
+                metrics_.write_queue_depth(write_queue_.size());
+                write_ring();
+            }
+
+            // Puts the new frame in the place of a waiting one with the same conflation key.
+            bool conflate(frame& new_frame)
+            {
+                uint64_t new_key;
+                if (!limiter_.key(new_frame, serializer_.header_size(), new_key))
+                    return false;
+
+                for (auto i = first_waiting(); i < write_queue_.size(); ++i)
+                {
+                    uint64_t key;
+                    if (limiter_.key(write_queue_[i], serializer_.header_size(), key) && key == new_key)
+                    {
+                        limiter_.replaced(write_queue_[i].size(), new_frame.size());
+                        frame_builder_.recycle(write_queue_[i]);
+                        write_queue_[i] = std::move(new_frame);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // Drops the oldest frames that aren't partly in the ring while the queue is over its limits.
+            // The newest frame is always kept.
+            void drop_overflow()
+            {
+                if (limiter_.policy() != overflow_policy::drop_oldest && limiter_.policy() != overflow_policy::conflate)
+                    return;
+
+                while (limiter_.over_limit() && write_queue_.size() > first_waiting() + 1)
+                {
+                    auto oldest = write_queue_.begin() + first_waiting();
+                    limiter_.dropped(oldest->size());
+                    frame_builder_.recycle(*oldest);
+                    write_queue_.erase(oldest);
+                }
+            }
+
+            // Copies as many queued frames into the ring as fit, then waits for room if any are left.
+            void write_ring()
+            {
+                if (!tx_.attached() || waiting_for_room_ || failed_)
+                    return;
+
+                size_t frames = 0;
+                size_t bytes = 0;
+                while (!write_queue_.empty())
+                {
+                    auto& front = write_queue_.front();
+                    auto total = front.size();
+                    bool complete = false;
+                    while (!complete)
+                    {
+                        auto piece = std::min(total - written_, tx_.max_piece());
+                        auto kind = piece == total ? shm_record_kind::whole : written_ + piece == total ? shm_record_kind::end : shm_record_kind::more;
+                        auto out = tx_.reserve(piece, kind);
+                        if (!out)
+                            break;
+                        copy_out(front, written_, piece, out);
+                        written_ += piece;
+                        complete = written_ == total;
+                    }
+
+                    if (!complete)
+                        break;
+
+                    limiter_.dequeued(total);
+                    frame_builder_.recycle(front);
+                    write_queue_.pop_front();
+                    written_ = 0;
+                    ++frames;
+                    bytes += total;
+                }
+
+                if (tx_.publish())
+                    signal(tx_data_);
+
+                if (frames != 0)
+                {
+                    metrics_.sent(frames, bytes);
+                    metrics_.write_queue_depth(write_queue_.size());
+                }
+
+                if (!write_queue_.empty())
+                    wait_for_room();
+            }
+
+            void wait_for_room()
+            {
+                if (tx_.wait_for_room())
+                {
+                    executor_.post([this, sp = this->shared_from_this()] { write_ring(); });
+                    return;
+                }
+
+                waiting_for_room_ = true;
+                auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t)
+                {
+                    waiting_for_room_ = false;
+                    if (!error)
+                        write_ring();
+                });
+                tx_space_.async_read_some(boost::asio::buffer(&tx_event_, sizeof(tx_event_)), callback);
+            }
+
+            // Copies part of a frame, whose bytes are its data followed by its body.
+            static void copy_out(const frame& source, size_t from, size_t size, char* out)
+            {
+                auto data_size = source.data.size();
+                if (from < data_size)
+                {
+                    auto count = std::min(size, data_size - from);
+                    std::memcpy(out, source.data.data() + from, count);
+                    out += count;
+                    from += count;
+                    size -= count;
+                }
+                if (size != 0)
+                    std::memcpy(out, static_cast<const char*>(source.body.data()) + (from - data_size), size);
+            }
+        };
+    }
+}
+
+#endif
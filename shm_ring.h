@@ -0,0 +1,359 @@
+/**
+@file shm_ring.h
+@author Gary Heckman
+@brief Single producer, single consumer ring of records in shared memory.
+@detail
+	The ring lives in an anonymous memory file that one process creates and
+	hands to the other, so both map the same pages. The file is sealed at its
+	size before it is handed over and the other process checks the seals, so
+	neither can make the other's mapping fault by truncating the file.
+	The producer only moves the head and the consumer only moves the tail;
+	each sits on its own cache line so they don't fight over it.
+
+	Records are 8 byte aligned and start with an 8 byte header:
+		length (4) | kind (4)
+	A record never wraps around the end of the ring. When one doesn't fit,
+	a pad record fills the rest of the ring and the record starts over at
+	the beginning.
+
+	Either side may go to sleep on an eventfd when the ring is empty or
+	full. It raises its waiting flag first, and the other side only signals
+	the eventfd when it sees the flag, so a busy ring costs no system calls.
+*/
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <boost/system/error_code.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace boost_messaging
+{
+    namespace detail
+    {
+        static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "shared memory rings need lock free atomics");
+
+        /**
+        Kinds of record in a shm_ring.
+        A frame that doesn't fit in one record is split into pieces: every piece but the last is more, the last is end.
+        */
+        enum class shm_record_kind : uint32_t
+        {
+            whole = 1,
+            more = 2,
+            end = 3,
+            pad = 4
+        };
+
+        /**
+        Record read from a shm_ring. The data stays valid until the consumer releases it.
+        */
+        struct shm_record
+        {
+            shm_record_kind kind;
+            const char* data;
+            size_t size;
+        };
+
+        /**
+        One direction of a shared memory session.
+        The creator of a ring produces into it and the process it is handed to consumes from it.
+        */
+        class shm_ring
+        {
+        public:
+            static const size_t RECORD_HEADER_SIZE = 8;
+            static const size_t MIN_CAPACITY = 0x1000;
+            static const int SEALS = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+            shm_ring() :
+                control_(nullptr),
+                data_(nullptr),
+                capacity_(0),
+                cursor_(0),
+                tail_seen_(0)
+            { }
+
+            ~shm_ring()
+            {
+                if (control_)
+                    ::munmap(control_, sizeof(control) + capacity_);
+            }
+
+            shm_ring(const shm_ring&) = delete;
+            shm_ring& operator=(const shm_ring&) = delete;
+
+            bool attached() const { return control_ != nullptr; }
+
+            size_t capacity() const { return capacity_; }
+
+            /**
+            Largest piece of a frame that goes in one record.
+            Half the ring, so the consumer can free one piece while the producer fills the next.
+            */
+            size_t max_piece() const { return capacity_ / 2 - RECORD_HEADER_SIZE; }
+
+            /**
+            Makes a new ring in an anonymous memory file sealed at its size, to be produced into.
+            @param [in]  capacity Bytes for records, rounded up to a power of two
+            @param [out] error    Set if the ring couldn't be made
+            @return Descriptor of the memory file to hand to the consumer, which the caller closes, or -1 on error
+            */
+            int create(size_t capacity, boost::system::error_code& error)
+            {
+                size_t rounded = MIN_CAPACITY;
+                while (rounded < capacity)
+                    rounded <<= 1;
+
+                int fd = ::memfd_create("boost_messaging", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+                if (fd < 0)
+                {
+                    error = last_error();
+                    return -1;
+                }
+                if (::ftruncate(fd, static_cast<off_t>(sizeof(control) + rounded)) != 0 || ::fcntl(fd, F_ADD_SEALS, SEALS) != 0 || !map(fd, rounded, error))
+                {
+                    if (!error)
+                        error = last_error();
+                    ::close(fd);
+                    return -1;
+                }
+
+                // A new memory file is all zeros, which is an empty ring
+                return fd;
+            }
+
+            /**
+            Maps a ring that the producer made, to be consumed from.
+            @param [in]  fd    Descriptor of the memory file, which the caller closes
+            @param [out] error Set if the file isn't a sealed ring or couldn't be mapped
+            @return True if the ring is ready
+            */
+            bool attach(int fd, boost::system::error_code& error)
+            {
+                struct stat status;
+                auto seals = ::fcntl(fd, F_GET_SEALS);
+                if (seals < 0 || ::fstat(fd, &status) != 0)
+                {
+                    error = last_error();
+                    return false;
+                }
+
+                // A file the producer could still shrink would fault the mapping
+                if ((seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW))
+                {
+                    error = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+                    return false;
+                }
+
+                auto size = static_cast<size_t>(status.st_size);
+                auto capacity = size > sizeof(control) ? size - sizeof(control) : 0;
+                if (capacity < MIN_CAPACITY || (capacity & (capacity - 1)) != 0)
+                {
+                    error = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+                    return false;
+                }
+
+                if (!map(fd, capacity, error))
+                    return false;
+                cursor_ = control_->tail.load(std::memory_order_relaxed);
+                return true;
+            }
+
+            /**
+            Producer: makes room for a record at the head, padding to the start of the ring if it doesn't fit before the end.
+            Nothing is visible to the consumer until publish.
+            @param [in] size Bytes in the record, at most max_piece()
+            @param [in] kind Kind of the record
+            @return Where the record's bytes go, or null if the ring is too full
+            */
+            char* reserve(size_t size, shm_record_kind kind)
+            {
+                auto record_size = align(RECORD_HEADER_SIZE + size);
+                auto offset = cursor_ & (capacity_ - 1);
+                auto to_end = capacity_ - offset;
+                if (record_size > to_end)
+                {
+                    if (!has_room(to_end))
+                        return nullptr;
+                    write_header(offset, to_end - RECORD_HEADER_SIZE, shm_record_kind::pad);
+                    cursor_ += to_end;
+                    offset = 0;
+                }
+
+                if (!has_room(record_size))
+                    return nullptr;
+                write_header(offset, size, kind);
+                cursor_ += record_size;
+                return data_ + offset + RECORD_HEADER_SIZE;
+            }
+
+            /**
+            Producer: makes every reserved record visible to the consumer.
+            @return True if the consumer was asleep and has to be woken up
+            */
+            bool publish()
+            {
+                control_->head.store(cursor_, std::memory_order_release);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                return control_->consumer_waiting.load(std::memory_order_relaxed) != 0 && control_->consumer_waiting.exchange(0) != 0;
+            }
+
+            /**
+            Producer: raises the waiting flag after reserve ran out of room.
+            @return True if the consumer freed space since, so there is no need to wait
+            */
+            bool wait_for_room()
+            {
+                control_->producer_waiting.store(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (control_->tail.load(std::memory_order_acquire) == tail_seen_)
+                    return false;
+                control_->producer_waiting.store(0, std::memory_order_relaxed);
+                return true;
+            }
+
+            /**
+            Consumer: gets the next record without freeing it.
+            @param [out] record  Next record
+            @param [out] corrupt Set if the record's header doesn't make sense
+            @return False if there is no record, or it is corrupt
+            */
+            bool peek(shm_record& record, bool& corrupt)
+            {
+                corrupt = false;
+                if (cursor_ == control_->head.load(std::memory_order_acquire))
+                    return false;
+
+                auto offset = cursor_ & (capacity_ - 1);
+                uint32_t header[2];
+                std::memcpy(header, data_ + offset, sizeof(header));
+                record.kind = static_cast<shm_record_kind>(header[1]);
+                record.data = data_ + offset + RECORD_HEADER_SIZE;
+                record.size = header[0];
+                if (record.size > capacity_ - offset - RECORD_HEADER_SIZE || header[1] < 1 || header[1] > 4)
+                {
+                    corrupt = true;
+                    return false;
+                }
+                return true;
+            }
+
+            /**
+            Consumer: moves past the record from the last peek. Its bytes stay valid until release.
+            @param [in] record Record from the last peek
+            */
+            void next(const shm_record& record)
+            {
+                cursor_ += align(RECORD_HEADER_SIZE + record.size);
+            }
+
+            /**
+            Consumer: frees every record moved past, so the producer can reuse the space.
+            @return True if the producer was waiting for room and has to be woken up
+            */
+            bool release()
+            {
+                if (control_->tail.load(std::memory_order_relaxed) == cursor_)
+                    return false;
+                control_->tail.store(cursor_, std::memory_order_release);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                return control_->producer_waiting.load(std::memory_order_relaxed) != 0 && control_->producer_waiting.exchange(0) != 0;
+            }
+
+            /**
+            Consumer: raises the waiting flag when the ring looks empty.
+            @return True if a record came in since, so there is no need to sleep
+            */
+            bool sleep()
+            {
+                control_->consumer_waiting.store(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (control_->head.load(std::memory_order_acquire) == cursor_)
+                    return false;
+                control_->consumer_waiting.store(0, std::memory_order_relaxed);
+                return true;
+            }
+
+            /**
+            Consumer: lowers the waiting flag after waking up.
+            */
+            void wake()
+            {
+                control_->consumer_waiting.store(0, std::memory_order_relaxed);
+            }
+
+        private:
+            /**
+            Start of the shared memory. Positions count every byte ever written, so they never wrap.
+            */
+            struct control
+            {
+                alignas(64) std::atomic<uint64_t> head;
+                std::atomic<uint32_t> consumer_waiting;
+                alignas(64) std::atomic<uint64_t> tail;
+                std::atomic<uint32_t> producer_waiting;
+            };
+
+            control* control_;
+            char* data_;
+            size_t capacity_;
+            // Head for the producer, or the read position for the consumer, in this process only
+            uint64_t cursor_;
+            // Tail the producer saw when it last ran out of room
+            uint64_t tail_seen_;
+
+            static size_t align(size_t size)
+            {
+                return (size + RECORD_HEADER_SIZE - 1) & ~(RECORD_HEADER_SIZE - 1);
+            }
+
+            static boost::system::error_code last_error()
+            {
+                return boost::system::error_code(errno, boost::system::system_category());
+            }
+
+            bool map(int fd, size_t capacity, boost::system::error_code& error)
+            {
+                auto memory = ::mmap(nullptr, sizeof(control) + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (memory == MAP_FAILED)
+                {
+                    error = last_error();
+                    return false;
+                }
+
+                control_ = static_cast<control*>(memory);
+                data_ = static_cast<char*>(memory) + sizeof(control);
+                capacity_ = capacity;
+                return true;
+            }
+
+            bool has_room(size_t size)
+            {
+                if (capacity_ - (cursor_ - tail_seen_) >= size)
+                    return true;
+                tail_seen_ = control_->tail.load(std::memory_order_acquire);
+                return capacity_ - (cursor_ - tail_seen_) >= size;
+            }
+
+            void write_header(size_t offset, size_t size, shm_record_kind kind)
+            {
+                uint32_t header[2] = { static_cast<uint32_t>(size), static_cast<uint32_t>(kind) };
+                std::memcpy(data_ + offset, header, sizeof(header));
+            }
+        };
+    }
+}
+
+#endif
@@ -9,9 +9,17 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
 #include <string>
 #include <vector>
 
+#include <boost/asio/buffer.hpp>
+#include <boost/endian/conversion.hpp>
+
 namespace boost_messaging
 {
 	/**
@@ -49,16 +57,27 @@ namespace boost_messaging
 		{
 			uint32_t size = 0;
 
-			// Extract size in big endian
+			// Extract size in big endian, through unsigned char so bytes with the high bit set don't sign extend
 			for (; first != last; ++first)
 			{
 				size <<= 8;
-				size += *first;
+				size += static_cast<unsigned char>(*first);
 			}
 
 			return size;
 		}
 
+		/**
+		Gets the body size straight out of a buffer with a single load.
+		@param [in] first Pointer to the first character in the header, which is always a whole header
+		*/
+		size_t body_size(const char* first, const char*) const
+		{
+			uint32_t size;
+			std::memcpy(&size, first, sizeof(size));
+			return boost::endian::big_to_native(size);
+		}
+
 		/**
 		Checks the header to make sure it is a reasonable value.
 		Only restraint on the header is that it must be 4 bytes.
@@ -70,7 +89,7 @@ namespace boost_messaging
 		template <typename FwdIter>
 		bool validate_header(FwdIter first, FwdIter last) const
 		{
-			return std::distance(first, last) == header_size();
+			return std::distance(first, last) == static_cast<std::ptrdiff_t>(header_size());
 		}
 
 		/**
@@ -81,26 +100,56 @@ namespace boost_messaging
 		std::vector<char> serialize(const send_t& send_msg) const
 		{
 			// Reserve room for the header and body
-			std::vector<char> buffer(header_size() + send_msg.size());
-
-			// size_t is probably 64-bit on most systems, but 32-bit should be enough for normal uses.
-			uint32_t size = send_msg.size();
+			std::vector<char> buffer(serialized_size(send_msg));
+			serialize_into(send_msg, buffer.data());
+			return buffer;
+		}
 
-			// Get the header end / body begin iterator
-			auto body_begin = buffer.begin() + header_size();
+		/**
+		Gets the size of the serialized message.
+		@param [in] send_msg string to send
+		@return Size of the header and body in bytes
+		*/
+		size_t serialized_size(const send_t& send_msg) const
+		{
+			return header_size() + send_msg.size();
+		}
 
-			// Store size in big endian
-			for (auto it = buffer.begin(); it != body_begin; ++it)
-			{
-				*it = (char)size;
-				size >>= 8;
-			}
-			std::reverse(buffer.begin(), body_begin);
+		/**
+		Serializes the passed in string into a caller-provided buffer.
+		@param [in]  send_msg string to send
+		@param [out] first    Start of a buffer at least serialized_size(send_msg) bytes long
+		*/
+		void serialize_into(const send_t& send_msg, char* first) const
+		{
+			serialize_header(send_msg, first);
 
 			// Store the string in the body portion
-			std::copy(send_msg.begin(), send_msg.end(), body_begin);
+			std::copy(send_msg.begin(), send_msg.end(), first + header_size());
+		}
 
-			return buffer;
+		/**
+		Serializes only the header of the passed in string.
+		The body is sent straight from the string, see body_buffer.
+		@param [in]  send_msg string to send
+		@param [out] first    Start of a buffer at least header_size() bytes long
+		*/
+		void serialize_header(const send_t& send_msg, char* first) const
+		{
+			// size_t is probably 64-bit on most systems, but 32-bit should be enough for normal uses.
+			// Store size in big endian
+			auto size = boost::endian::native_to_big(static_cast<uint32_t>(send_msg.size()));
+			std::memcpy(first, &size, sizeof(size));
+		}
+
+		/**
+		Points at the body of the passed in string without copying it.
+		@param [in] send_msg string to send
+		@return Buffer over the characters of the string
+		*/
+		boost::asio::const_buffer body_buffer(const send_t& send_msg) const
+		{
+			return boost::asio::buffer(send_msg);
 		}
 
 		/**
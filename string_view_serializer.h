@@ -0,0 +1,42 @@
+/**
+@author Gary Heckman
+@file string_view_serializer.h
+@brief String serializer example that deserializes into views
+@detail
+	Example serializer for use with the boost messaging library. It fulfils the
+	Serializer concept. See README for more information.
+*/
+
+#pragma once
+
+#include <iterator>
+
+#include <boost/utility/string_view.hpp>
+
+#include "string_serializer.h"
+
+namespace boost_messaging
+{
+	/**
+	String serializer that hands out views instead of strings.
+	Sends the same wire format as string_serializer, so the two can talk to each other.
+	Received messages point straight into the session's read buffer, so they
+	are only valid for the length of the handle call. Copy what must be kept.
+	*/
+	class string_view_serializer : public string_serializer
+	{
+	public:
+		typedef boost::string_view recv_t;
+
+		/**
+		Points a view at the message body.
+		@param [in] first Pointer to the first character in the body
+		@param [in] last  Pointer past the last character in the body
+		@return View over the body, valid until the handler returns
+		*/
+		recv_t deserialize(const char* first, const char* last) const
+		{
+			return recv_t(first, std::distance(first, last));
+		}
+	};
+}
@@ -1,50 +1,157 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
 #include <functional>
 #include <memory>
-#include <queue>
+#include <utility>
 #include <vector>
 
 #include <boost/asio.hpp>
 
+#include "backpressure.h"
+#include "comm_options.h"
+#include "frame.h"
+#include "handler_traits.h"
+#include "metrics.h"
+#include "session_registry.h"
+#include "threading.h"
+
 using namespace boost::asio;
 
 namespace boost_messaging
 {
     namespace detail
     {
-        template <typename TSerializer, typename THandler>
-        class tcp_comm : public std::enable_shared_from_this<tcp_comm<TSerializer, THandler>>
+        template <typename TSerializer, typename THandler, typename TThreading = single_threaded, typename TProtocol = ip::tcp>
+        class tcp_comm : public std::enable_shared_from_this<tcp_comm<TSerializer, THandler, TThreading, TProtocol>>
         {
         public:
-            typedef ip::tcp::socket socket_t;
+            typedef typename TProtocol::socket socket_t;
+            typedef typename TProtocol::endpoint endpoint_t;
             typedef typename TSerializer::send_t send_t;
             typedef typename TSerializer::recv_t recv_t;
             typedef typename std::function<void(const boost::system::error_code& error)> error_callback_t;
+            typedef typename TThreading::executor_t executor_t;
 
-            tcp_comm(io_service& io_service, socket_t&& socket) :
+            /**
+            Constructor.
+            @param [in, out] io_service   Facilitates async operations
+            @param [in]      socket       Socket of the session
+            @param [in]      options      Tunable settings for the session
+            @param [in]      handler_args Arguments for the handler's constructor, usually none or a handler to copy
+            */
+            template <typename... THandlerArgs>
+            tcp_comm(io_service& io_service, socket_t&& socket, const comm_options& options = comm_options(), THandlerArgs&&... handler_args) :
                 io_service_(io_service),
+                id_(next_session_id()),
+                executor_(io_service),
                 socket_(std::move(socket)),
+                options_(options),
+                pool_(options.pool ? options.pool : buffer_pool::shared(io_service)),
                 serializer_(),
-                handler_(),
+                handler_(std::forward<THandlerArgs>(handler_args)...),
+                read_begin_(0),
+                read_end_(0),
+                frame_builder_(pool_),
+                frames_in_flight_(0),
+                limiter_(options.write_limits, id_),
+                paused_(false),
                 error_callback_(nullptr)
             {}
 
+            ~tcp_comm()
+            {
+                pool_->release(std::move(read_buffer_));
+                for (auto& queued : write_queue_)
+                    frame_builder_.recycle(queued);
+            }
+
             void read()
             {
-                auto header_size = serializer_.header_size();
-                read_buffer_.resize(header_size);
-                auto callback = [this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t) { read_header(error); };
-                async_read(socket_, boost::asio::buffer(read_buffer_), callback);
+                // Cached so lookups by endpoint don't have to ask the socket
+                boost::system::error_code error;
+                remote_endpoint_ = socket_.remote_endpoint(error);
+                attach_session(handler_, this->shared_from_this());
+
+                read_begin_ = 0;
+                read_end_ = 0;
+                pool_->release(std::move(read_buffer_));
+                read_buffer_ = pool_->acquire(options_.read_buffer_size);
+                read_some();
+            }
+
+            // Every write returns false if the write queue's limits kept the message out.
+            bool write(const send_t& message)
+            {
+                return write(send_t(message));
+            }
+
+            bool write(send_t&& message)
+            {
+                return post_write(std::move(message));
             }
 
-            void write(const send_t& message)
+            // Queues bytes that were already serialized, they are written as is.
+            bool write_frame(std::vector<char>&& serialized)
             {
-                io_service_.post([this, message] { enter_write_loop(message); });
+                return post_write(std::move(serialized));
+            }
+
+            // Queues bytes that are shared with other sessions, they are never copied.
+            bool write_shared(shared_frame serialized)
+            {
+                return post_write(std::move(serialized));
+            }
+
+            // Writes accepted before the session existed go in past the write queue's limits.
+            void write_accepted(send_t&& message)
+            {
+                post_write(std::move(message), true);
+            }
+
+            void write_frame_accepted(std::vector<char>&& serialized)
+            {
+                post_write(std::move(serialized), true);
             }
 
             inline socket_t& socket() { return socket_; }
 
+            inline session_id_t id() const { return id_; }
+
+            // Remote endpoint as of the last call to read().
+            inline const endpoint_t& remote_endpoint() const { return remote_endpoint_; }
+
+            // Counters may be read from any thread.
+            inline const session_metrics& metrics() const { return metrics_; }
+
+            // Anything outside the session that shares its state must run its handlers through here.
+            inline executor_t& executor() { return executor_; }
+
+            void close()
+            {
+                executor_.post([this, sp = this->shared_from_this()] { socket_.close(); });
+            }
+
+            // Only the handler may pause, from inside its handle call, so the flag is only touched on the executor.
+            void pause_reading()
+            {
+                paused_ = true;
+            }
+
+            void resume_reading()
+            {
+                executor_.post([this, sp = this->shared_from_this()]
+                {
+                    paused_ = false;
+                    if (paused_read_)
+                    {
+                        paused_read_.reset();
+                        read_some();
+                    }
+                });
+            }
+
             void set_error_callback(const error_callback_t& error_callback)
             {
                 error_callback_ = error_callback;
@@ -52,68 +159,227 @@ namespace boost_messaging
 
         private:
             io_service & io_service_;
+            const session_id_t id_;
+            executor_t executor_;
             socket_t socket_;
+            endpoint_t remote_endpoint_;
+            comm_options options_;
+            std::shared_ptr<buffer_pool> pool_;
             TSerializer serializer_;
             THandler handler_;
+            message_delivery<THandler, recv_t> delivery_;
             std::vector<char> read_buffer_;
-            std::queue<std::vector<char>> write_queue_;
+            size_t read_begin_;
+            size_t read_end_;
+            frame_builder<TSerializer> frame_builder_;
+            std::deque<frame> write_queue_;
+            std::vector<const_buffer> write_buffers_;
+            size_t frames_in_flight_;
+            write_limiter limiter_;
+            session_metrics metrics_;
+            bool paused_;
+            // Keeps the session alive while its reading is paused, since nothing else may be pending
+            std::shared_ptr<void> paused_read_;
             error_callback_t error_callback_;
 
-            void read_header(const boost::system::error_code& error)
+            // Writers blocked on a full queue are let go since it won't drain any more.
+            void fail(const boost::system::error_code& error)
             {
-                if (!error)
+                limiter_.shut_down();
+                if (error_callback_)
+                    error_callback_(error);
+            }
+
+            // A stream can't be read past a bad frame, so the session is closed after the messages before it are handled.
+            void reject_frame()
+            {
+                delivery_.flush(handler_, metrics_);
+                boost::system::error_code ignored;
+                socket_.close(ignored);
+                fail(boost::system::errc::make_error_code(boost::system::errc::bad_message));
+            }
+
+            // Reads as much as the socket has into the free space after any partial frame.
+            void read_some()
+            {
+                if (read_begin_ != 0)
                 {
-                    auto header_is_valid = serializer_.validate_header(read_buffer_.begin(), read_buffer_.end());
-                    // TODO [1] do something if header isn't valid
-                    auto body_size = serializer_.body_size(read_buffer_.begin(), read_buffer_.end());
-                    read_buffer_.resize(body_size);
-                    auto callback = [this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t) { read_body(error); };
-                    async_read(socket_, boost::asio::buffer(read_buffer_), callback);
+                    std::copy(read_buffer_.begin() + read_begin_, read_buffer_.begin() + read_end_, read_buffer_.begin());
+                    read_end_ -= read_begin_;
+                    read_begin_ = 0;
                 }
-                else if (error_callback_)
-                    error_callback_(error);
+
+                auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t bytes_read) { read_frames(error, bytes_read); });
+                socket_.async_read_some(boost::asio::buffer(&read_buffer_[read_end_], read_buffer_.size() - read_end_), callback);
             }
 
-            void read_body(const boost::system::error_code& error)
+            // Cuts every complete frame out of the buffer in place and leaves a partial one for the next read.
+            void read_frames(const boost::system::error_code& error, size_t bytes_read)
             {
                 if (!error)
                 {
-                    auto mesage = serializer_.deserialize(read_buffer_.begin(), read_buffer_.end());
-                    handler_.handle(mesage);
+                    read_end_ += bytes_read;
 
                     auto header_size = serializer_.header_size();
-                    read_buffer_.resize(header_size);
-                    auto callback = [this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t) { read_header(error); };
-                    async_read(socket_, boost::asio::buffer(read_buffer_), callback);
+                    size_t partial_frame_size = 0;
+                    while (read_end_ - read_begin_ >= header_size)
+                    {
+                        const char* header_begin = read_buffer_.data() + read_begin_;
+                        const char* body_begin = header_begin + header_size;
+                        if (!serializer_.validate_header(header_begin, body_begin))
+                            return reject_frame();
+
+                        auto body_size = serializer_.body_size(header_begin, body_begin);
+                        auto frame_size = header_size + body_size;
+
+                        if (read_end_ - read_begin_ < frame_size)
+                        {
+                            partial_frame_size = frame_size;
+                            break;
+                        }
+
+                        metrics_.received(frame_size);
+                        if (!deserialize_body(serializer_, body_begin, body_begin + body_size, [this](recv_t&& message) { delivery_.deliver(handler_, metrics_, std::move(message)); }))
+                            return reject_frame();
+
+                        read_begin_ += frame_size;
+                    }
+
+                    // Batched messages may point into the buffer, so they go out before it is resized
+                    delivery_.flush(handler_, metrics_);
+
+                    // Make sure the whole frame fits once the partial frame is moved to the front
+                    if (partial_frame_size > read_buffer_.size())
+                        read_buffer_.resize(partial_frame_size);
+
+                    if (read_begin_ == read_end_)
+                        read_begin_ = read_end_ = 0;
+
+                    if (paused_)
+                        paused_read_ = this->shared_from_this();
+                    else
+                        read_some();
                 }
-                else if (error_callback_)
-                    error_callback_(error);
+                else
+                    fail(error);
+            }
+
+            // Serialization happens on the session's executor since the serializer belongs to the session.
+            template <typename TMessage>
+            bool post_write(TMessage&& message, bool accepted = false)
+            {
+                auto admission = accepted ? limiter_.admit_anyway() : limiter_.admit();
+                if (admission == write_limiter::disconnect)
+                    close();
+                if (admission != write_limiter::admitted)
+                    return false;
+
+                executor_.post([this, sp = this->shared_from_this(), message = std::move(message)]() mutable { enter_write_loop(to_frame(std::move(message))); });
+                return true;
+            }
+
+            frame to_frame(send_t&& message) { return frame_builder_.make(serializer_, std::move(message)); }
+            frame to_frame(std::vector<char>&& serialized) { return make_frame(std::move(serialized)); }
+            frame to_frame(shared_frame&& serialized) { return make_frame(serialized); }
+
+            void enter_write_loop(frame&& new_frame)
+            {
+                if (limiter_.backpressured() && limiter_.policy() == overflow_policy::conflate && conflate(new_frame))
+                    return;
+
+                auto bytes = new_frame.size();
+                write_queue_.push_back(std::move(new_frame));
+                limiter_.queued(bytes);
+                drop_overflow();
+                metrics_.write_queue_depth(write_queue_.size());
+                if (frames_in_flight_ == 0)
+                    write_batch();
             }
 
-            void enter_write_loop(const send_t& message)
+            // Puts the new frame in the place of a waiting one with the same conflation key.
+            bool conflate(frame& new_frame)
             {
-                auto writing = !write_queue_.empty();
-                write_queue_.push(serializer_.serialize(message));
-                if (!writing)
+                uint64_t new_key;
+                if (!limiter_.key(new_frame, serializer_.header_size(), new_key))
+                    return false;
+
+                for (auto i = frames_in_flight_; i < write_queue_.size(); ++i)
+                {
+                    uint64_t key;
+                    if (limiter_.key(write_queue_[i], serializer_.header_size(), key) && key == new_key)
+                    {
+                        limiter_.replaced(write_queue_[i].size(), new_frame.size());
+                        frame_builder_.recycle(write_queue_[i]);
+                        write_queue_[i] = std::move(new_frame);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // Drops the oldest frames that aren't being written while the queue is over its limits.
+            // The newest frame is always kept.
+            void drop_overflow()
+            {
+                if (limiter_.policy() != overflow_policy::drop_oldest && limiter_.policy() != overflow_policy::conflate)
+                    return;
+
+                while (limiter_.over_limit() && write_queue_.size() > frames_in_flight_ + 1)
                 {
-                    auto callback = [this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t) { write_loop(error); };
-                    async_write(socket_, boost::asio::buffer(write_queue_.front()), callback);
+                    auto oldest = write_queue_.begin() + frames_in_flight_;
+                    limiter_.dropped(oldest->size());
+                    frame_builder_.recycle(*oldest);
+                    write_queue_.erase(oldest);
                 }
             }
 
+            // Gathers as many queued frames as the options allow into a single write.
+            // At least one frame is always taken, even if it is larger than the byte limit.
+            void write_batch()
+            {
+                size_t bytes = 0;
+                write_buffers_.clear();
+                frames_in_flight_ = 0;
+                for (const auto& queued : write_queue_)
+                {
+                    auto has_data = !queued.data.empty();
+                    auto has_body = buffer_size(queued.body) != 0;
+                    auto buffer_count = write_buffers_.size() + has_data + has_body;
+                    if (frames_in_flight_ != 0 && (buffer_count > options_.max_write_buffers || bytes + queued.size() > options_.max_write_bytes))
+                        break;
+
+                    if (has_data)
+                        write_buffers_.push_back(boost::asio::buffer(queued.data));
+                    if (has_body)
+                        write_buffers_.push_back(queued.body);
+                    bytes += queued.size();
+                    ++frames_in_flight_;
+                }
+
+                auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t) { write_loop(error); });
+                async_write(socket_, write_buffers_, callback);
+            }
+
             void write_loop(const boost::system::error_code& error)
             {
                 if (!error)
                 {
-                    write_queue_.pop();
-                    if (!write_queue_.empty())
+                    size_t bytes = 0;
+                    for (size_t i = 0; i < frames_in_flight_; ++i)
                     {
-                        auto callback = [this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t) { write_loop(error); };
-                        async_write(socket_, boost::asio::buffer(write_queue_.front()), callback);
+                        bytes += write_queue_[i].size();
+                        limiter_.dequeued(write_queue_[i].size());
+                        frame_builder_.recycle(write_queue_[i]);
                     }
+                    write_queue_.erase(write_queue_.begin(), write_queue_.begin() + frames_in_flight_);
+                    metrics_.sent(frames_in_flight_, bytes);
+                    metrics_.write_queue_depth(write_queue_.size());
+                    frames_in_flight_ = 0;
+                    if (!write_queue_.empty())
+                        write_batch();
                 }
-                else if (error_callback_)
-                    error_callback_(error);
+                else
+                    fail(error);
             }
         };
     }
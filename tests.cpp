@@ -0,0 +1,666 @@
+/**
+@author Gary Heckman
+@file tests.cpp
+@brief Checks of the data structures behind the library
+@detail
+	Each check_ function drives one structure through its edge cases
+	directly, without sockets, and reports every expectation that doesn't
+	hold. The program exits with a non-zero status if any of them failed.
+
+	Build and run on Linux with
+		g++ -std=c++14 -I<boost> tests.cpp -o tests -lpthread -lz && ./tests
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "compressing_serializer.h"
+#include "dispatch.h"
+#include "pod_serializer.h"
+#include "pubsub.h"
+#include "shm_ring.h"
+#include "string_serializer.h"
+#include "string_view_serializer.h"
+#include "udp_fragments.h"
+
+using namespace boost_messaging;
+
+namespace
+{
+	int failures = 0;
+
+	void expect(bool condition, const char* expression, const char* file, int line)
+	{
+		if (condition)
+			return;
+		++failures;
+		std::cerr << file << ':' << line << ": expected " << expression << std::endl;
+	}
+
+#define EXPECT(condition) expect((condition), #condition, __FILE__, __LINE__)
+
+	// The headers bring boost::asio::detail in as well
+	typedef boost_messaging::detail::topic_index topic_index;
+	typedef boost_messaging::detail::shm_ring shm_ring;
+	typedef boost_messaging::detail::shm_record shm_record;
+	typedef boost_messaging::detail::shm_record_kind shm_record_kind;
+	typedef boost_messaging::detail::mpsc_queue<std::string> string_queue;
+	typedef boost_messaging::detail::reassembly_table<> reassembly_table;
+	typedef std::vector<std::vector<char>> fragments_t;
+	typedef std::vector<session_id_t> ids_t;
+
+	ids_t match(topic_index& index, const std::string& topic)
+	{
+		ids_t ids;
+		index.match(topic, ids);
+		return ids;
+	}
+
+	void check_topic_index()
+	{
+		EXPECT(!topic_index::is_pattern("prices/eur/usd"));
+		EXPECT(topic_index::is_pattern("prices/+/usd"));
+		EXPECT(topic_index::is_pattern("prices/#"));
+		EXPECT(!topic_index::is_pattern("prices/a+b/#x"));
+
+		topic_index index;
+		EXPECT(index.subscribe("prices/eur/usd", 1));
+		EXPECT(!index.subscribe("prices/eur/usd", 1));
+		EXPECT(index.subscribe("prices/+/usd", 2));
+		EXPECT(index.subscribe("prices/#", 3));
+		EXPECT(index.subscribe("#", 4));
+		EXPECT(index.subscribe("x/+/y", 5));
+		EXPECT(!index.subscribe("a/#/b", 6));
+		EXPECT(!index.subscribe("#/b", 6));
+
+		// Exact, '+' and '#' subscriptions together, each session once and in order
+		EXPECT(match(index, "prices/eur/usd") == (ids_t{ 1, 2, 3, 4 }));
+		EXPECT(match(index, "prices/gbp/usd") == (ids_t{ 2, 3, 4 }));
+		// '+' matches exactly one level
+		EXPECT(match(index, "prices/usd") == (ids_t{ 3, 4 }));
+		EXPECT(match(index, "prices/eur/gbp/usd") == (ids_t{ 3, 4 }));
+		// '#' matches no levels too, so "prices/#" gets "prices"
+		EXPECT(match(index, "prices") == (ids_t{ 3, 4 }));
+		EXPECT(match(index, "news") == (ids_t{ 4 }));
+		EXPECT(match(index, "") == (ids_t{ 4 }));
+		// Empty levels are levels like any other
+		EXPECT(match(index, "x//y") == (ids_t{ 4, 5 }));
+		EXPECT(match(index, "x/y") == (ids_t{ 4 }));
+
+		// A session with several matching subscriptions still gets a message once
+		EXPECT(index.subscribe("prices/eur/+", 1));
+		EXPECT(match(index, "prices/eur/usd") == (ids_t{ 1, 2, 3, 4 }));
+
+		EXPECT(index.unsubscribe("prices/eur/usd", 1));
+		EXPECT(!index.unsubscribe("prices/eur/usd", 1));
+		EXPECT(!index.unsubscribe("prices/+/usd", 1));
+		EXPECT(match(index, "prices/eur/usd") == (ids_t{ 1, 2, 3, 4 }));
+		EXPECT(index.unsubscribe("prices/eur/+", 1));
+		EXPECT(index.unsubscribe("#", 4));
+		EXPECT(match(index, "prices/eur/usd") == (ids_t{ 2, 3 }));
+		EXPECT(index.unsubscribe("prices/+/usd", 2));
+		EXPECT(index.unsubscribe("prices/#", 3));
+		EXPECT(index.unsubscribe("x/+/y", 5));
+		EXPECT(match(index, "prices/eur/usd").empty());
+		EXPECT(match(index, "x//y").empty());
+
+		// Pruned nodes can be subscribed again
+		EXPECT(index.subscribe("prices/+/usd", 7));
+		EXPECT(match(index, "prices/eur/usd") == (ids_t{ 7 }));
+	}
+
+	struct pod_point
+	{
+		int32_t x;
+		int32_t y;
+	};
+
+	struct pod_flags
+	{
+		uint8_t flags;
+	};
+
+	void check_pod_serializer()
+	{
+		typedef pod_serializer<pod_point, pod_flags> serializer_t;
+		serializer_t serializer;
+		auto header_size = serializer.header_size();
+
+		auto frame = serializer.serialize(serializer_t::send_t(pod_point{ -3, 70000 }));
+		EXPECT(frame.size() == header_size + sizeof(pod_point));
+		EXPECT(serializer.validate_header(frame.data(), frame.data() + header_size));
+
+		// The iterator overload and the single load overload read the same header
+		const std::vector<char>& header = frame;
+		EXPECT(serializer.body_size(header.begin(), header.begin() + header_size) == sizeof(pod_point));
+		EXPECT(serializer.body_size(frame.data(), frame.data() + header_size) == sizeof(pod_point));
+		auto message = serializer.deserialize(frame.data() + header_size, frame.data() + frame.size());
+		auto point = boost::get<pod_point>(&message);
+		EXPECT(point && point->x == -3 && point->y == 70000);
+
+		// The body size follows the type id of the last header read
+		auto flags_frame = serializer.serialize(serializer_t::send_t(pod_flags{ 0x81 }));
+		EXPECT(serializer.body_size(flags_frame.data(), flags_frame.data() + header_size) == sizeof(pod_flags));
+		message = serializer.deserialize(flags_frame.data() + header_size, flags_frame.data() + flags_frame.size());
+		auto flags = boost::get<pod_flags>(&message);
+		EXPECT(flags && flags->flags == 0x81);
+
+		// serialized_size and serialize_into agree with serialize
+		std::vector<char> into(serializer.serialized_size(serializer_t::send_t(pod_point{ -3, 70000 })));
+		serializer.serialize_into(serializer_t::send_t(pod_point{ -3, 70000 }), into.data());
+		EXPECT(into == frame);
+
+		// Unknown type ids fail the header and get no body, short headers fail too
+		const char unknown[] = { 0, 0, 0, 2 };
+		EXPECT(!serializer.validate_header(unknown, unknown + sizeof(unknown)));
+		EXPECT(serializer.body_size(unknown, unknown + sizeof(unknown)) == 0);
+		const char high_bit[] = { '\x80', 0, 0, 0 };
+		EXPECT(!serializer.validate_header(high_bit, high_bit + sizeof(high_bit)));
+		EXPECT(!serializer.validate_header(frame.data(), frame.data() + header_size - 1));
+	}
+
+	void check_string_serializer()
+	{
+		string_serializer serializer;
+		auto header_size = serializer.header_size();
+
+		std::string body(0x80 + 0x85, 'x');
+		auto frame = serializer.serialize(body);
+		EXPECT(frame.size() == header_size + body.size());
+		EXPECT(serializer.validate_header(frame.data(), frame.data() + header_size));
+		EXPECT(serializer.deserialize(frame.data() + header_size, frame.data() + frame.size()) == body);
+
+		// Length bytes with the high bit set must not sign extend through char
+		const char high_bytes[] = { 0, '\x81', 0, '\x85' };
+		const std::vector<char> header(high_bytes, high_bytes + sizeof(high_bytes));
+		EXPECT(serializer.body_size(header.begin(), header.end()) == 0x810085);
+		EXPECT(serializer.body_size(high_bytes, high_bytes + sizeof(high_bytes)) == 0x810085);
+		EXPECT(serializer.body_size(frame.data(), frame.data() + header_size) == 0x105);
+		EXPECT(serializer.body_size(frame.begin(), frame.begin() + header_size) == 0x105);
+	}
+
+	void check_topic_serializer()
+	{
+		typedef topic_serializer<string_serializer> serializer_t;
+		serializer_t serializer;
+		auto header_size = serializer.header_size();
+
+		auto frame = serializer.serialize(serializer_t::send_t{ topic_kind::message, "a/b", "body" });
+		serializer_t::recv_t message;
+		auto body_size = serializer.body_size(frame.data(), frame.data() + header_size);
+		EXPECT(serializer.validate_header(frame.data(), frame.data() + header_size));
+		EXPECT(header_size + body_size == frame.size());
+		EXPECT(serializer.try_deserialize(frame.data() + header_size, frame.data() + frame.size(), message));
+		EXPECT(message.kind == topic_kind::message && message.topic == "a/b" && message.body == "body");
+
+		// serialized_size and serialize_into agree with serialize
+		serializer_t::send_t sent{ topic_kind::message, "a/b", "body" };
+		std::vector<char> into(serializer.serialized_size(sent));
+		serializer.serialize_into(sent, into.data());
+		EXPECT(into == frame);
+
+		// Unknown kinds fail the header, frames that don't add up fail the body
+		const char bad_kind[] = { 3, 0, 0, 0, 0, 0, 0 };
+		EXPECT(!serializer.validate_header(bad_kind, bad_kind + sizeof(bad_kind)));
+
+		const char zeros[7] = {};
+		serializer.body_size(zeros, zeros + header_size);
+		EXPECT(!serializer.try_deserialize(zeros + header_size, zeros + header_size, message));
+
+		const char short_topic[] = { 0, 0, 5, 0, 0, 0, 0, 'a' };
+		serializer.body_size(short_topic, short_topic + header_size);
+		EXPECT(!serializer.try_deserialize(short_topic + header_size, short_topic + sizeof(short_topic), message));
+
+		const char control_with_body[] = { 1, 0, 1, 0, 0, 0, 1, 'a', 'b' };
+		serializer.body_size(control_with_body, control_with_body + header_size);
+		EXPECT(!serializer.try_deserialize(control_with_body + header_size, control_with_body + sizeof(control_with_body), message));
+
+		const char inner_too_long[] = { 0, 0, 1, 0, 0, 0, 6, 't', 0, 0, 0, 9, 'x' };
+		serializer.body_size(inner_too_long, inner_too_long + header_size);
+		EXPECT(!serializer.try_deserialize(inner_too_long + header_size, inner_too_long + sizeof(inner_too_long), message));
+	}
+
+	void check_frame_builder()
+	{
+		string_serializer serializer;
+		boost_messaging::detail::frame_builder<string_serializer> builder(std::make_shared<buffer_pool>());
+
+		// Small messages are copied whole, bigger ones are sent from the string itself
+		std::string small(boost_messaging::detail::SMALL_FRAME_SIZE - serializer.header_size() - 1, 's');
+		auto small_frame = builder.make(serializer, std::string(small));
+		EXPECT(small_frame.data == serializer.serialize(small));
+		EXPECT(boost::asio::buffer_size(small_frame.body) == 0 && !small_frame.owner);
+
+		std::string big(boost_messaging::detail::SMALL_FRAME_SIZE, 'b');
+		auto big_frame = builder.make(serializer, std::string(big));
+		EXPECT(big_frame.data.size() == serializer.header_size());
+		EXPECT(boost::asio::buffer_size(big_frame.body) == big.size() && big_frame.owner);
+		EXPECT(big_frame.size() == serializer.serialize(big).size());
+	}
+
+	void check_owned_message()
+	{
+		static_assert(is_view<boost::string_view>::value && !is_view<std::string>::value, "string views are views");
+		static_assert(std::is_same<owned_message<boost::string_view>::type, std::string>::value, "string views are owned as strings");
+		static_assert(std::is_same<owned_message<topic_message<boost::string_view>>::type, topic_message<std::string>>::value, "adaptors own their bodies");
+#ifdef BOOST_MESSAGING_STD_STRING_VIEW
+		static_assert(is_view<std::string_view>::value, "std string views are views");
+		static_assert(std::is_same<owned_message<std::wstring_view>::type, std::wstring>::value, "std string views are owned as strings");
+#endif
+
+		char buffer[] = "payload";
+		auto owned = owned_message<boost::string_view>::own(boost::string_view(buffer, 3));
+		buffer[0] = 'x';
+		EXPECT(owned == "pay");
+	}
+
+	typedef compressing_serializer<string_serializer> compressing_t;
+
+	// Flag of a serialized frame, or -1 if there is none
+	int compression_flag(const std::vector<char>& frame)
+	{
+		return frame.size() > sizeof(uint32_t) ? frame[sizeof(uint32_t)] : -1;
+	}
+
+	bool decodes(compressing_t& serializer, const std::vector<char>& frame, std::string& message)
+	{
+		return serializer.try_deserialize(frame.data() + serializer.header_size(), frame.data() + frame.size(), message);
+	}
+
+	void check_compressing_serializer()
+	{
+		compressing_t serializer;
+		std::string message;
+
+		// Only frames from the threshold on are compressed, and only if that makes them smaller
+		std::string small(100, 's');
+		std::string big(4000, 'b');
+		std::string noise(4000, 0);
+		uint32_t state = 1;
+		for (auto& c : noise)
+		{
+			state = state * 1103515245 + 12345;
+			c = static_cast<char>(state >> 24);
+		}
+		auto small_frame = serializer.serialize(small);
+		auto big_frame = serializer.serialize(big);
+		auto noise_frame = serializer.serialize(noise);
+		EXPECT(compression_flag(small_frame) == 0 && compression_flag(noise_frame) == 0);
+		EXPECT(compression_flag(big_frame) == 1 && big_frame.size() < big.size());
+		EXPECT(decodes(serializer, small_frame, message) && message == small);
+		EXPECT(decodes(serializer, noise_frame, message) && message == noise);
+		EXPECT(decodes(serializer, big_frame, message) && message == big);
+
+		// Unknown flags and missing flags are turned down
+		auto bad_flag = small_frame;
+		bad_flag[sizeof(uint32_t)] = 2;
+		EXPECT(!decodes(serializer, bad_flag, message));
+		EXPECT(!decodes(serializer, std::vector<char>(sizeof(uint32_t)), message));
+
+		// An uncompressed frame must be a whole inner frame
+		auto short_inner = small_frame;
+		short_inner.pop_back();
+		EXPECT(!decodes(serializer, short_inner, message));
+
+		// So must a truncated or corrupt deflate stream
+		auto truncated = big_frame;
+		truncated.resize(truncated.size() - 4);
+		EXPECT(!decodes(serializer, truncated, message));
+		auto corrupt = big_frame;
+		for (size_t i = sizeof(uint32_t) + 5; i < corrupt.size(); ++i)
+			corrupt[i] = static_cast<char>(~corrupt[i]);
+		EXPECT(!decodes(serializer, corrupt, message));
+
+		// The inner size has to be what the stream inflates to
+		const size_t inner_size_at = sizeof(uint32_t) + 1;
+		auto larger = big_frame;
+		larger[inner_size_at + 3] = static_cast<char>(larger[inner_size_at + 3] + 1);
+		EXPECT(!decodes(serializer, larger, message));
+		auto smaller = big_frame;
+		smaller[inner_size_at + 3] = static_cast<char>(smaller[inner_size_at + 3] - 1);
+		EXPECT(!decodes(serializer, smaller, message));
+
+		// An inner size deflate can't reach from the stream is turned down before anything is inflated
+		auto inflated = big_frame;
+		inflated[inner_size_at] = 0x7f;
+		EXPECT(!decodes(serializer, inflated, message));
+
+		// The serializer still works after all that
+		EXPECT(decodes(serializer, big_frame, message) && message == big);
+	}
+
+	// Keeps what it was handed in its one handle_batch call
+	struct batch_handler
+	{
+		std::vector<std::string> messages;
+		size_t calls = 0;
+
+		void handle(const std::string&) {}
+
+		void handle_batch(const std::string* first, const std::string* last)
+		{
+			++calls;
+			messages.assign(first, last);
+		}
+	};
+
+	void check_compressed_batch()
+	{
+		typedef compressing_serializer<string_view_serializer> serializer_t;
+		static_assert(std::is_same<serializer_t::recv_t, std::string>::value, "decompressed views are owned");
+
+		// Two compressed frames in one read are both handed over at the end of it
+		serializer_t serializer;
+		std::string first(4000, 'a');
+		std::string second(2000, 'b');
+		auto read = serializer.serialize(first);
+		auto second_frame = serializer.serialize(second);
+		EXPECT(read.size() < first.size() && second_frame.size() < second.size());
+		read.insert(read.end(), second_frame.begin(), second_frame.end());
+
+		batch_handler handler;
+		boost_messaging::detail::message_delivery<batch_handler, serializer_t::recv_t> delivery;
+		boost_messaging::detail::session_metrics metrics;
+		serializer_t receiver;
+		auto header_size = receiver.header_size();
+		const char* frame = read.data();
+		while (frame != read.data() + read.size())
+		{
+			auto body = frame + header_size;
+			auto body_size = receiver.body_size(frame, body);
+			EXPECT(boost_messaging::detail::deserialize_body(receiver, body, body + body_size,
+				[&](serializer_t::recv_t&& message) { delivery.deliver(handler, metrics, std::move(message)); }));
+			frame = body + body_size;
+		}
+		delivery.flush(handler, metrics);
+		EXPECT(handler.calls == 1);
+		EXPECT(handler.messages == (std::vector<std::string>{ first, second }));
+	}
+
+	void check_mpsc_queue()
+	{
+		string_queue queue(3);
+		EXPECT(queue.capacity() == 4);
+		EXPECT(queue.size() == 0);
+
+		std::string value;
+		EXPECT(!queue.try_pop(value));
+
+		// Each round fills the queue, so the indexes wrap the cells many times over
+		for (int round = 0; round < 10; ++round)
+		{
+			for (int i = 0; i < 4; ++i)
+			{
+				value = std::to_string(round * 4 + i);
+				EXPECT(queue.try_push(value));
+				EXPECT(value.empty());
+			}
+
+			// A value that doesn't fit is left with the caller
+			value = "extra";
+			EXPECT(!queue.try_push(value));
+			EXPECT(value == "extra");
+			EXPECT(queue.size() == 4);
+
+			for (int i = 0; i < 4; ++i)
+				EXPECT(queue.try_pop(value) && value == std::to_string(round * 4 + i));
+			EXPECT(!queue.try_pop(value));
+			EXPECT(queue.size() == 0);
+		}
+
+		// Pops interleaved with pushes keep the order across the wrap
+		int pushed = 0;
+		int popped = 0;
+		for (int i = 0; i < 25; ++i)
+		{
+			value = std::to_string(pushed);
+			if (queue.try_push(value))
+				++pushed;
+			value = std::to_string(pushed);
+			if (queue.try_push(value))
+				++pushed;
+			EXPECT(queue.try_pop(value) && value == std::to_string(popped++));
+		}
+		EXPECT(queue.size() == static_cast<size_t>(pushed - popped));
+		while (queue.try_pop(value))
+			EXPECT(value == std::to_string(popped++));
+		EXPECT(popped == pushed);
+	}
+
+	bool produce(shm_ring& ring, size_t size, shm_record_kind kind, char fill)
+	{
+		auto data = ring.reserve(size, kind);
+		if (!data)
+			return false;
+		std::memset(data, fill, size);
+		ring.publish();
+		return true;
+	}
+
+	bool consume(shm_ring& ring, size_t size, shm_record_kind kind, char fill)
+	{
+		shm_record record;
+		bool corrupt = false;
+		if (!ring.peek(record, corrupt) || record.kind != kind || record.size != size)
+			return false;
+		for (size_t i = 0; i < size; ++i)
+		{
+			if (record.data[i] != fill)
+				return false;
+		}
+		ring.next(record);
+		ring.release();
+		return true;
+	}
+
+	void check_shm_ring()
+	{
+		boost::system::error_code error;
+		shm_ring producer;
+		auto fd = producer.create(100, error);
+		EXPECT(fd >= 0 && !error);
+		if (fd < 0)
+			return;
+		EXPECT(producer.capacity() == shm_ring::MIN_CAPACITY);
+		EXPECT(producer.max_piece() == shm_ring::MIN_CAPACITY / 2 - shm_ring::RECORD_HEADER_SIZE);
+
+		// The file can't change size once it is handed over
+		EXPECT((::fcntl(fd, F_GET_SEALS) & shm_ring::SEALS) == shm_ring::SEALS);
+		EXPECT(::ftruncate(fd, 0) != 0);
+
+		shm_ring consumer;
+		EXPECT(consumer.attach(fd, error) && !error);
+		::close(fd);
+
+		shm_record record;
+		bool corrupt = false;
+		EXPECT(!consumer.peek(record, corrupt) && !corrupt);
+
+		// Three records leave less than the fourth needs before the end of the ring
+		EXPECT(produce(producer, 1000, shm_record_kind::more, 'a'));
+		EXPECT(produce(producer, 1000, shm_record_kind::more, 'b'));
+		EXPECT(produce(producer, 1000, shm_record_kind::end, 'c'));
+		EXPECT(consume(consumer, 1000, shm_record_kind::more, 'a'));
+		EXPECT(consume(consumer, 1000, shm_record_kind::more, 'b'));
+		EXPECT(consume(consumer, 1000, shm_record_kind::end, 'c'));
+
+		// So it starts over at the beginning behind a pad record
+		EXPECT(produce(producer, 1500, shm_record_kind::whole, 'd'));
+		EXPECT(consumer.peek(record, corrupt) && record.kind == shm_record_kind::pad);
+		consumer.next(record);
+		EXPECT(consume(consumer, 1500, shm_record_kind::whole, 'd'));
+
+		// A full ring takes nothing more until the consumer frees space
+		EXPECT(produce(producer, producer.max_piece(), shm_record_kind::whole, 'e'));
+		EXPECT(!producer.reserve(producer.max_piece(), shm_record_kind::whole));
+		EXPECT(!producer.wait_for_room());
+		EXPECT(consume(consumer, producer.max_piece(), shm_record_kind::whole, 'e'));
+		EXPECT(produce(producer, producer.max_piece(), shm_record_kind::whole, 'f'));
+		EXPECT(consumer.peek(record, corrupt) && record.kind == shm_record_kind::pad);
+		consumer.next(record);
+		EXPECT(consume(consumer, producer.max_piece(), shm_record_kind::whole, 'f'));
+
+		// A memory file that isn't sealed isn't taken as a ring
+		auto unsealed = ::memfd_create("unsealed", MFD_CLOEXEC);
+		EXPECT(unsealed >= 0 && ::ftruncate(unsealed, 0x2000) == 0);
+		shm_ring rejected;
+		error.clear();
+		EXPECT(!rejected.attach(unsealed, error) && error == boost::system::errc::invalid_argument);
+		::close(unsealed);
+	}
+
+	// Splits size bytes counting up from fill into fragments of at most 100 bytes
+	fragments_t fragment(uint32_t message_id, size_t size, char fill, buffer_pool& pool)
+	{
+		std::vector<char> bytes(size);
+		for (size_t i = 0; i < size; ++i)
+			bytes[i] = static_cast<char>(fill + i);
+		fragments_t fragments;
+		boost_messaging::detail::split_frame(boost_messaging::detail::make_frame(std::move(bytes)), message_id, 100, pool,
+			[&](std::vector<char>&& fragment) { fragments.push_back(std::move(fragment)); });
+		return fragments;
+	}
+
+	// Fragment with any header, whose payload is the message's bytes at its offset
+	std::vector<char> make_fragment(uint32_t total_size, uint32_t offset, uint16_t index, uint16_t count, size_t payload_size)
+	{
+		std::vector<char> fragment(boost_messaging::detail::FRAGMENT_HEADER_SIZE + payload_size);
+		boost_messaging::detail::write_fragment_header(fragment.data(), { 9, total_size, offset, index, count });
+		for (size_t i = 0; i < payload_size; ++i)
+			fragment[boost_messaging::detail::FRAGMENT_HEADER_SIZE + i] = static_cast<char>('g' + offset + i);
+		return fragment;
+	}
+
+	bool is_message(const std::vector<char>& message, size_t size, char fill)
+	{
+		if (message.size() != size)
+			return false;
+		for (size_t i = 0; i < size; ++i)
+		{
+			if (message[i] != static_cast<char>(fill + i))
+				return false;
+		}
+		return true;
+	}
+
+	void check_reassembly_table()
+	{
+		auto pool = std::make_shared<buffer_pool>();
+		boost::asio::ip::udp::endpoint sender(boost::asio::ip::address_v4::loopback(), 1000);
+		boost::asio::ip::udp::endpoint other(boost::asio::ip::address_v4::loopback(), 2000);
+		std::vector<char> message;
+
+		// Frames over 65535 fragments can't be split
+		EXPECT(boost_messaging::detail::max_fragmented_size(100) == 65535 * 83);
+		EXPECT(fragment(1, 65535 * 83 + 1, 'a', *pool).empty());
+		EXPECT(fragment(1, 250, 'a', *pool).size() == 4);
+
+		// Fragments complete a message in any order, duplicates are ignored
+		{
+			reassembly_table table(pool, 1000, std::chrono::seconds(60));
+			auto fragments = fragment(1, 250, 'a', *pool);
+			EXPECT(!table.add(sender, fragments[2].data(), fragments[2].size(), message));
+			EXPECT(!table.add(sender, fragments[0].data(), fragments[0].size(), message));
+			EXPECT(!table.add(sender, fragments[0].data(), fragments[0].size(), message));
+			// The same message id from another sender is another message
+			EXPECT(!table.add(other, fragments[1].data(), fragments[1].size(), message));
+			EXPECT(!table.add(sender, fragments[1].data(), fragments[1].size(), message));
+			EXPECT(table.add(sender, fragments[3].data(), fragments[3].size(), message));
+			EXPECT(is_message(message, 250, 'a'));
+
+			// Fragments that don't match the header of the first one are ignored
+			auto truncated = fragments[0];
+			truncated.resize(boost_messaging::detail::FRAGMENT_HEADER_SIZE - 1);
+			EXPECT(!table.add(sender, truncated.data(), truncated.size(), message));
+		}
+
+		// Partly received messages are dropped once they time out
+		{
+			reassembly_table table(pool, 1000, std::chrono::milliseconds(10));
+			auto fragments = fragment(2, 250, 'b', *pool);
+			EXPECT(!table.add(sender, fragments[0].data(), fragments[0].size(), message));
+			EXPECT(!table.add(sender, fragments[1].data(), fragments[1].size(), message));
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			EXPECT(!table.add(sender, fragments[2].data(), fragments[2].size(), message));
+			EXPECT(!table.add(sender, fragments[3].data(), fragments[3].size(), message));
+			// The late fragments started over, so the early ones complete it again
+			EXPECT(!table.add(sender, fragments[0].data(), fragments[0].size(), message));
+			EXPECT(table.add(sender, fragments[1].data(), fragments[1].size(), message));
+			EXPECT(is_message(message, 250, 'b'));
+		}
+
+		// Fragments that aren't where the sender's fragment size puts them are ignored, so no message completes with gaps
+		{
+			reassembly_table table(pool, 1000, std::chrono::seconds(60));
+			auto add = [&](const std::vector<char>& fragment) { return table.add(sender, fragment.data(), fragment.size(), message); };
+			EXPECT(!add(make_fragment(250, 50, 1, 3, 100)));
+			EXPECT(!add(make_fragment(250, 0, 0, 2, 100)));
+			EXPECT(!add(make_fragment(250, 150, 2, 3, 100)));
+			EXPECT(!add(make_fragment(250, 0, 0, 3, 100)));
+			// Overlapping the first fragment, or leaving a gap after it
+			EXPECT(!add(make_fragment(250, 50, 1, 3, 50)));
+			EXPECT(!add(make_fragment(250, 100, 1, 3, 50)));
+			EXPECT(!add(make_fragment(250, 200, 2, 3, 49)));
+			EXPECT(!add(make_fragment(250, 200, 2, 3, 50)));
+			EXPECT(add(make_fragment(250, 100, 1, 3, 100)));
+			EXPECT(is_message(message, 250, 'g'));
+
+			// The last fragment alone tells the fragment size too
+			EXPECT(!add(make_fragment(250, 201, 2, 3, 49)));
+			EXPECT(!add(make_fragment(250, 200, 2, 3, 50)));
+			EXPECT(!add(make_fragment(250, 0, 0, 3, 125)));
+			EXPECT(!add(make_fragment(250, 0, 0, 3, 99)));
+			EXPECT(!add(make_fragment(250, 100, 1, 3, 100)));
+			EXPECT(add(make_fragment(250, 0, 0, 3, 100)));
+			EXPECT(is_message(message, 250, 'g'));
+		}
+
+		// The oldest message makes room for a new one, messages over the limit are never started
+		{
+			reassembly_table table(pool, 500, std::chrono::seconds(60));
+			auto first = fragment(3, 250, 'c', *pool);
+			auto second = fragment(4, 250, 'd', *pool);
+			auto third = fragment(5, 250, 'e', *pool);
+			auto too_big = fragment(6, 501, 'f', *pool);
+			EXPECT(!table.add(sender, first[0].data(), first[0].size(), message));
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			EXPECT(!table.add(sender, second[0].data(), second[0].size(), message));
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			EXPECT(!table.add(sender, third[0].data(), third[0].size(), message));
+			EXPECT(!table.add(sender, too_big[0].data(), too_big[0].size(), message));
+
+			for (size_t i = 1; i < 4; ++i)
+				EXPECT(!table.add(sender, first[i].data(), first[i].size(), message));
+			for (size_t i = 1; i < 3; ++i)
+				EXPECT(!table.add(sender, third[i].data(), third[i].size(), message));
+			EXPECT(table.add(sender, third[3].data(), third[3].size(), message));
+			EXPECT(is_message(message, 250, 'e'));
+		}
+	}
+}
+
+int main()
+{
+	check_topic_index();
+	check_pod_serializer();
+	check_string_serializer();
+	check_topic_serializer();
+	check_frame_builder();
+	check_owned_message();
+	check_compressing_serializer();
+	check_compressed_batch();
+	check_mpsc_queue();
+	check_shm_ring();
+	check_reassembly_table();
+
+	if (failures != 0)
+	{
+		std::cerr << failures << " expectations failed" << std::endl;
+		return 1;
+	}
+	std::cout << "all checks passed" << std::endl;
+}
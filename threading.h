@@ -0,0 +1,104 @@
+/**
+@file threading.h
+@author Gary Heckman
+@brief Threading policies for clients, servers and their sessions.
+@detail
+	A threading policy decides how a session keeps its handlers from running
+	at the same time. It is picked at compile time so that single threaded
+	users don't pay for synchronization they don't need.
+*/
+
+#pragma once
+
+#include <type_traits>
+#include <utility>
+
+#include <boost/asio.hpp>
+
+namespace boost_messaging
+{
+    /**
+    Threading policy for an io_service that is run by a single thread.
+    Handlers already can't run at the same time, so nothing is synchronized.
+    This is the default.
+    */
+    struct single_threaded
+    {
+        /**
+        Posts and wraps handlers straight on the io_service.
+        */
+        class executor_t
+        {
+        public:
+            explicit executor_t(boost::asio::io_service& io_service) :
+                io_service_(io_service)
+            { }
+
+            /**
+            Runs a handler on the io_service.
+            @param [in] handler Function to run
+            */
+            template <typename THandler>
+            void post(THandler&& handler)
+            {
+                io_service_.post(std::forward<THandler>(handler));
+            }
+
+            /**
+            Leaves a completion handler as is.
+            @param [in] handler Completion handler
+            @return The same handler
+            */
+            template <typename THandler>
+            typename std::decay<THandler>::type wrap(THandler&& handler) const
+            {
+                return std::forward<THandler>(handler);
+            }
+
+        private:
+            boost::asio::io_service& io_service_;
+        };
+    };
+
+    /**
+    Threading policy for an io_service that is run by several threads.
+    Each session runs all of its handlers on its own strand.
+    */
+    struct multi_threaded
+    {
+        /**
+        Posts and wraps handlers on a strand so they never run at the same time.
+        */
+        class executor_t
+        {
+        public:
+            explicit executor_t(boost::asio::io_service& io_service) :
+                strand_(io_service)
+            { }
+
+            /**
+            Runs a handler on the strand.
+            @param [in] handler Function to run
+            */
+            template <typename THandler>
+            void post(THandler&& handler)
+            {
+                strand_.post(std::forward<THandler>(handler));
+            }
+
+            /**
+            Wraps a completion handler so it runs on the strand.
+            @param [in] handler Completion handler
+            @return Handler that dispatches through the strand
+            */
+            template <typename THandler>
+            auto wrap(THandler&& handler) -> decltype(std::declval<boost::asio::io_service::strand&>().wrap(std::forward<THandler>(handler)))
+            {
+                return strand_.wrap(std::forward<THandler>(handler));
+            }
+
+        private:
+            boost::asio::io_service::strand strand_;
+        };
+    };
+}
@@ -0,0 +1,214 @@
+/**
+@file udp_batch.h
+@author Gary Heckman
+@brief Batched datagram receives and sends.
+@detail
+	On Linux, recvmmsg and sendmmsg move many datagrams per system call.
+	Elsewhere udp_batch reports that it isn't supported and udp sessions
+	use a system call per datagram.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+namespace boost_messaging
+{
+    namespace detail
+    {
+#if defined(__linux__)
+        /**
+        Fixed size set of datagram headers for recvmmsg and sendmmsg.
+        Calls don't block; they fail with would_block when the socket isn't ready.
+        @tparam TProtocol Datagram protocol, like boost::asio::ip::udp or boost::asio::local::datagram_protocol
+        */
+        template <typename TProtocol = boost::asio::ip::udp>
+        class udp_batch
+        {
+        public:
+            static constexpr bool supported = true;
+
+            /**
+            Constructor.
+            @param [in] capacity Most datagrams moved by one call
+            */
+            explicit udp_batch(size_t capacity) :
+                headers_(capacity),
+                endpoints_(capacity),
+                size_(0)
+            { }
+
+            size_t capacity() const { return headers_.size(); }
+
+            size_t size() const { return size_; }
+
+            /**
+            Receives as many waiting datagrams as fit, each into its own slot of the buffer.
+            @param [in, out] socket    Socket to receive from
+            @param [out]     buffer    Start of capacity() slots
+            @param [in]      slot_size Size of each slot
+            @param [out]     error     Set if nothing could be received
+            @return Number of datagrams received
+            */
+            size_t receive(typename TProtocol::socket& socket, char* buffer, size_t slot_size, boost::system::error_code& error)
+            {
+                iovecs_.resize(capacity());
+                for (size_t i = 0; i < capacity(); ++i)
+                {
+                    iovecs_[i].iov_base = buffer + i * slot_size;
+                    iovecs_[i].iov_len = slot_size;
+                    headers_[i] = mmsghdr();
+                    headers_[i].msg_hdr.msg_name = endpoints_[i].data();
+                    headers_[i].msg_hdr.msg_namelen = static_cast<socklen_t>(endpoints_[i].capacity());
+                    headers_[i].msg_hdr.msg_iov = &iovecs_[i];
+                    headers_[i].msg_hdr.msg_iovlen = 1;
+                }
+
+                auto received = ::recvmmsg(socket.native_handle(), headers_.data(), static_cast<unsigned int>(capacity()), MSG_DONTWAIT, nullptr);
+                if (received < 0)
+                {
+                    error = last_error();
+                    return 0;
+                }
+
+                for (int i = 0; i < received; ++i)
+                    endpoints_[i].resize(headers_[i].msg_hdr.msg_namelen);
+                error = boost::system::error_code();
+                size_ = received;
+                return size_;
+            }
+
+            // Sender of a datagram from the last receive.
+            const typename TProtocol::endpoint& sender(size_t i) const { return endpoints_[i]; }
+
+            // Size of a datagram from the last receive.
+            size_t bytes(size_t i) const { return headers_[i].msg_len; }
+
+            void clear()
+            {
+                size_ = 0;
+                iovecs_.clear();
+            }
+
+            /**
+            Adds a datagram to the next send.
+            The buffers must stay alive until the send.
+            @param [in] buffers     Buffers gathered into the datagram
+            @param [in] destination Endpoint the datagram is sent to
+            @return False if the batch is full
+            */
+            bool add(const std::vector<boost::asio::const_buffer>& buffers, const typename TProtocol::endpoint& destination)
+            {
+                if (size_ == capacity())
+                    return false;
+
+                for (const auto& buffer : buffers)
+                {
+                    iovec entry;
+                    entry.iov_base = const_cast<void*>(buffer.data());
+                    entry.iov_len = buffer.size();
+                    iovecs_.push_back(entry);
+                }
+                endpoints_[size_] = destination;
+                headers_[size_] = mmsghdr();
+                headers_[size_].msg_hdr.msg_name = endpoints_[size_].data();
+                headers_[size_].msg_hdr.msg_namelen = static_cast<socklen_t>(endpoints_[size_].size());
+                headers_[size_].msg_hdr.msg_iovlen = buffers.size();
+                ++size_;
+                return true;
+            }
+
+            /**
+            Sends the added datagrams, in order.
+            @param [in, out] socket Socket to send on
+            @param [out]     error  Set if nothing could be sent
+            @return Number of datagrams sent from the front of the batch
+            */
+            size_t send(typename TProtocol::socket& socket, boost::system::error_code& error)
+            {
+                // Pointed at only now since adding may have moved the entries
+                size_t offset = 0;
+                for (size_t i = 0; i < size_; ++i)
+                {
+                    headers_[i].msg_hdr.msg_iov = iovecs_.data() + offset;
+                    offset += headers_[i].msg_hdr.msg_iovlen;
+                }
+
+                auto sent = ::sendmmsg(socket.native_handle(), headers_.data(), static_cast<unsigned int>(size_), MSG_DONTWAIT);
+                if (sent < 0)
+                {
+                    error = last_error();
+                    return 0;
+                }
+
+                error = boost::system::error_code();
+                return sent;
+            }
+
+        private:
+            std::vector<mmsghdr> headers_;
+            std::vector<iovec> iovecs_;
+            std::vector<typename TProtocol::endpoint> endpoints_;
+            size_t size_;
+
+            // Kernels without the calls report operation_not_supported so callers can fall back.
+            static boost::system::error_code last_error()
+            {
+                if (errno == ENOSYS)
+                    return boost::asio::error::operation_not_supported;
+                return boost::system::error_code(errno, boost::asio::error::get_system_category());
+            }
+        };
+#else
+        /**
+        Stand-in for platforms without recvmmsg and sendmmsg.
+        Every call fails with operation_not_supported.
+        @tparam TProtocol Datagram protocol, like boost::asio::ip::udp or boost::asio::local::datagram_protocol
+        */
+        template <typename TProtocol = boost::asio::ip::udp>
+        class udp_batch
+        {
+        public:
+            static constexpr bool supported = false;
+
+            explicit udp_batch(size_t) { }
+
+            size_t capacity() const { return 1; }
+
+            size_t size() const { return 0; }
+
+            size_t receive(typename TProtocol::socket&, char*, size_t, boost::system::error_code& error)
+            {
+                error = boost::asio::error::operation_not_supported;
+                return 0;
+            }
+
+            const typename TProtocol::endpoint& sender(size_t) const { return endpoint_; }
+
+            size_t bytes(size_t) const { return 0; }
+
+            void clear() { }
+
+            bool add(const std::vector<boost::asio::const_buffer>&, const typename TProtocol::endpoint&) { return false; }
+
+            size_t send(typename TProtocol::socket&, boost::system::error_code& error)
+            {
+                error = boost::asio::error::operation_not_supported;
+                return 0;
+            }
+
+        private:
+            typename TProtocol::endpoint endpoint_;
+        };
+#endif
+    }
+}
@@ -1,10 +1,23 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
+#include <functional>
 #include <memory>
-#include <queue>
+#include <utility>
 #include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/optional.hpp>
+
+#include "backpressure.h"
+#include "comm_options.h"
+#include "frame.h"
+#include "handler_traits.h"
+#include "metrics.h"
+#include "threading.h"
+#include "udp_batch.h"
+#include "udp_fragments.h"
 
 using namespace boost::asio;
 
@@ -12,39 +25,143 @@ namespace boost_messaging
 {
     namespace detail
     {
-        template <typename TSerializer, typename THandler>
-        class udp_comm : public std::enable_shared_from_this<udp_comm<TSerializer, THandler>>
+        template <typename TSerializer, typename THandler, typename TThreading = single_threaded, typename TProtocol = ip::udp>
+        class udp_comm : public std::enable_shared_from_this<udp_comm<TSerializer, THandler, TThreading, TProtocol>>
         {
         public:
-            typedef ip::udp::socket socket_t;
+            typedef typename TProtocol::socket socket_t;
+            typedef typename TProtocol::endpoint endpoint_t;
             typedef typename TSerializer::send_t send_t;
             typedef typename TSerializer::recv_t recv_t;
             typedef typename std::function<void(const boost::system::error_code& error)> error_callback_t;
+            typedef typename TThreading::executor_t executor_t;
 
             const int BUFFER_SIZE = 0x4000;
 
-            udp_comm(io_service& io_service, socket_t&& socket) :
+            /**
+            Constructor.
+            @param [in, out] io_service   Facilitates async operations
+            @param [in]      socket       Socket of the session
+            @param [in]      options      Tunable settings for the session
+            @param [in]      handler_args Arguments for the handler's constructor, usually none or a handler to copy
+            */
+            template <typename... THandlerArgs>
+            udp_comm(io_service& io_service, socket_t&& socket, const comm_options& options = comm_options(), THandlerArgs&&... handler_args) :
                 io_service_(io_service),
+                id_(next_session_id()),
+                executor_(io_service),
                 socket_(std::move(socket)),
+                options_(options),
+                pool_(options.pool ? options.pool : buffer_pool::shared(io_service)),
                 serializer_(),
-                handler_(),
-                read_buffer_(BUFFER_SIZE)
+                handler_(std::forward<THandlerArgs>(handler_args)...),
+                batching_(udp_batch<TProtocol>::supported && options.udp_batch_size > 1),
+                fragmenting_(options.udp_fragmentation),
+                datagram_size_(std::max(options.udp_mtu ? options.udp_mtu : DEFAULT_UDP_MTU, FRAGMENT_HEADER_SIZE + 1)),
+                // Nothing bigger than the mtu arrives once messages are fragmented
+                read_slot_size_(fragmenting_ ? datagram_size_ : BUFFER_SIZE),
+                // As many slots as fit in read_buffer_size, so the batch doesn't multiply the memory of every session
+                read_batch_(std::max<size_t>(1, std::min(options.udp_batch_size, options.read_buffer_size / read_slot_size_))),
+                write_batch_(options.udp_batch_size),
+                read_buffer_(pool_->acquire(read_slot_size_ * (batching_ ? read_batch_.capacity() : 1))),
+                frame_builder_(pool_),
+                frames_in_flight_(0),
+                next_message_id_(0),
+                reassembly_(pool_, options.udp_reassembly_bytes, options.udp_reassembly_timeout),
+                limiter_(options.write_limits, id_)
             {}
 
+            ~udp_comm()
+            {
+                pool_->release(std::move(read_buffer_));
+                for (auto& queued : write_queue_)
+                    frame_builder_.recycle(queued.payload);
+            }
+
             void read()
             {
-                auto callback = [this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t) { read_msg(error); };
-                socket_.async_receive_from(boost::asio::buffer(read_buffer_), endpoint_, callback);
+                if (batching_)
+                    wait_read();
+                else
+                    receive_one();
+            }
+
+            // Every write returns false if the write queue's limits kept the message out,
+            // and frame writes also if the frame is too big to fragment.
+            bool write(const send_t& message)
+            {
+                return write(send_t(message));
+            }
+
+            bool write(send_t&& message)
+            {
+                return post_write(std::move(message), boost::none);
+            }
+
+            // Queues bytes that were already serialized, they are written as is.
+            bool write_frame(std::vector<char>&& serialized)
+            {
+                return post_write(std::move(serialized), boost::none);
+            }
+
+            // Queues bytes that are shared with other writes, they are never copied.
+            bool write_shared(shared_frame serialized)
+            {
+                return post_write(std::move(serialized), boost::none);
+            }
+
+            // Writes accepted before the session existed go in past the write queue's limits.
+            void write_accepted(send_t&& message)
+            {
+                post_write(std::move(message), boost::none, true);
             }
 
-            void write(const send_t& message)
+            void write_frame_accepted(std::vector<char>&& serialized)
             {
-                io_service_.post([this, message] { enter_write_loop(message); });
+                post_write(std::move(serialized), boost::none, true);
+            }
+
+            // The overloads below send to the given endpoint instead of the remote endpoint.
+            bool write(const send_t& message, const endpoint_t& endpoint)
+            {
+                return write(send_t(message), endpoint);
+            }
+
+            bool write(send_t&& message, const endpoint_t& endpoint)
+            {
+                return post_write(std::move(message), endpoint);
+            }
+
+            bool write_frame(std::vector<char>&& serialized, const endpoint_t& endpoint)
+            {
+                return post_write(std::move(serialized), endpoint);
+            }
+
+            bool write_shared(shared_frame serialized, const endpoint_t& endpoint)
+            {
+                return post_write(std::move(serialized), endpoint);
             }
 
             inline socket_t& socket() { return socket_; }
 
-            inline void set_remote_endpoint(const ip::udp::endpoint& endpoint) { endpoint_ = endpoint; }
+            inline session_id_t id() const { return id_; }
+
+            // Counters may be read from any thread.
+            inline const session_metrics& metrics() const { return metrics_; }
+
+            // Anything outside the session that shares its state must run its handlers through here.
+            inline executor_t& executor() { return executor_; }
+
+            void close()
+            {
+                executor_.post([this, sp = this->shared_from_this()] { socket_.close(); });
+            }
+
+            // Posted so that it takes effect between the writes queued before and after it.
+            void set_remote_endpoint(const endpoint_t& endpoint)
+            {
+                executor_.post([this, sp = this->shared_from_this(), endpoint] { endpoint_ = endpoint; });
+            }
 
             void set_error_callback(const error_callback_t& error_callback)
             {
@@ -52,57 +169,407 @@ namespace boost_messaging
             }
 
         private:
+            struct datagram
+            {
+                frame payload;
+                endpoint_t destination;
+                // Fragments are complete datagrams and are never packed with other frames
+                bool fragment;
+                // False on every fragment but the first and the last, so a message is counted, and dropped, whole
+                bool starts_message;
+                bool ends_message;
+            };
+
             io_service & io_service_;
+            const session_id_t id_;
+            executor_t executor_;
             socket_t socket_;
+            comm_options options_;
+            std::shared_ptr<buffer_pool> pool_;
             TSerializer serializer_;
             THandler handler_;
+            message_delivery<THandler, recv_t> delivery_;
+            // Cleared for good if the kernel turns out not to have the batch calls
+            bool batching_;
+            bool fragmenting_;
+            size_t datagram_size_;
+            size_t read_slot_size_;
+            udp_batch<TProtocol> read_batch_;
+            udp_batch<TProtocol> write_batch_;
             std::vector<char> read_buffer_;
-            std::queue<std::vector<char>> write_queue_;
-            ip::udp::endpoint endpoint_;
+            frame_builder<TSerializer> frame_builder_;
+            std::deque<datagram> write_queue_;
+            std::vector<const_buffer> write_buffers_;
+            size_t frames_in_flight_;
+            // Frames packed into each datagram of the batch being sent
+            std::vector<size_t> datagram_frames_;
+            uint32_t next_message_id_;
+            reassembly_table<endpoint_t> reassembly_;
+            write_limiter limiter_;
+            session_metrics metrics_;
+            endpoint_t endpoint_;
+            endpoint_t sender_endpoint_;
             error_callback_t error_callback_;
 
-            void read_msg(const boost::system::error_code& error)
+            // Writers blocked on a full queue are let go since it won't drain any more.
+            void fail(const boost::system::error_code& error)
+            {
+                limiter_.shut_down();
+                if (error_callback_)
+                    error_callback_(error);
+            }
+
+            void receive_one()
+            {
+                auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t bytes_read) { read_msg(error, bytes_read); });
+                socket_.async_receive_from(boost::asio::buffer(read_buffer_.data(), read_slot_size_), sender_endpoint_, callback);
+            }
+
+            void read_msg(const boost::system::error_code& error, size_t bytes_read)
             {
                 if (!error)
                 {
-                    auto header_size = serializer_.header_size();
-                    auto body_begin = read_buffer_.begin() + header_size;
-                    auto header_is_valid = serializer_.validate_header(read_buffer_.begin(), body_begin);
-                    auto body_size = serializer_.body_size(read_buffer_.begin(), body_begin);
-                    auto body_end = body_begin + body_size;
-                    auto message = serializer_.deserialize(body_begin, body_end);
-                    handler_.handle(message);
-                    auto callback = [this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t) { read_msg(error); };
-                    socket_.async_receive_from(boost::asio::buffer(read_buffer_), endpoint_, callback);
+                    handle_datagram(read_buffer_.data(), bytes_read);
+                    delivery_.flush(handler_, metrics_);
+                    receive_one();
                 }
                 else
-                    error_callback_(error);
+                    fail(error);
+            }
+
+            // The socket is only waited on; the datagrams are taken in batches once it is readable.
+            void wait_read()
+            {
+                auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error) { read_batch(error); });
+                socket_.async_wait(socket_base::wait_read, callback);
+            }
+
+            // A buffer that came back full is filled again at once, up to udp_batch_size datagrams per wait.
+            void read_batch(const boost::system::error_code& wait_error)
+            {
+                boost::system::error_code error = wait_error;
+                size_t handled = 0;
+                while (!error)
+                {
+                    auto received = read_batch_.receive(socket_, read_buffer_.data(), read_slot_size_, error);
+                    if (error)
+                        break;
+
+                    for (size_t i = 0; i < received; ++i)
+                    {
+                        sender_endpoint_ = read_batch_.sender(i);
+                        handle_datagram(read_buffer_.data() + i * read_slot_size_, read_batch_.bytes(i));
+                    }
+                    delivery_.flush(handler_, metrics_);
+
+                    handled += received;
+                    if (received < read_batch_.capacity() || handled >= options_.udp_batch_size)
+                    {
+                        wait_read();
+                        return;
+                    }
+                }
+
+                if (error == boost::asio::error::would_block)
+                    wait_read();
+                else if (error == boost::asio::error::operation_not_supported)
+                {
+                    batching_ = false;
+                    receive_one();
+                }
+                else
+                    fail(error);
+            }
+
+            void handle_datagram(const char* begin, size_t bytes_read)
+            {
+                if (!fragmenting_)
+                    handle_frames(begin, bytes_read);
+                else if (bytes_read != 0 && *begin == WHOLE_DATAGRAM)
+                    handle_frames(begin + 1, bytes_read - 1);
+                else
+                {
+                    std::vector<char> message;
+                    if (reassembly_.add(sender_endpoint_, begin, bytes_read, message))
+                    {
+                        handle_frames(message.data(), message.size());
+                        // Batched messages may point into the reassembled message
+                        delivery_.flush(handler_, metrics_);
+                        pool_->release(std::move(message));
+                    }
+                }
             }
 
-            void enter_write_loop(const send_t& message)
+            // A datagram holds one frame, or several when the sender packs them.
+            // Anything from an invalid, malformed or cut off frame on is dropped.
+            void handle_frames(const char* begin, size_t bytes_read)
+            {
+                auto header_size = serializer_.header_size();
+                const char* end = begin + bytes_read;
+                for (const char* header_begin = begin; static_cast<size_t>(end - header_begin) >= header_size;)
+                {
+                    const char* body_begin = header_begin + header_size;
+                    if (!serializer_.validate_header(header_begin, body_begin))
+                        break;
+
+                    auto body_size = serializer_.body_size(header_begin, body_begin);
+                    if (body_size > static_cast<size_t>(end - body_begin))
+                        break;
+
+                    auto body_end = body_begin + body_size;
+                    metrics_.received(header_size + body_size);
+                    if (!deserialize_body(serializer_, body_begin, body_end, [this](recv_t&& message) { delivery_.deliver(handler_, metrics_, std::move(message)); }))
+                        break;
+
+                    header_begin = body_end;
+                }
+            }
+
+            // Serialization happens on the session's executor since the serializer belongs to the session.
+            // Writes without an endpoint pick up the remote endpoint there too, after any earlier change to it.
+            template <typename TMessage>
+            bool post_write(TMessage&& message, const boost::optional<endpoint_t>& endpoint, bool accepted = false)
+            {
+                if (too_large(message))
+                    return false;
+
+                auto admission = accepted ? limiter_.admit_anyway() : limiter_.admit();
+                if (admission == write_limiter::disconnect)
+                    close();
+                if (admission != write_limiter::admitted)
+                    return false;
+
+                executor_.post([this, sp = this->shared_from_this(), message = std::move(message), endpoint]() mutable
+                {
+                    enter_write_loop(to_frame(std::move(message)), endpoint ? *endpoint : endpoint_);
+                });
+                return true;
+            }
+
+            frame to_frame(send_t&& message) { return frame_builder_.make(serializer_, std::move(message)); }
+            frame to_frame(std::vector<char>&& serialized) { return make_frame(std::move(serialized)); }
+            frame to_frame(shared_frame&& serialized) { return make_frame(serialized); }
+
+            // Serialized frames too big to fragment are refused up front; messages are only sized once they are serialized.
+            bool too_large(const send_t&) const { return false; }
+            bool too_large(const std::vector<char>& serialized) const { return too_large(serialized.size()); }
+            bool too_large(const shared_frame& serialized) const { return too_large(serialized->size()); }
+            bool too_large(size_t size) const { return fragmenting_ && size > max_fragmented_size(datagram_size_); }
+
+            void enter_write_loop(frame&& new_frame, const endpoint_t& destination)
             {
                 auto writing = !write_queue_.empty();
-                write_queue_.push(serializer_.serialize(message));
-                if (!writing)
+                auto queue_size = write_queue_.size();
+                size_t bytes = 0;
+                if (too_large(new_frame.size()))
+                {
+                    frame_builder_.recycle(new_frame);
+                    limiter_.rejected();
+                    return;
+                }
+                else if (fragmenting_ && new_frame.size() + 1 > datagram_size_)
+                {
+                    auto push_fragment = [&](std::vector<char>&& fragment)
+                    {
+                        bytes += fragment.size();
+                        write_queue_.push_back(datagram{ make_frame(std::move(fragment)), destination, true, write_queue_.size() == queue_size, false });
+                    };
+                    split_frame(new_frame, next_message_id_++, datagram_size_, *pool_, push_fragment);
+                    write_queue_.back().ends_message = true;
+                    frame_builder_.recycle(new_frame);
+                }
+                else if (limiter_.backpressured() && limiter_.policy() == overflow_policy::conflate && conflate(new_frame, destination))
+                    return;
+                else
                 {
-                    auto callback = [this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t) { write_loop(error); };
-                    socket_.async_send_to(boost::asio::buffer(write_queue_.front()), endpoint_, callback);
+                    bytes = new_frame.size();
+                    write_queue_.push_back(datagram{ std::move(new_frame), destination, false, true, true });
                 }
+
+                limiter_.queued(bytes);
+                drop_overflow();
+                metrics_.write_queue_depth(write_queue_.size());
+                if (writing || write_queue_.empty())
+                    return;
+
+                // Posted so that the writes already waiting on the executor join the batch
+                if (batching_)
+                    executor_.post([this, sp = this->shared_from_this()] { send_batches(); });
+                else
+                    send_front();
+            }
+
+            // Puts the new frame in the place of a waiting one for the same destination with the same conflation key.
+            bool conflate(frame& new_frame, const endpoint_t& destination)
+            {
+                uint64_t new_key;
+                if (!limiter_.key(new_frame, serializer_.header_size(), new_key))
+                    return false;
+
+                for (auto i = frames_in_flight_; i < write_queue_.size(); ++i)
+                {
+                    auto& queued = write_queue_[i];
+                    uint64_t key;
+                    if (!queued.fragment && queued.destination == destination && limiter_.key(queued.payload, serializer_.header_size(), key) && key == new_key)
+                    {
+                        limiter_.replaced(queued.payload.size(), new_frame.size());
+                        frame_builder_.recycle(queued.payload);
+                        queued.payload = std::move(new_frame);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // Drops the oldest messages that haven't started going out while the queue is over its limits.
+            // A fragmented message is dropped whole, and the newest message is always kept.
+            void drop_overflow()
+            {
+                if (limiter_.policy() != overflow_policy::drop_oldest && limiter_.policy() != overflow_policy::conflate)
+                    return;
+
+                while (limiter_.over_limit())
+                {
+                    // The rest of a message whose first fragments were sent still goes out
+                    auto first = write_queue_.begin() + frames_in_flight_;
+                    while (first != write_queue_.end() && !first->starts_message)
+                        ++first;
+
+                    auto last = first;
+                    while (last != write_queue_.end() && !last->ends_message)
+                        ++last;
+                    if (last == write_queue_.end() || last + 1 == write_queue_.end())
+                        return;
+
+                    size_t bytes = 0;
+                    for (auto it = first; it != last + 1; ++it)
+                    {
+                        bytes += it->payload.size();
+                        frame_builder_.recycle(it->payload);
+                    }
+                    write_queue_.erase(first, last + 1);
+                    limiter_.dropped(bytes);
+                }
+            }
+
+            // Sends one batch per system call, yielding to the executor between batches.
+            void send_batches()
+            {
+                if (!batching_)
+                {
+                    send_front();
+                    return;
+                }
+
+                write_batch_.clear();
+                datagram_frames_.clear();
+                for (auto it = write_queue_.begin(); it != write_queue_.end() && datagram_frames_.size() < write_batch_.capacity(); it += datagram_frames_.back())
+                {
+                    datagram_frames_.push_back(gather(it));
+                    write_batch_.add(write_buffers_, it->destination);
+                }
+
+                boost::system::error_code error;
+                auto sent = write_batch_.send(socket_, error);
+                if (error == boost::asio::error::would_block)
+                {
+                    auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error)
+                    {
+                        if (!error)
+                            send_batches();
+                        else
+                            fail(error);
+                    });
+                    socket_.async_wait(socket_base::wait_write, callback);
+                    return;
+                }
+                else if (error == boost::asio::error::operation_not_supported)
+                {
+                    batching_ = false;
+                    send_front();
+                    return;
+                }
+                else if (error)
+                {
+                    fail(error);
+                    return;
+                }
+
+                for (size_t i = 0; i < sent; ++i)
+                    pop_frames(datagram_frames_[i]);
+
+                if (!write_queue_.empty())
+                    executor_.post([this, sp = this->shared_from_this()] { send_batches(); });
+            }
+
+            // Gathers the frames that go out in the datagram starting at first into write_buffers_.
+            // With packing on, the frames after it join while they go to the same destination and fit in the mtu.
+            // At least one frame is always taken, even if it is larger than the mtu.
+            size_t gather(typename std::deque<datagram>::const_iterator first)
+            {
+                size_t frames = 0;
+                size_t bytes = 0;
+                write_buffers_.clear();
+                if (fragmenting_ && !first->fragment)
+                {
+                    write_buffers_.push_back(boost::asio::buffer(&WHOLE_DATAGRAM, 1));
+                    ++bytes;
+                }
+
+                for (auto it = first; it != write_queue_.end(); ++it)
+                {
+                    const auto& queued = it->payload;
+                    auto has_data = !queued.data.empty();
+                    auto has_body = buffer_size(queued.body) != 0;
+                    auto buffer_count = write_buffers_.size() + has_data + has_body;
+                    if (frames != 0 && (options_.udp_mtu == 0 || first->fragment || it->fragment || it->destination != first->destination ||
+                        buffer_count > options_.max_write_buffers || bytes + queued.size() > options_.udp_mtu))
+                        break;
+
+                    if (has_data)
+                        write_buffers_.push_back(boost::asio::buffer(queued.data));
+                    if (has_body)
+                        write_buffers_.push_back(queued.body);
+                    bytes += queued.size();
+                    ++frames;
+                }
+                return frames;
+            }
+
+            void pop_frames(size_t count)
+            {
+                size_t messages = 0;
+                size_t bytes = 0;
+                for (; count > 0; --count)
+                {
+                    messages += write_queue_.front().ends_message;
+                    bytes += write_queue_.front().payload.size();
+                    limiter_.dequeued(write_queue_.front().payload.size(), write_queue_.front().ends_message);
+                    frame_builder_.recycle(write_queue_.front().payload);
+                    write_queue_.pop_front();
+                }
+                metrics_.sent(messages, bytes);
+                metrics_.write_queue_depth(write_queue_.size());
+            }
+
+            void send_front()
+            {
+                frames_in_flight_ = gather(write_queue_.begin());
+                auto callback = executor_.wrap([this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t) { write_loop(error); });
+                socket_.async_send_to(write_buffers_, write_queue_.front().destination, callback);
             }
 
             void write_loop(const boost::system::error_code& error)
             {
                 if (!error)
                 {
-                    write_queue_.pop();
+                    pop_frames(frames_in_flight_);
+                    frames_in_flight_ = 0;
                     if (!write_queue_.empty())
-                    {
-                        auto callback = [this, sp = this->shared_from_this()](const boost::system::error_code& error, size_t) { write_loop(error); };
-                        socket_.async_send_to(boost::asio::buffer(write_queue_.front()), endpoint_, callback);
-                    }
+                        send_front();
                 }
                 else
-                    error_callback_(error);
+                    fail(error);
             }
         };
     }
@@ -0,0 +1,318 @@
+/**
+@file udp_fragments.h
+@author Gary Heckman
+@brief Splitting udp messages into fragments and putting them back together.
+@detail
+	When fragmentation is on, every datagram starts with a kind byte.
+	Whole datagrams hold one or more frames after it. Fragments carry the rest of
+	the fragment header, big endian, followed by a slice of a single frame:
+		kind (1) | message id (4) | total size (4) | offset (4) | index (2) | count (2)
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "buffer_pool.h"
+#include "frame.h"
+
+namespace boost_messaging
+{
+    namespace detail
+    {
+        const size_t DEFAULT_UDP_MTU = 1472;
+        const char WHOLE_DATAGRAM = 0;
+        const char FRAGMENT_DATAGRAM = 1;
+        const size_t FRAGMENT_HEADER_SIZE = 17;
+
+        /**
+        Position of a fragment within its message.
+        */
+        struct fragment_header
+        {
+            uint32_t message_id;
+            uint32_t total_size;
+            uint32_t offset;
+            uint16_t index;
+            uint16_t count;
+        };
+
+        inline void put_big_endian(char* out, uint32_t value, size_t bytes)
+        {
+            for (size_t i = 0; i < bytes; ++i)
+                out[i] = static_cast<char>(value >> (8 * (bytes - 1 - i)));
+        }
+
+        inline uint32_t get_big_endian(const char* in, size_t bytes)
+        {
+            uint32_t value = 0;
+            for (size_t i = 0; i < bytes; ++i)
+                value = (value << 8) | static_cast<unsigned char>(in[i]);
+            return value;
+        }
+
+        inline void write_fragment_header(char* out, const fragment_header& header)
+        {
+            out[0] = FRAGMENT_DATAGRAM;
+            put_big_endian(out + 1, header.message_id, 4);
+            put_big_endian(out + 5, header.total_size, 4);
+            put_big_endian(out + 9, header.offset, 4);
+            put_big_endian(out + 13, header.index, 2);
+            put_big_endian(out + 15, header.count, 2);
+        }
+
+        inline bool read_fragment_header(const char* in, size_t size, fragment_header& header)
+        {
+            if (size < FRAGMENT_HEADER_SIZE || in[0] != FRAGMENT_DATAGRAM)
+                return false;
+
+            header.message_id = get_big_endian(in + 1, 4);
+            header.total_size = get_big_endian(in + 5, 4);
+            header.offset = get_big_endian(in + 9, 4);
+            header.index = static_cast<uint16_t>(get_big_endian(in + 13, 2));
+            header.count = static_cast<uint16_t>(get_big_endian(in + 15, 2));
+            return true;
+        }
+
+        /**
+        Copies part of a frame's wire bytes, which may span its data and its body.
+        @param [in]  source Frame to copy from
+        @param [in]  offset Offset of the first byte to copy
+        @param [in]  size   Number of bytes to copy
+        @param [out] out    Destination of the bytes
+        */
+        inline void copy_frame_bytes(const frame& source, size_t offset, size_t size, char* out)
+        {
+            if (offset < source.data.size())
+            {
+                auto from_data = std::min(size, source.data.size() - offset);
+                out = std::copy(source.data.begin() + offset, source.data.begin() + offset + from_data, out);
+                size -= from_data;
+                offset = 0;
+            }
+            else
+                offset -= source.data.size();
+
+            const char* body = static_cast<const char*>(source.body.data());
+            std::copy(body + offset, body + offset + size, out);
+        }
+
+        /**
+        Largest frame split_frame can split.
+        @param [in] max_datagram_size Size of the largest fragment, header included
+        */
+        inline size_t max_fragmented_size(size_t max_datagram_size)
+        {
+            return std::min<size_t>(UINT16_MAX * (max_datagram_size - FRAGMENT_HEADER_SIZE), UINT32_MAX);
+        }
+
+        /**
+        Splits a frame into fragment datagrams.
+        @param [in]      whole             Frame to split
+        @param [in]      message_id        Id shared by the fragments, unique per sender for a while
+        @param [in]      max_datagram_size Size of the largest fragment, header included
+        @param [in, out] pool              Pool the fragments are taken from
+        @param [in]      emit              Called with a std::vector<char>&& for each fragment, in order
+        @return False if the frame is bigger than max_fragmented_size, in which case nothing was emitted
+        */
+        template <typename TEmit>
+        bool split_frame(const frame& whole, uint32_t message_id, size_t max_datagram_size, buffer_pool& pool, TEmit&& emit)
+        {
+            auto total_size = whole.size();
+            if (total_size > max_fragmented_size(max_datagram_size))
+                return false;
+
+            auto chunk_size = max_datagram_size - FRAGMENT_HEADER_SIZE;
+            auto count = (total_size + chunk_size - 1) / chunk_size;
+
+            fragment_header header;
+            header.message_id = message_id;
+            header.total_size = static_cast<uint32_t>(total_size);
+            header.count = static_cast<uint16_t>(count);
+            for (size_t index = 0; index < count; ++index)
+            {
+                auto offset = index * chunk_size;
+                auto size = std::min(chunk_size, total_size - offset);
+                header.offset = static_cast<uint32_t>(offset);
+                header.index = static_cast<uint16_t>(index);
+
+                auto fragment = pool.acquire(FRAGMENT_HEADER_SIZE + size);
+                write_fragment_header(fragment.data(), header);
+                copy_frame_bytes(whole, offset, size, fragment.data() + FRAGMENT_HEADER_SIZE);
+                emit(std::move(fragment));
+            }
+            return true;
+        }
+
+        /**
+        Partly received messages, keyed by sender and message id.
+        Memory is bounded: messages older than the timeout are dropped whenever a fragment arrives,
+        and the oldest messages are dropped to make room for new ones. Messages are also kept in the
+        order they were started, so both only look at the oldest ones.
+        Every fragment must sit where the sender's fragment size puts it, so a complete message has no gaps or overlaps.
+        @tparam TEndpoint Endpoint type of the datagram socket
+        */
+        template <typename TEndpoint = boost::asio::ip::udp::endpoint>
+        class reassembly_table
+        {
+        public:
+            typedef std::chrono::steady_clock clock_t;
+
+            /**
+            Constructor.
+            @param [in] pool      Pool the message buffers are taken from
+            @param [in] max_bytes Most bytes held in partly received messages
+            @param [in] timeout   How long a partly received message is kept
+            */
+            reassembly_table(std::shared_ptr<buffer_pool> pool, size_t max_bytes, clock_t::duration timeout) :
+                pool_(std::move(pool)),
+                max_bytes_(max_bytes),
+                timeout_(timeout),
+                bytes_(0)
+            { }
+
+            ~reassembly_table()
+            {
+                for (auto& pending : pending_)
+                    pool_->release(std::move(pending.second.data));
+            }
+
+            /**
+            Adds a fragment datagram.
+            Invalid, misplaced, duplicate and oversized fragments are ignored.
+            @param [in]  sender   Endpoint the fragment came from
+            @param [in]  datagram Fragment header and payload
+            @param [in]  size     Size of the datagram
+            @param [out] message  Set to the whole frame, taken from the pool, when this fragment completes it
+            @return True if the message is complete
+            */
+            bool add(const TEndpoint& sender, const char* datagram, size_t size, std::vector<char>& message)
+            {
+                fragment_header header;
+                if (!read_fragment_header(datagram, size, header))
+                    return false;
+
+                auto payload_size = size - FRAGMENT_HEADER_SIZE;
+                size_t chunk_size;
+                if (header.index >= header.count || header.offset > header.total_size || payload_size > header.total_size - header.offset ||
+                    !find_chunk_size(header, payload_size, chunk_size))
+                    return false;
+
+                auto now = clock_t::now();
+                expire(now);
+
+                auto key = std::make_pair(sender, header.message_id);
+                auto it = pending_.find(key);
+                if (it == pending_.end())
+                {
+                    if (header.total_size > max_bytes_)
+                        return false;
+                    while (bytes_ + header.total_size > max_bytes_)
+                        drop_oldest();
+
+                    pending_message pending;
+                    pending.data = pool_->acquire(header.total_size);
+                    pending.size = header.total_size;
+                    pending.chunk_size = chunk_size;
+                    pending.received.assign(header.count, false);
+                    pending.remaining = header.count;
+                    pending.started = now;
+                    pending.position = order_.insert(order_.end(), key);
+                    bytes_ += header.total_size;
+                    it = pending_.emplace(key, std::move(pending)).first;
+                }
+                else if (it->second.data.size() != header.total_size || it->second.received.size() != header.count || it->second.chunk_size != chunk_size)
+                    return false;
+
+                auto& pending = it->second;
+                if (pending.received[header.index])
+                    return false;
+
+                const char* payload = datagram + FRAGMENT_HEADER_SIZE;
+                std::copy(payload, payload + payload_size, pending.data.begin() + header.offset);
+                pending.received[header.index] = true;
+                if (--pending.remaining != 0)
+                    return false;
+
+                message = std::move(pending.data);
+                erase(it);
+                return true;
+            }
+
+        private:
+            typedef std::pair<TEndpoint, uint32_t> key_t;
+            // Keys from the oldest message to the newest
+            typedef std::list<key_t> order_t;
+
+            struct pending_message
+            {
+                std::vector<char> data;
+                size_t size;
+                size_t chunk_size;
+                std::vector<bool> received;
+                size_t remaining;
+                clock_t::time_point started;
+                typename order_t::iterator position;
+            };
+
+            typedef std::map<key_t, pending_message> pending_map_t;
+
+            std::shared_ptr<buffer_pool> pool_;
+            size_t max_bytes_;
+            clock_t::duration timeout_;
+            size_t bytes_;
+            pending_map_t pending_;
+            order_t order_;
+
+            // Works the sender's fragment size out from one fragment, which every other fragment of the message must agree with.
+            // Fails if the fragment isn't where that size puts it, or the size doesn't give the fragment count.
+            static bool find_chunk_size(const fragment_header& header, size_t payload_size, size_t& chunk_size)
+            {
+                size_t last = header.count - 1u;
+                if (header.index < last || last == 0)
+                    chunk_size = payload_size;
+                else if (header.offset % last == 0)
+                    chunk_size = header.offset / last;
+                else
+                    return false;
+
+                if (chunk_size == 0 || header.offset != header.index * chunk_size || header.count != (header.total_size + chunk_size - 1) / chunk_size)
+                    return false;
+                return header.index != last || header.offset + payload_size == header.total_size;
+            }
+
+            void erase(typename pending_map_t::iterator it)
+            {
+                bytes_ -= it->second.size;
+                pool_->release(std::move(it->second.data));
+                order_.erase(it->second.position);
+                pending_.erase(it);
+            }
+
+            void expire(clock_t::time_point now)
+            {
+                while (!order_.empty())
+                {
+                    auto oldest = pending_.find(order_.front());
+                    if (now - oldest->second.started <= timeout_)
+                        return;
+                    erase(oldest);
+                }
+            }
+
+            void drop_oldest()
+            {
+                erase(pending_.find(order_.front()));
+            }
+        };
+    }
+}